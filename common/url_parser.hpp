@@ -0,0 +1,198 @@
+#ifndef URL_PARSER_H
+#define URL_PARSER_H
+
+#include <cstdint>
+#include <cstring>
+#include <boost/beast/core/string.hpp>
+#include <boost/container/small_vector.hpp>
+#include <boost/optional.hpp>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace kkurl
+{
+
+//返回 [p, end) 中第一个 & = % + 的位置, 没有时返回 end
+inline const char* find_query_special(const char* p, const char* end) noexcept
+{
+#if defined(__SSE2__)
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i eq = _mm_set1_epi8('=');
+    const __m128i pct = _mm_set1_epi8('%');
+    const __m128i plus = _mm_set1_epi8('+');
+    while(end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, eq)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, plus)));
+        int mask = _mm_movemask_epi8(m);
+        if(mask)
+            return p + __builtin_ctz(static_cast<unsigned>(mask));
+        p += 16;
+    }
+#endif
+    for(; p < end; ++p)
+    {
+        char c = *p;
+        if(c == '&' || c == '=' || c == '%' || c == '+')
+            return p;
+    }
+    return end;
+}
+
+inline int hex_value(char c) noexcept
+{
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+//根据完整url获取 不带参数的url与参数字符串, 不复制
+inline void parse_target(boost::beast::string_view target, boost::beast::string_view& path, boost::beast::string_view& query_string) noexcept
+{
+    const char* q = static_cast<const char*>(memchr(target.data(), '?', target.size()));
+    if(q)
+    {
+        size_t pos = q - target.data();
+        path = target.substr(0, pos);
+        query_string = target.substr(pos + 1);
+    }
+    else
+    {
+        path = target;
+        query_string = boost::beast::string_view();
+    }
+}
+
+//url参数, 解析时一次扫描完成分割与值的百分号解码(原地解码)
+//参数与名字在内联缓冲区中, 常见的短参数串不分配内存; 名字查找不区分大小写
+//只保存偏移, 对象可以安全复制
+class QueryParams
+{
+public:
+    bool empty() const noexcept { return m_entries.empty(); }
+    size_t size() const noexcept { return m_entries.size(); }
+
+    boost::beast::string_view name(size_t i) const noexcept
+    {
+        return boost::beast::string_view(m_buf.data() + m_entries[i].name_off, m_entries[i].name_len);
+    }
+    boost::beast::string_view value(size_t i) const noexcept
+    {
+        return boost::beast::string_view(m_buf.data() + m_entries[i].value_off, m_entries[i].value_len);
+    }
+
+    //第一个同名参数的值
+    boost::optional<boost::beast::string_view> find(boost::beast::string_view key) const noexcept
+    {
+        for(size_t i = 0; i < m_entries.size(); ++i)
+        {
+            if(boost::beast::iequals(name(i), key))
+                return value(i);
+        }
+        return boost::none;
+    }
+    bool has(boost::beast::string_view key) const noexcept { return static_cast<bool>(find(key)); }
+    size_t count(boost::beast::string_view key) const noexcept
+    {
+        size_t n = 0;
+        for(size_t i = 0; i < m_entries.size(); ++i)
+        {
+            if(boost::beast::iequals(name(i), key))
+                ++n;
+        }
+        return n;
+    }
+
+    //解析 a=1&b=%20x&c, 空名字的参数被忽略, 只对值解码
+    void parse(boost::beast::string_view query_string)
+    {
+        m_entries.clear();
+        m_buf.assign(query_string.begin(), query_string.end());
+        if(m_buf.empty())
+            return;
+
+        char* buf = m_buf.data();
+        const uint32_t n = static_cast<uint32_t>(m_buf.size());
+        uint32_t r = 0;
+        uint32_t w = 0;
+        Entry cur = {0, 0, 0, 0};
+        bool in_value = false;
+
+        auto finish = [&](uint32_t end) {
+            if(in_value)
+                cur.value_len = end - cur.value_off;
+            else
+            {
+                cur.name_len = end - cur.name_off;
+                cur.value_off = end;
+                cur.value_len = 0;
+            }
+            if(cur.name_len > 0)
+                m_entries.push_back(cur);
+        };
+
+        while(r < n)
+        {
+            const char* special = find_query_special(buf + r, buf + n);
+            uint32_t pos = static_cast<uint32_t>(special - buf);
+            if(w != r)
+                memmove(buf + w, buf + r, pos - r);
+            w += pos - r;
+            r = pos;
+            if(r == n)
+                break;
+
+            char c = buf[r];
+            if(c == '&')
+            {
+                finish(w);
+                cur = {w, 0, 0, 0};
+                in_value = false;
+                ++r;
+            }
+            else if(c == '=' && !in_value)
+            {
+                cur.name_len = w - cur.name_off;
+                cur.value_off = w;
+                in_value = true;
+                ++r;
+            }
+            else if(c == '%' && in_value && r + 2 < n && hex_value(buf[r + 1]) >= 0 && hex_value(buf[r + 2]) >= 0)
+            {
+                buf[w++] = static_cast<char>(hex_value(buf[r + 1]) * 16 + hex_value(buf[r + 2]));
+                r += 3;
+            }
+            else if(c == '+' && in_value)
+            {
+                buf[w++] = ' ';
+                ++r;
+            }
+            else
+            {
+                buf[w++] = c;
+                ++r;
+            }
+        }
+        finish(w);
+        m_buf.resize(w);
+    }
+
+private:
+    struct Entry
+    {
+        uint32_t name_off;
+        uint32_t name_len;
+        uint32_t value_off;
+        uint32_t value_len;
+    };
+
+    boost::container::small_vector<char, 256> m_buf;
+    boost::container::small_vector<Entry, 8> m_entries;
+};
+
+} //namespace kkurl
+
+#endif // URL_PARSER_H
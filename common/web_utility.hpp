@@ -7,12 +7,14 @@
 #include <map>
 #include <cstdio>
 #include <cctype>
+#include <ctime>
 #include <string>
 #include <memory>
 #include <mutex>
 #include <sstream>
 #include <thread>
 #include <unordered_map>
+#include "url_parser.hpp"
 
 inline bool case_insensitive_equal(const std::string &str1, const std::string &str2) noexcept {
     return str1.size() == str2.size() &&
@@ -30,10 +32,14 @@ public:
 class CaseInsensitiveHash {
 public:
     size_t operator()(const std::string &str) const noexcept {
-        size_t h = 0;
-        std::hash<int> hash;
-        for(auto c : str)
-            h ^= hash(tolower(c)) + 0x9e3779b9 + (h << 6) + (h >> 2);
+        //FNV-1a, ASCII字母置位0x20转小写, 不调用 tolower 与 std::hash
+        size_t h = 14695981039346656037ULL;
+        for(auto c : str) {
+            unsigned char uc = static_cast<unsigned char>(c);
+            if(uc >= 'A' && uc <= 'Z')
+                uc |= 0x20;
+            h = (h ^ uc) * 1099511628211ULL;
+        }
         return h;
     }
 };
@@ -66,14 +72,15 @@ public:
     /// Returns percent-decoded string
     static std::string decode(const std::string &value) noexcept {
         std::string result;
-        result.reserve(value.size() / 3 + (value.size() % 3)); // Minimum size of result
+        result.reserve(value.size()); // Maximum size of result
 
         for(std::size_t i = 0; i < value.size(); ++i) {
             auto &chr = value[i];
-            if(chr == '%' && i + 2 < value.size()) {
-                auto hex = value.substr(i + 1, 2);
-                auto decoded_chr = static_cast<char>(std::strtol(hex.c_str(), nullptr, 16));
-                result += decoded_chr;
+            int hi, lo;
+            //不合法的 %XY 原样保留, 与 kkurl::QueryParams 一致
+            if(chr == '%' && i + 2 < value.size() &&
+                    (hi = kkurl::hex_value(value[i + 1])) >= 0 && (lo = kkurl::hex_value(value[i + 2])) >= 0) {
+                result += static_cast<char>(hi * 16 + lo);
                 i += 2;
             }
             else if(chr == '+')
@@ -123,6 +130,63 @@ inline boost::beast::string_view mime_type(boost::beast::string_view path)
     return "application/octet-stream";
 }
 
+//HTTP-date (RFC 7231 IMF-fixdate), 如 Sun, 06 Nov 1994 08:49:37 GMT
+inline std::string http_date(time_t t)
+{
+    char buf[64];
+    struct tm tm_val;
+    gmtime_r(&t, &tm_val);
+    size_t n = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm_val);
+    return std::string(buf, n);
+}
+
+//解析HTTP-date, 支持 IMF-fixdate, RFC 850, asctime 三种格式
+inline bool parse_http_date(boost::beast::string_view value, time_t& t)
+{
+    static const char* formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",
+        "%A, %d-%b-%y %H:%M:%S GMT",
+        "%a %b %e %H:%M:%S %Y"
+    };
+    std::string str = value.to_string();
+    for(const char* fmt : formats)
+    {
+        struct tm tm_val = {};
+        const char* end = strptime(str.c_str(), fmt, &tm_val);
+        if(end && *end == '\0')
+        {
+            t = timegm(&tm_val);
+            return true;
+        }
+    }
+    return false;
+}
+
+//追加JSON字符串内容(不含两侧引号), 转义引号 反斜杠 控制字符
+inline void json_escape(boost::beast::string_view str, std::string& out)
+{
+    static const char hex[] = "0123456789abcdef";
+    for(char c : str)
+    {
+        unsigned char uc = static_cast<unsigned char>(c);
+        if(c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if(uc < 0x20)
+        {
+            out += "\\u00";
+            out += hex[uc >> 4];
+            out += hex[uc & 0xf];
+        }
+        else
+        {
+            out += c;
+        }
+    }
+}
+
 //根据完整url获取 不带参数的url与参数字符串
 inline bool parse_target(const boost::beast::string_view& target, std::string &path, std::string &query_string)
 {
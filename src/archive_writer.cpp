@@ -0,0 +1,373 @@
+#include "archive_writer.h"
+#include "send_file.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace {
+const int64_t TAR_BLOCK = 512;
+const uint32_t ZIP_MAX32 = 0xFFFFFFFFu;
+const uint16_t ZIP_MAX16 = 0xFFFFu;
+const size_t ZIP_LOCAL_HEADER = 30;
+const size_t ZIP_CENTRAL_HEADER = 46;
+const size_t ZIP_EOCD = 22;
+const size_t ZIP64_EOCD = 56;
+const size_t ZIP64_LOCATOR = 20;
+const uint16_t ZIP_FLAG_UTF8 = 0x0800;
+
+int64_t tar_round(int64_t size)
+{
+    return (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+}
+
+//pax记录 "{len} path={name}\n", len包含自身的位数
+string pax_record(const string& key, const string& value)
+{
+    size_t body = 1 + key.size() + 1 + value.size() + 1;
+    size_t len = body + 1;
+    while(std::to_string(len).size() + body != len)
+        ++len;
+    return std::to_string(len) + " " + key + "=" + value + "\n";
+}
+
+//数字字段, 放不下时用 base-256 编码
+void tar_number(char* field, size_t len, int64_t value)
+{
+    int64_t limit = int64_t(1) << (3 * (len - 1));
+    if(value < limit)
+    {
+        snprintf(field, len, "%0*llo", static_cast<int>(len - 1), static_cast<unsigned long long>(value));
+        return;
+    }
+    memset(field, 0, len);
+    for(size_t i = len - 1; i > 0 && value > 0; --i)
+    {
+        field[i] = static_cast<char>(value & 0xff);
+        value >>= 8;
+    }
+    field[0] = static_cast<char>(0x80);
+}
+
+void tar_block(const string& name, char type, int64_t size, time_t mtime, string& out)
+{
+    char h[TAR_BLOCK] = {0};
+    memcpy(h, name.data(), std::min<size_t>(name.size(), 100));
+    tar_number(h + 100, 8, 0644);
+    tar_number(h + 108, 8, 0);
+    tar_number(h + 116, 8, 0);
+    tar_number(h + 124, 12, size);
+    tar_number(h + 136, 12, mtime);
+    memset(h + 148, ' ', 8);
+    h[156] = type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    unsigned int sum = 0;
+    for(size_t i = 0; i < sizeof(h); ++i)
+    {
+        sum += static_cast<unsigned char>(h[i]);
+    }
+    snprintf(h + 148, 8, "%06o", sum);
+    out.append(h, sizeof(h));
+}
+
+void put16(string& out, uint16_t v)
+{
+    out += static_cast<char>(v & 0xff);
+    out += static_cast<char>(v >> 8);
+}
+
+void put32(string& out, uint32_t v)
+{
+    put16(out, static_cast<uint16_t>(v & 0xffff));
+    put16(out, static_cast<uint16_t>(v >> 16));
+}
+
+void put64(string& out, uint64_t v)
+{
+    put32(out, static_cast<uint32_t>(v & 0xffffffff));
+    put32(out, static_cast<uint32_t>(v >> 32));
+}
+
+void dos_time(time_t t, uint16_t& time, uint16_t& date)
+{
+    struct tm tm_val;
+    localtime_r(&t, &tm_val);
+    if(tm_val.tm_year < 80)
+    {
+        time = 0;
+        date = (1 << 5) | 1;
+        return;
+    }
+    time = static_cast<uint16_t>((tm_val.tm_hour << 11) | (tm_val.tm_min << 5) | (tm_val.tm_sec / 2));
+    date = static_cast<uint16_t>(((tm_val.tm_year - 80) << 9) | ((tm_val.tm_mon + 1) << 5) | tm_val.tm_mday);
+}
+
+bool zip_large(int64_t v)
+{
+    return v >= static_cast<int64_t>(ZIP_MAX32);
+}
+
+//中央目录项 zip64 扩展字段长度, 只包含超出32位的字段
+size_t zip_central_extra(int64_t size, int64_t offset)
+{
+    size_t n = (zip_large(size) ? 16 : 0) + (zip_large(offset) ? 8 : 0);
+    return n ? n + 4 : 0;
+}
+
+bool write_all(Connection& conn, string& data, BSError& ec)
+{
+    if(data.empty())
+        return true;
+    boost::asio::async_write(conn, boost::asio::buffer(data), boost::fibers::asio::yield[ec]);
+    data.clear();
+    return !ec;
+}
+}
+
+bool parse_archive_format(boost::beast::string_view name, ARCHIVE_FORMAT& format)
+{
+    if(boost::beast::iequals(name, "tar"))
+        format = ARCHIVE_FORMAT::TAR;
+    else if(boost::beast::iequals(name, "zip"))
+        format = ARCHIVE_FORMAT::ZIP;
+    else
+        return false;
+    return true;
+}
+
+bool file_crc32(const string& path, uint32_t& crc)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return false;
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    bool ok = file_crc32(fd, 0, -1, crc);
+    ::close(fd);
+    return ok;
+}
+
+bool file_crc32(int fd, int64_t offset, int64_t size, uint32_t& crc)
+{
+    const int64_t BUFFER_SIZE = 256 * 1024;
+    std::unique_ptr<char[]> buf(new char[BUFFER_SIZE]);
+    uLong value = ::crc32(0L, Z_NULL, 0);
+    //size 为-1时读到文件尾
+    while(size != 0)
+    {
+        int64_t want = size < 0 ? BUFFER_SIZE : std::min(size, BUFFER_SIZE);
+        ssize_t n = ::pread(fd, buf.get(), static_cast<size_t>(want), offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return false;
+        if(n == 0)
+        {
+            if(size > 0)
+                return false;
+            break;
+        }
+        value = ::crc32(value, reinterpret_cast<const Bytef*>(buf.get()), static_cast<uInt>(n));
+        offset += n;
+        if(size > 0)
+            size -= n;
+    }
+    crc = static_cast<uint32_t>(value);
+    return true;
+}
+
+ArchiveWriter::ArchiveWriter(ARCHIVE_FORMAT format, vector<Item> items) :
+    m_format(format), m_items(std::move(items))
+{
+    //总长度只取决于文件名和大小
+    int64_t length = 0;
+    for(const Item& item : m_items)
+    {
+        if(m_format == ARCHIVE_FORMAT::TAR)
+        {
+            if(item.name.size() > 100)
+                length += TAR_BLOCK + tar_round(pax_record("path", item.name).size());
+            length += TAR_BLOCK + tar_round(item.meta.size);
+        }
+        else
+        {
+            m_offsets.push_back(length);
+            length += ZIP_LOCAL_HEADER + item.name.size() + (zip_large(item.meta.size) ? 20 : 0) + item.meta.size;
+        }
+    }
+    if(m_format == ARCHIVE_FORMAT::TAR)
+    {
+        //两个全零块结束
+        m_length = length + 2 * TAR_BLOCK;
+        return;
+    }
+    m_central_offset = length;
+    for(size_t i = 0; i < m_items.size(); ++i)
+    {
+        m_central_size += ZIP_CENTRAL_HEADER + m_items[i].name.size() + zip_central_extra(m_items[i].meta.size, m_offsets[i]);
+    }
+    m_length = m_central_offset + m_central_size + ZIP_EOCD;
+    if(m_items.size() >= ZIP_MAX16 || zip_large(m_central_offset) || zip_large(m_central_size))
+        m_length += ZIP64_EOCD + ZIP64_LOCATOR;
+}
+
+const char* ArchiveWriter::contentType() const
+{
+    return m_format == ARCHIVE_FORMAT::TAR ? "application/x-tar" : "application/zip";
+}
+
+const char* ArchiveWriter::extension() const
+{
+    return m_format == ARCHIVE_FORMAT::TAR ? ".tar" : ".zip";
+}
+
+void ArchiveWriter::tarHeader(const Item& item, string& out) const
+{
+    if(item.name.size() > 100)
+    {
+        string record = pax_record("path", item.name);
+        tar_block("PaxHeader/" + item.name.substr(0, 80), 'x', record.size(), item.meta.mtime, out);
+        out += record;
+        out.append(tar_round(record.size()) - record.size(), '\0');
+    }
+    tar_block(item.name, '0', item.meta.size, item.meta.mtime, out);
+}
+
+void ArchiveWriter::zipLocalHeader(size_t i, string& out) const
+{
+    const Item& item = m_items[i];
+    bool zip64 = zip_large(item.meta.size);
+    uint16_t time = 0;
+    uint16_t date = 0;
+    dos_time(item.meta.mtime, time, date);
+    put32(out, 0x04034b50);
+    put16(out, zip64 ? 45 : 20);
+    put16(out, ZIP_FLAG_UTF8);
+    put16(out, 0);      //store
+    put16(out, time);
+    put16(out, date);
+    put32(out, item.meta.crc32);
+    put32(out, zip64 ? ZIP_MAX32 : static_cast<uint32_t>(item.meta.size));
+    put32(out, zip64 ? ZIP_MAX32 : static_cast<uint32_t>(item.meta.size));
+    put16(out, static_cast<uint16_t>(item.name.size()));
+    put16(out, zip64 ? 20 : 0);
+    out += item.name;
+    if(zip64)
+    {
+        put16(out, 0x0001);
+        put16(out, 16);
+        put64(out, item.meta.size);
+        put64(out, item.meta.size);
+    }
+}
+
+void ArchiveWriter::zipCentralDirectory(string& out) const
+{
+    for(size_t i = 0; i < m_items.size(); ++i)
+    {
+        const Item& item = m_items[i];
+        bool large_size = zip_large(item.meta.size);
+        bool large_offset = zip_large(m_offsets[i]);
+        size_t extra = zip_central_extra(item.meta.size, m_offsets[i]);
+        uint16_t time = 0;
+        uint16_t date = 0;
+        dos_time(item.meta.mtime, time, date);
+        put32(out, 0x02014b50);
+        put16(out, (3 << 8) | 45);  //unix
+        put16(out, extra ? 45 : 20);
+        put16(out, ZIP_FLAG_UTF8);
+        put16(out, 0);
+        put16(out, time);
+        put16(out, date);
+        put32(out, item.meta.crc32);
+        put32(out, large_size ? ZIP_MAX32 : static_cast<uint32_t>(item.meta.size));
+        put32(out, large_size ? ZIP_MAX32 : static_cast<uint32_t>(item.meta.size));
+        put16(out, static_cast<uint16_t>(item.name.size()));
+        put16(out, static_cast<uint16_t>(extra));
+        put16(out, 0);      //comment
+        put16(out, 0);      //disk
+        put16(out, 0);      //internal attr
+        put32(out, (0100644u) << 16);
+        put32(out, large_offset ? ZIP_MAX32 : static_cast<uint32_t>(m_offsets[i]));
+        out += item.name;
+        if(extra)
+        {
+            put16(out, 0x0001);
+            put16(out, static_cast<uint16_t>(extra - 4));
+            if(large_size)
+            {
+                put64(out, item.meta.size);
+                put64(out, item.meta.size);
+            }
+            if(large_offset)
+                put64(out, m_offsets[i]);
+        }
+    }
+
+    uint64_t count = m_items.size();
+    if(count >= ZIP_MAX16 || zip_large(m_central_offset) || zip_large(m_central_size))
+    {
+        int64_t eocd64_offset = m_central_offset + m_central_size;
+        put32(out, 0x06064b50);
+        put64(out, ZIP64_EOCD - 12);
+        put16(out, (3 << 8) | 45);
+        put16(out, 45);
+        put32(out, 0);
+        put32(out, 0);
+        put64(out, count);
+        put64(out, count);
+        put64(out, m_central_size);
+        put64(out, m_central_offset);
+
+        put32(out, 0x07064b50);
+        put32(out, 0);
+        put64(out, eocd64_offset);
+        put32(out, 1);
+    }
+    put32(out, 0x06054b50);
+    put16(out, 0);
+    put16(out, 0);
+    put16(out, count >= ZIP_MAX16 ? ZIP_MAX16 : static_cast<uint16_t>(count));
+    put16(out, count >= ZIP_MAX16 ? ZIP_MAX16 : static_cast<uint16_t>(count));
+    put32(out, zip_large(m_central_size) ? ZIP_MAX32 : static_cast<uint32_t>(m_central_size));
+    put32(out, zip_large(m_central_offset) ? ZIP_MAX32 : static_cast<uint32_t>(m_central_offset));
+    put16(out, 0);
+}
+
+bool ArchiveWriter::write(Connection& conn, BSError& ec)
+{
+    //上一个文件的填充与下一个文件的头合并成一次写
+    string pending;
+    for(size_t i = 0; i < m_items.size(); ++i)
+    {
+        const Item& item = m_items[i];
+        int fd = item.segment ? item.segment->fd : ::open(item.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+        {
+            ec.assign(errno, boost::system::system_category());
+            LogErrorExt << "open file failed," << ec.message() << "," << item.path;
+            return false;
+        }
+        if(!item.segment)
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if(m_format == ARCHIVE_FORMAT::TAR)
+            tarHeader(item, pending);
+        else
+            zipLocalHeader(i, pending);
+        int64_t offset = item.segment ? item.meta.offset : 0;
+        bool ok = write_all(conn, pending, ec) && send_file(conn, fd, offset, item.meta.size, ec);
+        if(!item.segment)
+            ::close(fd);
+        if(!ok)
+        {
+            LogErrorExt << "send archive entry failed," << ec.message() << "," << item.path;
+            return false;
+        }
+        if(m_format == ARCHIVE_FORMAT::TAR)
+            pending.append(tar_round(item.meta.size) - item.meta.size, '\0');
+    }
+    if(m_format == ARCHIVE_FORMAT::TAR)
+        pending.append(2 * TAR_BLOCK, '\0');
+    else
+        zipCentralDirectory(pending);
+    return write_all(conn, pending, ec);
+}
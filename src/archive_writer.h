@@ -0,0 +1,60 @@
+#ifndef ARCHIVE_WRITER_H
+#define ARCHIVE_WRITER_H
+
+#include "kconfig.h"
+#include "file_index.h"
+#include "segment_store.h"
+#include "connection.h"
+
+enum class ARCHIVE_FORMAT
+{
+    TAR = 0,    //POSIX ustar, 长文件名用pax扩展头
+    ZIP = 1     //只存储不压缩, 需要时使用zip64
+};
+
+bool parse_archive_format(boost::beast::string_view name, ARCHIVE_FORMAT& format);
+
+//读文件计算CRC32, 阻塞操作, 在存储盘的IO线程上调用
+bool file_crc32(const string& path, uint32_t& crc);
+//读 fd 的 [offset, offset+size) 计算CRC32, 用于段文件中的小文件
+bool file_crc32(int fd, int64_t offset, int64_t size, uint32_t& crc);
+
+//目录打包下载, 不生成临时文件
+//归档头在发送时生成, 文件内容用 sendfile 发送, 归档总长度在发送前就能算出
+class ArchiveWriter : private boost::noncopyable
+{
+public:
+    struct Item
+    {
+        string name;
+        string path;    //完整路径
+        FileMeta meta;  //大小以索引为准, 发送时文件变短则中断连接
+        SegmentFilePtr segment;     //打包存储的文件从段文件 meta.offset 处发送
+    };
+
+    ArchiveWriter(ARCHIVE_FORMAT format, vector<Item> items);
+
+    const char* contentType() const;
+    const char* extension() const;
+    int64_t contentLength() const { return m_length; }
+
+    //zip格式要求发送前知道CRC32, 索引中没有缓存的由调用方算好后设置
+    vector<Item>& items() { return m_items; }
+
+    //应答头已发送, 写归档内容; 失败后连接不可再使用
+    bool write(Connection& conn, BSError& ec);
+
+private:
+    void tarHeader(const Item& item, string& out) const;
+    void zipLocalHeader(size_t i, string& out) const;
+    void zipCentralDirectory(string& out) const;
+
+    ARCHIVE_FORMAT m_format;
+    vector<Item> m_items;
+    vector<int64_t> m_offsets;  //zip本地头在归档中的偏移
+    int64_t m_central_offset = 0;
+    int64_t m_central_size = 0;
+    int64_t m_length = 0;
+};
+
+#endif // ARCHIVE_WRITER_H
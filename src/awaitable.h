@@ -0,0 +1,57 @@
+#ifndef AWAITABLE_H
+#define AWAITABLE_H
+
+/*
+宏定义说明
+FTS_AWAITABLE 连接的 session, accept 与 DownTask 的发送方使用 asio::awaitable 协程, 不占用fiber栈
+              请求处理仍在fiber中执行, 协程等待它结束; 需要 C++20, 见 BUILD.gn 的 fts_awaitable
+*/
+
+#ifdef FTS_AWAITABLE
+
+#include "fiber_stack.h"
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+//boost 1.72 的asio只按 Coroutines TS 特化 std::experimental::coroutine_traits,
+//gcc 的C++20协程查找 std::coroutine_traits (<experimental/coroutine> 由 src/compat 提供)
+#if !defined(BOOST_ASIO_HAS_STD_COROUTINE) && defined(__cpp_impl_coroutine)
+namespace std {
+template <typename T, typename Executor, typename... Args>
+struct coroutine_traits<boost::asio::awaitable<T, Executor>, Args...>
+{
+    typedef boost::asio::detail::awaitable_frame<T, Executor> promise_type;
+};
+}
+#endif
+
+//在新fiber中执行 fn, 结束后在 token 关联的executor上完成, 签名 void()
+//协程通过它调用依赖 fiber yield 的代码; fn 抛出的异常记日志后忽略
+template<typename Fn, typename CompletionToken>
+auto async_run_fiber(Fn&& fn, CompletionToken&& token)
+{
+    return boost::asio::async_initiate<CompletionToken, void()>(
+        [](auto handler, auto fn) {
+            //完成回调投递出去, 协程不能在这个fiber的栈上恢复
+            auto h = std::make_shared<decltype(handler)>(std::move(handler));
+            make_fiber([h, fn]() mutable {
+                try
+                {
+                    fn();
+                }
+                catch(std::exception& e)
+                {
+                    LogErrorExt << e.what();
+                }
+                boost::asio::post(std::move(*h));
+            }).detach();
+        },
+        token, std::forward<Fn>(fn));
+}
+
+#endif // FTS_AWAITABLE
+
+#endif // AWAITABLE_H
@@ -0,0 +1,288 @@
+#include "cluster.h"
+#include <boost/algorithm/string.hpp>
+#include <sys/stat.h>
+#include <fstream>
+
+namespace {
+//成员文件检查修改的间隔
+const std::chrono::seconds kMemberCheckInterval(5);
+}
+
+Cluster::Cluster(const string& member_file, const string& self, bool tls) :
+    m_member_file(member_file), m_self(self), m_scheme(tls ? "https://" : "http://")
+{
+}
+
+bool Cluster::load()
+{
+    struct stat st;
+    if(::stat(m_member_file.c_str(), &st) != 0)
+    {
+        LogErrorExt << "stat cluster member file failed," << m_member_file << "," << strerror(errno);
+        return false;
+    }
+    auto m = std::make_shared<Membership>();
+    if(!parse(m_membership, *m))
+        return false;
+    if(m->self == SIZE_MAX)
+    {
+        LogWarnExt << "self not in cluster member file, forward all requests," << m_self;
+    }
+    LogInfo << "cluster members loaded," << m->nodes.size();
+    m_membership = m;
+    m_mtime = st.st_mtime;
+    m_next_check = std::chrono::steady_clock::now() + kMemberCheckInterval;
+    return true;
+}
+
+bool Cluster::parse(const MembershipPtr& old, Membership& m)
+{
+    std::ifstream ifs(m_member_file);
+    if(!ifs)
+    {
+        LogErrorExt << "open cluster member file failed," << m_member_file;
+        return false;
+    }
+    string line;
+    while(std::getline(ifs, line))
+    {
+        boost::trim(line);
+        if(line.empty() || line[0] == '#')
+            continue;
+        vector<string> fields;
+        boost::split(fields, line, boost::is_any_of(" \t"), boost::token_compress_on);
+        auto node = std::make_shared<ClusterNode>();
+        node->address = fields[0];
+        node->url = fields.size() > 1 ? fields[1] : m_scheme + node->address;
+        if(!node->url.empty() && node->url.back() == '/')
+            node->url.pop_back();
+        //保留原有节点的连接
+        if(old)
+        {
+            for(const ClusterNodePtr& n : old->nodes)
+            {
+                if(n->address == node->address)
+                    node->peer = n->peer;
+            }
+        }
+        if(!node->peer)
+            node->peer = std::make_shared<ReplicaPeer>(node->address);
+        if(node->address == m_self)
+            m.self = m.nodes.size();
+        m.ring.addNode(m.nodes.size(), node->address);
+        m.nodes.push_back(node);
+    }
+    if(m.nodes.empty())
+    {
+        LogErrorExt << "cluster member file is empty," << m_member_file;
+        return false;
+    }
+    return true;
+}
+
+Cluster::MembershipPtr Cluster::membership()
+{
+    std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+    auto now = std::chrono::steady_clock::now();
+    if(now < m_next_check)
+        return m_membership;
+    m_next_check = now + kMemberCheckInterval;
+    struct stat st;
+    if(::stat(m_member_file.c_str(), &st) != 0 || st.st_mtime == m_mtime)
+        return m_membership;
+    //解析失败时继续使用旧的成员
+    auto m = std::make_shared<Membership>();
+    if(parse(m_membership, *m))
+    {
+        LogInfo << "cluster members reloaded," << m->nodes.size();
+        m_membership = m;
+    }
+    m_mtime = st.st_mtime;
+    return m_membership;
+}
+
+ClusterNodePtr Cluster::Membership::owner(const string& rel_path) const
+{
+    size_t index = ring.primary(rel_path);
+    if(index == self)
+        return nullptr;
+    return nodes[index];
+}
+
+ClusterNodePtr Cluster::owner(const string& rel_path)
+{
+    return membership()->owner(rel_path);
+}
+
+namespace {
+//把 parser 中的消息边读边写到 output, parser 的头已经读完
+//body 的 Content-Length 或 chunked 编码按头原样写出
+template<bool isRequest, class Allocator, class ReadStream, class WriteStream, class DynamicBuffer>
+void relay(ReadStream& input, DynamicBuffer& buffer, http::parser<isRequest, http::buffer_body, Allocator>& p,
+           WriteStream& output, BSError& read_ec, BSError& write_ec)
+{
+    char buf[16 * 1024];
+    http::serializer<isRequest, http::buffer_body, http::basic_fields<Allocator>> sr{p.get()};
+    do
+    {
+        if(!p.is_done())
+        {
+            p.get().body().data = buf;
+            p.get().body().size = sizeof(buf);
+            http::async_read(input, buffer, p, boost::fibers::asio::yield[read_ec]);
+            if(read_ec == http::error::need_buffer)
+                read_ec.assign(0, read_ec.category());
+            if(read_ec)
+                return;
+            p.get().body().size = sizeof(buf) - p.get().body().size;
+            p.get().body().data = buf;
+            p.get().body().more = !p.is_done();
+        }
+        else
+        {
+            p.get().body().data = nullptr;
+            p.get().body().size = 0;
+            p.get().body().more = false;
+        }
+        http::async_write(output, sr, boost::fibers::asio::yield[write_ec]);
+        if(write_ec == http::error::need_buffer)
+            write_ec.assign(0, write_ec.category());
+        if(write_ec)
+            return;
+    }
+    while(!p.is_done() || !sr.is_done());
+}
+}
+
+bool proxy_request(Connection& client, RequestParser& p,
+                   boost::beast::multi_buffer& buffer, ClusterNode& node, bool& close)
+{
+    IoContext& ioc = static_cast<IoContext&>(client.get_executor().context());
+    BSError ec;
+    SocketPtr upstream = node.peer->acquire(ioc, ec);
+    if(!upstream)
+    {
+        LogErrorExt << "connect cluster node failed," << ec.message() << "," << node.address;
+        return false;
+    }
+
+    auto& req = p.get();
+    bool keep_alive = req.keep_alive();
+    bool head = req.method() == http::verb::head;
+    req.set(FORWARDED_HEADER, "1");
+    //100-continue 已由本节点应答
+    req.erase(http::field::expect);
+    req.keep_alive(true);
+
+    BSError read_ec;
+    BSError write_ec;
+    relay(client, buffer, p, *upstream, read_ec, write_ec);
+    if(read_ec)
+    {
+        LogErrorExt << "read request body failed," << read_ec.message();
+        close = true;
+        return true;
+    }
+    if(write_ec)
+    {
+        LogErrorExt << "forward request failed," << write_ec.message() << "," << node.address;
+        return false;
+    }
+
+    boost::beast::flat_buffer upstream_buffer;
+    http::response_parser<http::buffer_body> rp;
+    rp.body_limit(std::numeric_limits<std::uint64_t>::max());
+    if(head)
+        rp.skip(true);
+    http::async_read_header(*upstream, upstream_buffer, rp, boost::fibers::asio::yield[ec]);
+    if(ec)
+    {
+        LogErrorExt << "read response failed," << ec.message() << "," << node.address;
+        return false;
+    }
+    auto& res = rp.get();
+    bool upstream_keep_alive = res.keep_alive();
+    res.keep_alive(keep_alive);
+    if(!keep_alive)
+        close = true;
+
+    //边上传边下载时 body 为 chunked, 随上传进度转给客户端
+    relay(*upstream, upstream_buffer, rp, client, read_ec, write_ec);
+    if(read_ec || write_ec)
+    {
+        LogErrorExt << "relay response failed," << (read_ec ? read_ec : write_ec).message() << "," << node.address;
+        close = true;
+        return true;
+    }
+    if(upstream_keep_alive)
+    {
+        node.peer->release(ioc, upstream);
+    }
+    return true;
+}
+
+ReplicaStreamPtr forward_upload(IoContext& ioc, ClusterNode& node, const string& rel_path, int64_t size)
+{
+    ReplicaStreamPtr stream = std::make_shared<ReplicaStream>(node.peer, rel_path, size, FORWARDED_HEADER);
+    stream->start(ioc);
+    return stream;
+}
+
+bool forward_delete(IoContext& ioc, ClusterNode& node, const string& dir_name, const vector<string>& names,
+                    vector<bool>& deleted)
+{
+    deleted.assign(names.size(), false);
+    BSError ec;
+    SocketPtr socket;
+    boost::beast::flat_buffer buffer;
+    for(size_t i = 0; i < names.size(); ++i)
+    {
+        if(!socket)
+        {
+            buffer.consume(buffer.size());
+            socket = node.peer->acquire(ioc, ec);
+            if(!socket)
+            {
+                LogErrorExt << "connect cluster node failed," << ec.message() << "," << node.address;
+                return false;
+            }
+        }
+        http::request<http::empty_body> req{http::verb::delete_, "/" + dir_name + "/" + names[i], 11};
+        req.set(http::field::host, node.address);
+        req.set(FORWARDED_HEADER, "1");
+        req.keep_alive(true);
+        http::async_write(*socket, req, boost::fibers::asio::yield[ec]);
+        http::response<http::string_body> res;
+        if(!ec)
+        {
+            http::async_read(*socket, buffer, res, boost::fibers::asio::yield[ec]);
+        }
+        if(ec)
+        {
+            LogErrorExt << "forward delete failed," << ec.message() << "," << node.address;
+            socket->close(ec);
+            return false;
+        }
+        deleted[i] = res.result() == http::status::no_content;
+        if(!res.keep_alive())
+        {
+            socket->close(ec);
+            socket.reset();
+        }
+    }
+    if(socket)
+    {
+        node.peer->release(ioc, socket);
+    }
+    return true;
+}
+
+bool forwardable_name(const string& name)
+{
+    for(unsigned char c : name)
+    {
+        if(c <= ' ' || c == 0x7f || c == '?' || c == '#')
+            return false;
+    }
+    return true;
+}
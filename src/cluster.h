@@ -0,0 +1,76 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "kconfig.h"
+#include "hash_ring.h"
+#include "replicator.h"
+#include "connection.h"
+
+//节点之间转发的请求带上此头, 收到后直接在本节点处理, 避免成员文件不一致时循环转发
+#define FORWARDED_HEADER "X-Fts-Forwarded"
+
+struct ClusterNode
+{
+    string address;         //host:port, 节点之间访问
+    string url;             //重定向给客户端的地址, 如 http://node1.xxx.com:2180
+    ReplicaPeerPtr peer;    //转发用的持久连接
+};
+
+typedef std::shared_ptr<ClusterNode> ClusterNodePtr;
+
+//集群成员与文件归属
+//成员文件每行一个节点: host:port [重定向url], #开头为注释
+//{dir}/{name} 按一致性哈希归属一个节点, 所有节点用同一份成员文件计算结果一致
+//成员文件修改后自动重新加载
+class Cluster : private boost::noncopyable
+{
+public:
+    //self 为本节点在成员文件中的 host:port
+    Cluster(const string& member_file, const string& self, bool tls);
+
+    struct Membership
+    {
+        HashRing ring;
+        vector<ClusterNodePtr> nodes;
+        size_t self = SIZE_MAX;
+
+        //rel_path 的归属节点, 属于本节点时返回空; 只读, 可以在IO线程上调用
+        ClusterNodePtr owner(const string& rel_path) const;
+    };
+    typedef std::shared_ptr<const Membership> MembershipPtr;
+
+    bool load();
+    //rel_path 的归属节点, 属于本节点时返回空
+    ClusterNodePtr owner(const string& rel_path);
+    //当前成员, 一个目录级请求中的所有文件按同一份成员计算归属
+    MembershipPtr membership();
+
+private:
+    bool parse(const MembershipPtr& old, Membership& m);
+
+    string m_member_file;
+    string m_self;
+    string m_scheme;
+    boost::fibers::mutex m_mutex;
+    MembershipPtr m_membership;
+    time_t m_mtime = 0;
+    std::chrono::steady_clock::time_point m_next_check;
+};
+
+//把已读完请求头的请求转发到 node, 再把应答转回 client, 请求与应答body都边读边写
+//转发失败且还没有应答写给 client 时返回false, 由调用方应答; client 连接需要关闭时 close 为true
+bool proxy_request(Connection& client, RequestParser& p,
+                   boost::beast::multi_buffer& buffer, ClusterNode& node, bool& close);
+
+//目录级请求中归属 node 的一个文件, 作为带 FORWARDED_HEADER 的普通上传转发过去, 归属节点照常复制
+//size 为-1时使用chunked; 返回的流已开始连接, 由调用方 send/finish 并等待 result
+ReplicaStreamPtr forward_upload(IoContext& ioc, ClusterNode& node, const string& rel_path, int64_t size);
+
+//在归属节点上逐个删除 {dir_name}/{name}, deleted 与 names 一一对应; 连接或读写失败时返回false
+bool forward_delete(IoContext& ioc, ClusterNode& node, const string& dir_name, const vector<string>& names,
+                    vector<bool>& deleted);
+
+//转发时文件名直接放在请求行中, 不能含空白, 控制字符, '?' 与 '#'
+bool forwardable_name(const string& name);
+
+#endif // CLUSTER_H
@@ -0,0 +1,294 @@
+#include "compressor.h"
+#include <zlib.h>
+#include <cstdio>
+#ifdef FTS_WITH_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef FTS_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+const size_t COMPRESS_CHUNK = 256 * 1024;
+//压缩后大于原文件的90%时不保留
+const int64_t MIN_SAVING_PERCENT = 10;
+
+typedef std::unique_ptr<FILE, decltype(&fclose)> FilePtr;
+
+//把 in 的内容交给 step 压缩, step(data, size, finish, out) 把产生的数据追加到 out
+template<typename Step>
+bool stream_compress(FILE* in, FILE* out, Step step)
+{
+    std::unique_ptr<char[]> in_buf(new char[COMPRESS_CHUNK]);
+    string out_buf;
+    for(;;)
+    {
+        size_t n = fread(in_buf.get(), 1, COMPRESS_CHUNK, in);
+        if(ferror(in))
+            return false;
+        bool finish = feof(in);
+        out_buf.clear();
+        if(!step(in_buf.get(), n, finish, out_buf))
+            return false;
+        if(!out_buf.empty() && fwrite(out_buf.data(), 1, out_buf.size(), out) != out_buf.size())
+            return false;
+        if(finish)
+            return true;
+    }
+}
+
+bool compress_gzip(FILE* in, FILE* out)
+{
+    z_stream zs = {};
+    //windowBits 15 + 16 输出gzip格式
+    if(deflateInit2(&zs, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    bool ok = stream_compress(in, out, [&zs](const char* data, size_t size, bool finish, string& result) {
+        char buf[64 * 1024];
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        zs.avail_in = static_cast<uInt>(size);
+        int r;
+        do
+        {
+            zs.next_out = reinterpret_cast<Bytef*>(buf);
+            zs.avail_out = sizeof(buf);
+            r = deflate(&zs, finish ? Z_FINISH : Z_NO_FLUSH);
+            if(r == Z_STREAM_ERROR)
+                return false;
+            result.append(buf, sizeof(buf) - zs.avail_out);
+        } while(zs.avail_out == 0 || (finish && r != Z_STREAM_END));
+        return true;
+    });
+    deflateEnd(&zs);
+    return ok;
+}
+
+#ifdef FTS_WITH_BROTLI
+bool compress_brotli(FILE* in, FILE* out)
+{
+    std::unique_ptr<BrotliEncoderState, decltype(&BrotliEncoderDestroyInstance)> st(
+                BrotliEncoderCreateInstance(nullptr, nullptr, nullptr), &BrotliEncoderDestroyInstance);
+    if(!st)
+        return false;
+    BrotliEncoderSetParameter(st.get(), BROTLI_PARAM_QUALITY, 9);
+    return stream_compress(in, out, [&st](const char* data, size_t size, bool finish, string& result) {
+        size_t avail_in = size;
+        const uint8_t* next_in = reinterpret_cast<const uint8_t*>(data);
+        BrotliEncoderOperation op = finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS;
+        while(avail_in > 0 || (finish && !BrotliEncoderIsFinished(st.get())) || BrotliEncoderHasMoreOutput(st.get()))
+        {
+            uint8_t buf[64 * 1024];
+            size_t avail_out = sizeof(buf);
+            uint8_t* next_out = buf;
+            if(!BrotliEncoderCompressStream(st.get(), op, &avail_in, &next_in, &avail_out, &next_out, nullptr))
+                return false;
+            result.append(reinterpret_cast<char*>(buf), sizeof(buf) - avail_out);
+        }
+        return true;
+    });
+}
+#endif
+
+#ifdef FTS_WITH_ZSTD
+bool compress_zstd(FILE* in, FILE* out)
+{
+    std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+    if(!cctx)
+        return false;
+    ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_compressionLevel, 9);
+    return stream_compress(in, out, [&cctx](const char* data, size_t size, bool finish, string& result) {
+        ZSTD_inBuffer input = { data, size, 0 };
+        ZSTD_EndDirective mode = finish ? ZSTD_e_end : ZSTD_e_continue;
+        size_t remaining;
+        do
+        {
+            char buf[64 * 1024];
+            ZSTD_outBuffer output = { buf, sizeof(buf), 0 };
+            remaining = ZSTD_compressStream2(cctx.get(), &output, &input, mode);
+            if(ZSTD_isError(remaining))
+                return false;
+            result.append(buf, output.pos);
+        } while(finish ? remaining != 0 : input.pos != input.size);
+        return true;
+    });
+}
+#endif
+}
+
+const char* encoding_name(CONTENT_ENCODING e)
+{
+    switch(e)
+    {
+    case CONTENT_ENCODING::GZIP: return "gzip";
+    case CONTENT_ENCODING::ZSTD: return "zstd";
+    case CONTENT_ENCODING::BROTLI: return "br";
+    default: return "identity";
+    }
+}
+
+const char* encoding_suffix(CONTENT_ENCODING e)
+{
+    switch(e)
+    {
+    case CONTENT_ENCODING::GZIP: return ".gz";
+    case CONTENT_ENCODING::ZSTD: return ".zst";
+    case CONTENT_ENCODING::BROTLI: return ".br";
+    default: return "";
+    }
+}
+
+bool encoding_supported(CONTENT_ENCODING e)
+{
+    switch(e)
+    {
+    case CONTENT_ENCODING::GZIP: return true;
+#ifdef FTS_WITH_ZSTD
+    case CONTENT_ENCODING::ZSTD: return true;
+#endif
+#ifdef FTS_WITH_BROTLI
+    case CONTENT_ENCODING::BROTLI: return true;
+#endif
+    default: return false;
+    }
+}
+
+bool parse_encoding(const string& name, CONTENT_ENCODING& e)
+{
+    for(int i = 1; i < CONTENT_ENCODING_COUNT; ++i)
+    {
+        if(boost::beast::iequals(name, encoding_name(static_cast<CONTENT_ENCODING>(i))))
+        {
+            e = static_cast<CONTENT_ENCODING>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool is_compressible(boost::beast::string_view mime)
+{
+    return mime.starts_with("text/") ||
+            mime == "application/json" ||
+            mime == "application/javascript" ||
+            mime == "application/xml" ||
+            mime == "image/svg+xml";
+}
+
+string variant_path(const string& file_dir, const string& file_name, CONTENT_ENCODING e)
+{
+    return file_dir + "/.variants/" + file_name + encoding_suffix(e);
+}
+
+string variant_etag(const string& etag, CONTENT_ENCODING e)
+{
+    if(e == CONTENT_ENCODING::IDENTITY || etag.size() < 2)
+        return etag;
+    return etag.substr(0, etag.size() - 1) + "-" + encoding_name(e) + "\"";
+}
+
+bool compress_file(const string& src, const string& dst, CONTENT_ENCODING e, int64_t& out_size)
+{
+    FilePtr in(fopen(src.c_str(), "rb"), &fclose);
+    if(!in)
+        return false;
+    FilePtr out(fopen(dst.c_str(), "wb"), &fclose);
+    if(!out)
+    {
+        LogErrorExt << "open variant failed," << strerror(errno) << "," << dst;
+        return false;
+    }
+
+    bool ok = false;
+    switch(e)
+    {
+    case CONTENT_ENCODING::GZIP: ok = compress_gzip(in.get(), out.get()); break;
+#ifdef FTS_WITH_BROTLI
+    case CONTENT_ENCODING::BROTLI: ok = compress_brotli(in.get(), out.get()); break;
+#endif
+#ifdef FTS_WITH_ZSTD
+    case CONTENT_ENCODING::ZSTD: ok = compress_zstd(in.get(), out.get()); break;
+#endif
+    default: break;
+    }
+
+    int64_t src_size = ftello(in.get());
+    out_size = ftello(out.get());
+    ok = ok && fflush(out.get()) == 0;
+    out.reset();
+    if(ok && out_size * 100 > src_size * (100 - MIN_SAVING_PERCENT))
+    {
+        ok = false;
+    }
+    if(!ok)
+    {
+        ::unlink(dst.c_str());
+        return false;
+    }
+    return true;
+}
+
+CONTENT_ENCODING choose_encoding(boost::beast::string_view accept_encoding, uint32_t available)
+{
+    //同q值时优先压缩率高的
+    static const CONTENT_ENCODING preference[] = {
+        CONTENT_ENCODING::BROTLI, CONTENT_ENCODING::ZSTD, CONTENT_ENCODING::GZIP
+    };
+    if(available == 0 || accept_encoding.empty())
+        return CONTENT_ENCODING::IDENTITY;
+
+    //-1 表示客户端未提到
+    float q_values[CONTENT_ENCODING_COUNT] = {-1, -1, -1, -1};
+    float q_any = 0;
+    bool has_any = false;
+    size_t pos = 0;
+    while(pos < accept_encoding.size())
+    {
+        size_t end = accept_encoding.find(',', pos);
+        if(end == boost::beast::string_view::npos)
+            end = accept_encoding.size();
+        boost::beast::string_view item = accept_encoding.substr(pos, end - pos);
+        pos = end + 1;
+
+        float q = 1;
+        size_t semi = item.find(';');
+        if(semi != boost::beast::string_view::npos)
+        {
+            size_t qpos = item.find("q=", semi);
+            if(qpos != boost::beast::string_view::npos)
+                q = static_cast<float>(atof(item.substr(qpos + 2).to_string().c_str()));
+            item = item.substr(0, semi);
+        }
+        while(!item.empty() && item.front() == ' ')
+            item.remove_prefix(1);
+        while(!item.empty() && item.back() == ' ')
+            item.remove_suffix(1);
+
+        if(item == "*")
+        {
+            has_any = true;
+            q_any = q;
+            continue;
+        }
+        for(int i = 1; i < CONTENT_ENCODING_COUNT; ++i)
+        {
+            if(boost::beast::iequals(item, encoding_name(static_cast<CONTENT_ENCODING>(i))))
+                q_values[i] = q;
+        }
+    }
+
+    CONTENT_ENCODING best = CONTENT_ENCODING::IDENTITY;
+    float best_q = 0;
+    for(CONTENT_ENCODING e : preference)
+    {
+        int i = static_cast<int>(e);
+        if(!(available & (1u << i)))
+            continue;
+        float q = q_values[i] >= 0 ? q_values[i] : (has_any ? q_any : 0);
+        if(q > best_q)
+        {
+            best = e;
+            best_q = q;
+        }
+    }
+    return best;
+}
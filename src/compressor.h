@@ -0,0 +1,46 @@
+#ifndef COMPRESSOR_H
+#define COMPRESSOR_H
+
+#include "kconfig.h"
+
+/*
+宏定义说明
+FTS_WITH_BROTLI 启用br压缩(链接 brotlienc)
+FTS_WITH_ZSTD   启用zstd压缩(链接 zstd)
+gzip 始终可用(链接 z)
+*/
+
+enum class CONTENT_ENCODING
+{
+    IDENTITY = 0,
+    GZIP = 1,
+    ZSTD = 2,
+    BROTLI = 3
+};
+
+const int CONTENT_ENCODING_COUNT = 4;
+
+//Content-Encoding 名字
+const char* encoding_name(CONTENT_ENCODING e);
+//预压缩文件后缀
+const char* encoding_suffix(CONTENT_ENCODING e);
+//本次编译是否支持
+bool encoding_supported(CONTENT_ENCODING e);
+//解析 gzip,br,zstd 这样的配置
+bool parse_encoding(const string& name, CONTENT_ENCODING& e);
+
+//文本类文件才值得压缩
+bool is_compressible(boost::beast::string_view mime);
+
+//预压缩文件路径 {file_dir}/.variants/{name}{suffix}, 放在隐藏目录里不会和上传的文件重名
+string variant_path(const string& file_dir, const string& file_name, CONTENT_ENCODING e);
+//预压缩文件的ETag, 不同编码的表示必须不同
+string variant_etag(const string& etag, CONTENT_ENCODING e);
+
+//压缩 src 直接写入 dst, dst 由调用方保证唯一并在之后改名提交; 压缩率不足或失败时删除 dst, 返回false
+bool compress_file(const string& src, const string& dst, CONTENT_ENCODING e, int64_t& out_size);
+
+//根据 Accept-Encoding 在 available(按 CONTENT_ENCODING 位掩码) 中选择, 客户端都不接受时返回 IDENTITY
+CONTENT_ENCODING choose_encoding(boost::beast::string_view accept_encoding, uint32_t available);
+
+#endif // COMPRESSOR_H
@@ -0,0 +1,84 @@
+#include "compute_pool.h"
+#include "fiber_stack.h"
+#include <boost/fiber/algo/work_stealing.hpp>
+#include <boost/fiber/barrier.hpp>
+#include <boost/fiber/operations.hpp>
+
+ComputePool& ComputePool::instance()
+{
+    static ComputePool pool;
+    return pool;
+}
+
+ComputePool::~ComputePool()
+{
+    stop();
+}
+
+void ComputePool::init(size_t threads)
+{
+    if(threads == 0 || enabled())
+        return;
+    //所有线程装好调度器后才能开始窃取, 否则会访问到还未登记的线程
+    auto ready = std::make_shared<boost::fibers::barrier>(threads);
+    for(size_t i = 0; i < threads; ++i)
+    {
+        m_threads.emplace_back([this, threads, ready]() {
+            boost::fibers::use_scheduling_algorithm<boost::fibers::algo::work_stealing>(threads, true);
+            ready->wait();
+            workerLoop();
+        });
+    }
+    LogInfo << "compute pool started," << threads;
+}
+
+void ComputePool::stop()
+{
+    if(!enabled())
+        return;
+    m_tasks.close();
+    for(std::thread& t : m_threads)
+    {
+        t.join();
+    }
+    m_threads.clear();
+}
+
+void ComputePool::submit(std::function<void()> task)
+{
+    if(m_tasks.push(std::move(task)) != boost::fibers::channel_op_status::success)
+    {
+        LogErrorExt << "compute pool closed";
+    }
+}
+
+void ComputePool::workerLoop()
+{
+    std::function<void()> task;
+    while(m_tasks.pop(task) == boost::fibers::channel_op_status::success)
+    {
+        {
+            std::lock_guard<boost::fibers::mutex> lk(m_running_mutex);
+            ++m_running;
+        }
+        //主fiber只负责取任务, 任务fiber进入本线程就绪队列, 可能被其他线程窃取执行
+        make_fiber([this, task]() {
+            try
+            {
+                task();
+            }
+            catch(std::exception& e)
+            {
+                LogErrorExt << "compute task failed," << e.what();
+            }
+            std::lock_guard<boost::fibers::mutex> lk(m_running_mutex);
+            if(--m_running == 0)
+                m_running_cond.notify_all();
+        }).detach();
+        task = nullptr;
+        //让出给刚创建的任务, 队列里的任务不会都堆在取到它的线程上
+        boost::this_fiber::yield();
+    }
+    std::unique_lock<boost::fibers::mutex> lk(m_running_mutex);
+    m_running_cond.wait(lk, [this]() { return m_running == 0; });
+}
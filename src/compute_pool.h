@@ -0,0 +1,67 @@
+#ifndef COMPUTE_POOL_H
+#define COMPUTE_POOL_H
+
+#include "kconfig.h"
+#include <thread>
+#include <boost/fiber/buffered_channel.hpp>
+#include <boost/fiber/future.hpp>
+#include <boost/fiber/mutex.hpp>
+#include <boost/fiber/condition_variable.hpp>
+
+//CPU密集的计算(上传校验, 预压缩)在这里执行, 网络线程只负责收发
+//每个工作线程安装 boost::fibers 的 work_stealing 调度, 提交的任务作为fiber运行,
+//空闲线程从忙线程的就绪队列窃取, 几个大上传不会把计算压在同一个核上
+//work_stealing 的线程表是进程级的, 所以只有一个实例
+class ComputePool : private boost::noncopyable
+{
+public:
+    static ComputePool& instance();
+
+    //threads 为0时不启动, run/post 在调用方线程直接执行
+    void init(size_t threads);
+    bool enabled() const { return !m_threads.empty(); }
+    //关闭任务队列, 等待已提交的任务执行完
+    void stop();
+
+    //在计算线程执行 f, 当前fiber挂起等待结果
+    template<typename F>
+    auto run(F&& f) -> decltype(f())
+    {
+        if(!enabled())
+            return f();
+        typedef decltype(f()) R;
+        auto task = std::make_shared<boost::fibers::packaged_task<R()>>(std::forward<F>(f));
+        boost::fibers::future<R> fut = task->get_future();
+        submit([task]() { (*task)(); });
+        return fut.get();
+    }
+
+    //在计算线程执行 f, 不等待
+    template<typename F>
+    void post(F&& f)
+    {
+        if(!enabled())
+        {
+            f();
+            return;
+        }
+        submit(std::function<void()>(std::forward<F>(f)));
+    }
+
+private:
+    ComputePool() = default;
+    ~ComputePool();
+
+    void submit(std::function<void()> task);
+    void workerLoop();
+
+    //容量满时提交方fiber挂起, 计算跟不上时反压到上传连接
+    boost::fibers::buffered_channel<std::function<void()>> m_tasks{1024};
+    vector<std::thread> m_threads;
+    //正在执行的任务数, fiber 可能被其他线程窃取, 退出时统一等待
+    boost::fibers::mutex m_running_mutex;
+    boost::fibers::condition_variable m_running_cond;
+    size_t m_running = 0;
+};
+
+#endif // COMPUTE_POOL_H
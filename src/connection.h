@@ -0,0 +1,154 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include "kconfig.h"
+#include <boost/asio/compose.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/ssl.hpp>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+//SSL_* 返回 r 且不是 WANT_READ/WANT_WRITE 时对应的错误
+inline boost::system::error_code ssl_error(SSL* conn, int r)
+{
+    int err = SSL_get_error(conn, r);
+    if(err == SSL_ERROR_ZERO_RETURN || (err == SSL_ERROR_SYSCALL && ERR_peek_error() == 0))
+        return boost::asio::error::eof;
+    return boost::system::error_code(static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category());
+}
+
+//客户端连接, 满足 AsyncReadStream/AsyncWriteStream, beast 的读写可以直接使用
+//明文或内核TLS(kTLS)时直接读写 tcp socket, 可以在 socket() 上 sendfile
+//用户态TLS时读写经过 asio ssl::stream, 或握手时的SSL对象(协商出的算法内核不支持时), 每个字节只在TLS层处理一次
+class Connection : private boost::noncopyable
+{
+public:
+    typedef tcp::socket::executor_type executor_type;
+
+    explicit Connection(boost::asio::io_context& ioc) : m_socket(ioc) {}
+    ~Connection()
+    {
+        if(m_ssl)
+            SSL_free(m_ssl);
+    }
+
+    executor_type get_executor() noexcept { return m_socket.get_executor(); }
+    tcp::socket& socket() noexcept { return m_socket; }
+    //读写不经过用户态TLS
+    bool raw() const noexcept { return !m_stream && !m_ssl; }
+
+    //整个连接使用 ssl::stream, 返回的stream用来握手
+    boost::asio::ssl::stream<tcp::socket&>& useStream(boost::asio::ssl::context& ctx)
+    {
+        m_stream.reset(new boost::asio::ssl::stream<tcp::socket&>(m_socket, ctx));
+        return *m_stream;
+    }
+    //继续用握手时的SSL对象在非阻塞的socket上加解密, 接管 conn
+    void useSsl(SSL* conn) { m_ssl = conn; }
+
+    void shutdown(tcp::socket::shutdown_type what, boost::system::error_code& ec) { m_socket.shutdown(what, ec); }
+    void close(boost::system::error_code& ec) { m_socket.close(ec); }
+
+    template<class MutableBufferSequence, class ReadHandler>
+    BOOST_ASIO_INITFN_RESULT_TYPE(ReadHandler, void(boost::system::error_code, std::size_t))
+    async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler)
+    {
+        if(m_stream)
+            return m_stream->async_read_some(buffers, std::forward<ReadHandler>(handler));
+        if(m_ssl)
+        {
+            boost::asio::mutable_buffer b = first_buffer<boost::asio::mutable_buffer>(buffers);
+            return boost::asio::async_compose<ReadHandler, void(boost::system::error_code, std::size_t)>(
+                        SslOp{m_ssl, m_socket, b.data(), b.size(), false}, handler, m_socket);
+        }
+        return m_socket.async_read_some(buffers, std::forward<ReadHandler>(handler));
+    }
+
+    template<class ConstBufferSequence, class WriteHandler>
+    BOOST_ASIO_INITFN_RESULT_TYPE(WriteHandler, void(boost::system::error_code, std::size_t))
+    async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler)
+    {
+        if(m_stream)
+            return m_stream->async_write_some(buffers, std::forward<WriteHandler>(handler));
+        if(m_ssl)
+        {
+            boost::asio::const_buffer b = first_buffer<boost::asio::const_buffer>(buffers);
+            return boost::asio::async_compose<WriteHandler, void(boost::system::error_code, std::size_t)>(
+                        SslOp{m_ssl, m_socket, const_cast<void*>(b.data()), b.size(), true}, handler, m_socket);
+        }
+        return m_socket.async_write_some(buffers, std::forward<WriteHandler>(handler));
+    }
+
+private:
+    //与 ssl::stream 一样每次只处理第一个非空的buffer
+    template<class Buffer, class BufferSequence>
+    static Buffer first_buffer(const BufferSequence& buffers)
+    {
+        for(auto it = boost::asio::buffer_sequence_begin(buffers); it != boost::asio::buffer_sequence_end(buffers); ++it)
+        {
+            Buffer b(*it);
+            if(b.size() > 0)
+                return b;
+        }
+        return Buffer();
+    }
+
+    //一次 SSL_read/SSL_write, WANT_* 时等待socket就绪后用同样的参数重试
+    //结果立即可用时投递一次再完成, 不在发起操作的调用中回调
+    struct SslOp
+    {
+        SSL* conn;
+        tcp::socket& socket;
+        void* data;
+        size_t size;
+        bool write;
+        bool waited = false;
+        bool done = false;
+        boost::system::error_code ec;
+        size_t n = 0;
+
+        template<class Self>
+        void operator()(Self& self, boost::system::error_code wait_ec = boost::system::error_code())
+        {
+            if(done)
+                return self.complete(ec, n);
+            if(wait_ec)
+                return self.complete(wait_ec, 0);
+            if(size > 0)
+            {
+                int len = static_cast<int>(std::min<size_t>(size, 1 << 30));
+                ERR_clear_error();
+                int r = write ? SSL_write(conn, data, len) : SSL_read(conn, data, len);
+                if(r > 0)
+                {
+                    n = static_cast<size_t>(r);
+                }
+                else
+                {
+                    int err = SSL_get_error(conn, r);
+                    if(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+                    {
+                        waited = true;
+                        socket.async_wait(err == SSL_ERROR_WANT_READ ? tcp::socket::wait_read : tcp::socket::wait_write,
+                                          std::move(self));
+                        return;
+                    }
+                    ec = ssl_error(conn, r);
+                }
+            }
+            if(waited)
+                return self.complete(ec, n);
+            done = true;
+            boost::asio::post(socket.get_executor(), std::move(self));
+        }
+    };
+
+    //m_stream 引用 m_socket, 声明在后先析构
+    tcp::socket m_socket;
+    std::unique_ptr<boost::asio::ssl::stream<tcp::socket&>> m_stream;
+    SSL* m_ssl = nullptr;
+};
+
+typedef std::shared_ptr<Connection> ConnectionPtr;
+
+#endif // CONNECTION_H
@@ -1,24 +1,185 @@
 #include "down_task.h"
+#include "fiber_stack.h"
 
-DownTask::DownTask(const TransportContext& cxt) : m_cxt(cxt)
+DownTask::DownTask(const TransportContext& cxt) : m_socket(cxt.socket), m_file_size(cxt.file_size)
+#ifdef FTS_AWAITABLE
+    , m_wakeup(cxt.socket->get_executor())
+#endif
 {
     m_running = false;
+#ifdef FTS_AWAITABLE
+    m_done_future = m_done.get_future();
+#endif
 }
 
+void DownTask::initResponse(http::response<http::buffer_body>& res) const
+{
+    res.result(http::status::ok);
+    res.version(11);
+    //大小未知(multipart中的part)或中途加入时使用chunked
+    if(m_start_offset > 0)
+    {
+        res.set("X-Start-Offset", std::to_string(m_start_offset));
+        res.chunked(true);
+    }
+    else if(m_file_size >= 0)
+        res.content_length(m_file_size);
+    else
+        res.chunked(true);
+    res.body().data = nullptr;
+    res.body().more = true;
+}
+
+std::shared_ptr<string> DownTask::skip(std::shared_ptr<string> buf)
+{
+    if(m_skip > 0)
+    {
+        if(static_cast<int64_t>(buf->size()) <= m_skip)
+        {
+            m_skip -= buf->size();
+            return nullptr;
+        }
+        buf = std::make_shared<string>(buf->substr(static_cast<size_t>(m_skip)));
+        m_skip = 0;
+    }
+    return buf;
+}
+
+#ifdef FTS_AWAITABLE
 void DownTask::start()
 {
     m_running = true;
     auto self(shared_from_this());
-    m_send_fiber = boost::fibers::fiber([this, self]() {
-        auto socket = m_cxt.socket;
+    boost::asio::co_spawn(m_socket->get_executor(), [this, self]() -> boost::asio::awaitable<void> {
+        try
+        {
+            co_await sendLoop();
+        }
+        catch(std::exception& e)
+        {
+            LogErrorExt << e.what();
+        }
+        m_running = false;
+        m_done.set_value();
+    }, boost::asio::detached);
+}
+
+boost::asio::awaitable<std::shared_ptr<string>> DownTask::pop()
+{
+    for(;;)
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            if(!m_send_buffers.empty())
+            {
+                std::shared_ptr<string> buf = m_send_buffers.front();
+                m_send_buffers.pop_front();
+                co_return buf;
+            }
+            m_waiting = true;
+        }
+        //cancel 在同一个线程上执行, 不会早于 async_wait
+        BSError ec;
+        m_wakeup.expires_at(boost::asio::steady_timer::time_point::max());
+        co_await m_wakeup.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    }
+}
+
+boost::asio::awaitable<void> DownTask::sendLoop()
+{
+    auto socket = m_socket;
+    boost::beast::error_code ec;
+    auto token = boost::asio::redirect_error(boost::asio::use_awaitable, ec);
+
+    http::response<http::buffer_body> res;
+    initResponse(res);
+    http::response_serializer<http::buffer_body, http::fields> sr{res};
+    co_await http::async_write_header(*socket, sr, token);
+    if(ec)
+    {
+        LogErrorExt << ec.message();
+        co_return;
+    }
+    for(;;)
+    {
+        std::shared_ptr<string> buf = co_await pop();
+        if(!buf) //空指针 结束
+        {
+            if(!m_complete)
+            {
+                LogWarnExt << "upload not complete, close download";
+                socket->close(ec);
+                co_return;
+            }
+            res.body().data = nullptr;
+            res.body().more = false;
+            co_await http::async_write(*socket, sr, token);
+            if(ec == http::error::need_buffer)
+            {
+                ec = {};
+            }
+            if(ec)
+            {
+                LogErrorExt << ec.message();
+            }
+            co_return;
+        }
+
+        buf = skip(buf);
+        if(!buf)
+            continue;
+        res.body().data = const_cast<char*>(buf->c_str());
+        res.body().size = buf->size();
+        res.body().more = true;
+        co_await http::async_write(*socket, sr, token);
+        if(ec == http::error::need_buffer)
+        {
+            ec = {};
+        }
+        if(ec)
+        {
+            LogErrorExt << ec.message();
+            co_return;
+        }
+    }
+}
+
+void DownTask::stop(bool complete)
+{
+    m_complete = complete;
+    //发送空指针表示结束
+    send(nullptr);
+    if(m_done_future.valid())
+    {
+        m_done_future.get();
+    }
+    m_running = false;
+}
+
+void DownTask::send(const std::shared_ptr<string>& buf)
+{
+    if(buf && !m_running)
+        return;
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_send_buffers.push_back(buf);
+    if(m_waiting)
+    {
+        m_waiting = false;
+        auto self(shared_from_this());
+        boost::asio::post(m_socket->get_executor(), [this, self]() { m_wakeup.cancel(); });
+    }
+}
+#else
+void DownTask::start()
+{
+    m_running = true;
+    auto self(shared_from_this());
+    m_send_fiber = make_fiber([this, self]() {
+        auto socket = m_socket;
         boost::beast::error_code ec;
 
         http::response<http::buffer_body> res;
-        res.result(http::status::ok);
-        res.version(11);
-        res.content_length(m_cxt.file_size);
-        res.body().data = nullptr;
-        res.body().more = true;
+        initResponse(res);
         http::response_serializer<http::buffer_body, http::fields> sr{res};
         http::async_write_header(*socket, sr, boost::fibers::asio::yield[ec]);
         if(ec)
@@ -30,23 +191,16 @@ void DownTask::start()
         std::shared_ptr<string> buf;
         while(1)
         {
-//            {
-//                std::unique_lock<boost::fibers::mutex> lk(m_mutex);
-//                if(m_send_buffers.empty())
-//                {
-//                    lk.unlock();
-//                    boost::this_fiber::sleep_for(std::chrono::milliseconds(10));
-//                    continue;
-//                }
-//                else
-//                {
-//                    buf = m_send_buffers.front();
-//                    m_send_buffers.pop();
-//                }
-//            }
             buf = m_send_buffers.pop();
             if(!buf) //空指针 结束
             {
+                if(!m_complete)
+                {
+                    LogWarnExt << "upload not complete, close download";
+                    socket->close(ec);
+                    m_running = false;
+                    return;
+                }
                 res.body().data = nullptr;
                 res.body().more = false;
                 http::async_write(*socket, sr, boost::fibers::asio::yield[ec]);
@@ -61,8 +215,12 @@ void DownTask::start()
                     return;
                 }
                 m_running = false;
+                return;
             }
 
+            buf = skip(buf);
+            if(!buf)
+                continue;
             res.body().data = const_cast<char*>(buf->c_str());
             res.body().size = buf->size();
             res.body().more = true;
@@ -77,19 +235,15 @@ void DownTask::start()
                 m_running = false;
                 return;
             }
-
-
         }
     });
 }
 
-void DownTask::stop()
+void DownTask::stop(bool complete)
 {
-    {
-        //发送空指针表示结束
-        //std::lock_guard<boost::fibers::mutex> lk(m_mutex);
-        m_send_buffers.push(nullptr);
-    }
+    m_complete = complete;
+    //发送空指针表示结束
+    m_send_buffers.push(nullptr);
     if(m_send_fiber.joinable())
     {
         m_send_fiber.join();
@@ -101,6 +255,6 @@ void DownTask::send(const std::shared_ptr<string>& buf)
 {
     if(!m_running)
         return;
-    //std::lock_guard<boost::fibers::mutex> lk(m_mutex);
     m_send_buffers.push(buf);
 }
+#endif
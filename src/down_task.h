@@ -3,26 +3,58 @@
 
 #include "kconfig.h"
 #include "transport_server.h"
-//#include <boost/thread/sync_queue.hpp>
+#ifdef FTS_AWAITABLE
+#include <boost/fiber/future.hpp>
+#include <mutex>
+#include <deque>
+#else
 #include "fiber_unbounded_buffer.h"
+#endif
 
+//边上传边下载的发送方, 按入队顺序把收到的数据写给下载连接
+//FTS_AWAITABLE 时发送方是 socket 所在 io_context 上的协程, 否则是一个fiber
 class DownTask : public std::enable_shared_from_this<DownTask>
 {
 public:
     DownTask(const TransportContext& cxt);
     virtual ~DownTask() = default;
 
+    //不从头开始时使用chunked, 应答头 X-Start-Offset 为开始的偏移
+    //skip 为之后收到的数据中需要丢弃的字节数, 必须在 start 之前调用
+    void setStartOffset(int64_t offset, int64_t skip) { m_start_offset = offset; m_skip = skip; }
     void start();
-    void stop();
+    //complete 为false时直接断开连接, 不发送body结束; 等待发送方结束
+    void stop(bool complete = true);
     void send(const std::shared_ptr<string>& buf);
 
 private:
+    void initResponse(http::response<http::buffer_body>& res) const;
+    //丢弃 m_skip 覆盖的部分, 整块丢弃时返回空
+    std::shared_ptr<string> skip(std::shared_ptr<string> buf);
+
     std::atomic_bool m_running;
-    TransportContext m_cxt;
+    std::atomic_bool m_complete{true};
+    int64_t m_start_offset = 0;
+    int64_t m_skip = 0;
+    //只保留发送需要的部分, 不复制请求的路径与参数
+    ConnectionPtr m_socket;
+    int64_t m_file_size;
+#ifdef FTS_AWAITABLE
+    boost::asio::awaitable<void> sendLoop();
+    //取下一块, 队列为空时等待 send/stop, 空指针表示结束
+    boost::asio::awaitable<std::shared_ptr<string>> pop();
+
+    std::mutex m_mutex;
+    std::deque<std::shared_ptr<string>> m_send_buffers;
+    //协程在等待时为true, send/stop 投递 cancel 唤醒它
+    bool m_waiting = false;
+    boost::asio::steady_timer m_wakeup;
+    boost::fibers::promise<void> m_done;
+    boost::fibers::future<void> m_done_future;
+#else
     boost::fibers::fiber m_send_fiber;
-    //boost::fibers::mutex m_mutex;
-    //std::queue<std::shared_ptr<string>> m_send_buffers; //后续替换成使用 boost::fibers::condition_variable 的队列
     fiber_unbounded_queue<std::shared_ptr<string>> m_send_buffers;
+#endif
 };
 
 #endif // DOWN_TASK_H
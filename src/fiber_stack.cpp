@@ -0,0 +1,136 @@
+#include "fiber_stack.h"
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+size_t s_stack_size = 128 * 1024;   //与 boost 默认栈大小相同
+bool s_guard = true;
+size_t s_max_cached = 256;
+bool s_report = false;
+std::atomic<size_t> s_high_water{0};
+
+size_t page_size()
+{
+    static const size_t size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    return size;
+}
+
+//包括保护页的映射大小
+size_t mapped_size()
+{
+    return s_stack_size + (s_guard ? page_size() : 0);
+}
+
+//线程退出时释放缓存的栈
+//调度器在线程退出过程中仍可能回收fiber, 缓存析构后直接 munmap
+thread_local bool t_cache_closed = false;
+
+struct StackCache
+{
+    vector<void*> stacks;
+    ~StackCache()
+    {
+        t_cache_closed = true;
+        for(void* p : stacks)
+        {
+            ::munmap(p, mapped_size());
+        }
+    }
+};
+
+thread_local StackCache t_cache;
+
+//栈从高地址向低地址增长, 从低端找到第一个非0的字得到用过的深度
+//之后把用过的页还给系统, 重新映射的页全为0, 下一次统计仍然准确
+void measure(char* low, size_t size)
+{
+    const uint64_t* p = reinterpret_cast<const uint64_t*>(low);
+    const uint64_t* end = reinterpret_cast<const uint64_t*>(low + size);
+    while(p != end && *p == 0)
+    {
+        ++p;
+    }
+    size_t used = static_cast<size_t>(reinterpret_cast<const char*>(end) - reinterpret_cast<const char*>(p));
+    if(used == 0)
+        return;
+    char* touched = low + (size - used) / page_size() * page_size();
+    ::madvise(touched, low + size - touched, MADV_DONTNEED);
+
+    size_t old = s_high_water.load();
+    while(used > old)
+    {
+        if(s_high_water.compare_exchange_weak(old, used))
+        {
+            if(used > size / 4 * 3)
+            {
+                LogWarnExt << "fiber stack high water near limit," << used << "," << size;
+            }
+            else
+            {
+                LogInfo << "fiber stack high water," << used << "," << size;
+            }
+            break;
+        }
+    }
+}
+}
+
+void FiberStackPool::init(size_t stack_size, bool guard, size_t max_cached, bool report)
+{
+    size_t page = page_size();
+    s_stack_size = std::max<size_t>(16 * 1024, (stack_size + page - 1) / page * page);
+    s_guard = guard;
+    s_max_cached = max_cached;
+    s_report = report;
+}
+
+size_t FiberStackPool::highWater()
+{
+    return s_high_water;
+}
+
+boost::context::stack_context FiberStackPool::allocate()
+{
+    size_t size = mapped_size();
+    void* base = nullptr;
+    if(!t_cache_closed && !t_cache.stacks.empty())
+    {
+        base = t_cache.stacks.back();
+        t_cache.stacks.pop_back();
+    }
+    else
+    {
+        base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if(base == MAP_FAILED)
+            throw std::bad_alloc();
+        if(s_guard && ::mprotect(base, page_size(), PROT_NONE) != 0)
+        {
+            ::munmap(base, size);
+            throw std::bad_alloc();
+        }
+    }
+    boost::context::stack_context sctx;
+    sctx.size = size;
+    sctx.sp = static_cast<char*>(base) + size;
+    return sctx;
+}
+
+void FiberStackPool::deallocate(boost::context::stack_context& sctx) noexcept
+{
+    size_t size = mapped_size();
+    char* base = static_cast<char*>(sctx.sp) - size;
+    if(s_report)
+    {
+        size_t guard = s_guard ? page_size() : 0;
+        measure(base + guard, size - guard);
+    }
+    //fiber 可能被其他线程窃取后结束, 栈放进结束时所在线程的缓存
+    if(!t_cache_closed && t_cache.stacks.size() < s_max_cached)
+    {
+        t_cache.stacks.push_back(base);
+    }
+    else
+    {
+        ::munmap(base, size);
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef FIBER_STACK_H
+#define FIBER_STACK_H
+
+#include "kconfig.h"
+#include <boost/fiber/fiber.hpp>
+#include <boost/context/stack_context.hpp>
+
+/*
+宏定义说明
+FTS_SEGMENTED_STACKS 使用分段栈, 栈按需增长, 不使用栈池
+                     需要 boost 以 segmented-stacks=on 编译, 并且所有代码用 -fsplit-stack 编译
+*/
+
+#ifdef FTS_SEGMENTED_STACKS
+#include <boost/fiber/segmented_stack.hpp>
+#endif
+
+//fiber 栈分配器, 每个线程缓存释放的栈, 新建连接与请求不需要 mmap/munmap
+//guard 为true时栈底保留一页不可访问, 栈溢出立即段错误而不是改写相邻内存
+//report 为true时回收栈前统计用过的深度并把用过的页还给系统, 出现新的最高水位时记日志, 用来确定栈大小
+class FiberStackPool
+{
+public:
+    //必须在创建第一个fiber之前调用
+    static void init(size_t stack_size, bool guard, size_t max_cached, bool report);
+    //所有线程出现过的最大栈使用字节数, 只在 report 为true时统计
+    static size_t highWater();
+
+    boost::context::stack_context allocate();
+    void deallocate(boost::context::stack_context& sctx) noexcept;
+};
+
+#ifdef FTS_SEGMENTED_STACKS
+typedef boost::fibers::segmented_stack FiberStackAllocator;
+#else
+typedef FiberStackPool FiberStackAllocator;
+#endif
+
+//按配置的栈创建fiber, 代替直接构造 boost::fibers::fiber
+template<typename Fn>
+boost::fibers::fiber make_fiber(Fn&& fn)
+{
+    return boost::fibers::fiber(std::allocator_arg, FiberStackAllocator(), std::forward<Fn>(fn));
+}
+
+#endif // FIBER_STACK_H
@@ -0,0 +1,347 @@
+#include "file_index.h"
+#include <future>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/xattr.h>
+
+namespace {
+struct ScanEntry
+{
+    string dir;
+    string name;
+    FileMeta meta;
+};
+
+const char* DIGEST_XATTR = "user.fts.digest";
+
+string digest_etag(const string& digest)
+{
+    return "\"" + digest + "\"";
+}
+
+void load_file_digest(const string& path, FileMeta& meta)
+{
+    char buf[128];
+    ssize_t n = ::getxattr(path.c_str(), DIGEST_XATTR, buf, sizeof(buf));
+    if(n > 0)
+    {
+        meta.digest.assign(buf, n);
+        meta.etag = digest_etag(meta.digest);
+    }
+}
+
+bool valid_dir_name(const char* name)
+{
+    size_t n = 0;
+    for(; name[n]; ++n)
+    {
+        if(!isalnum(static_cast<unsigned char>(name[n])))
+            return false;
+    }
+    return n > 0 && n <= 32;
+}
+
+bool ends_with(const string& s, const char* suffix)
+{
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+//把 {dir}/.variants 下比原文件新的预压缩文件挂到 entries[first, end) 上
+void scan_variants(const string& dir_path, vector<ScanEntry>& entries, size_t first)
+{
+    string variants_dir = dir_path + "/.variants";
+    DIR* vd = ::opendir(variants_dir.c_str());
+    if(!vd)
+        return;
+    std::map<string, size_t> names;
+    for(size_t i = first; i < entries.size(); ++i)
+    {
+        names.emplace(entries[i].name, i);
+    }
+    int vd_fd = ::dirfd(vd);
+    while(struct dirent* ve = ::readdir(vd))
+    {
+        string vname = ve->d_name;
+        for(int i = 1; i < CONTENT_ENCODING_COUNT; ++i)
+        {
+            CONTENT_ENCODING e = static_cast<CONTENT_ENCODING>(i);
+            if(!encoding_supported(e) || !ends_with(vname, encoding_suffix(e)))
+                continue;
+            auto it = names.find(vname.substr(0, vname.size() - strlen(encoding_suffix(e))));
+            struct stat st;
+            if(it == names.end() || ::fstatat(vd_fd, ve->d_name, &st, 0) != 0)
+                break;
+            FileMeta& meta = entries[it->second].meta;
+            if(st.st_mtim.tv_sec >= meta.mtime)
+            {
+                meta.encodings |= (1u << i);
+                meta.encoded_size[i] = st.st_size;
+            }
+            break;
+        }
+    }
+    ::closedir(vd);
+}
+
+//扫描 root/{dir}/{name}, 只有两层目录
+void scan_root(const StorageRoot& root, vector<ScanEntry>& entries)
+{
+    DIR* top = ::opendir(root.path().c_str());
+    if(!top)
+    {
+        LogErrorExt << "opendir failed," << strerror(errno) << "," << root.path();
+        return;
+    }
+    while(struct dirent* de = ::readdir(top))
+    {
+        if(!valid_dir_name(de->d_name))
+            continue;
+        string dir_path = root.path() + "/" + de->d_name;
+        DIR* sub = ::opendir(dir_path.c_str());
+        if(!sub)
+            continue;
+        int sub_fd = ::dirfd(sub);
+        size_t first = entries.size();
+        while(struct dirent* fe = ::readdir(sub))
+        {
+            if(fe->d_name[0] == '.')
+                continue;
+            ScanEntry e;
+            e.name = fe->d_name;
+            if(ends_with(e.name, ".tmp"))
+                continue;
+            struct stat st;
+            if(::fstatat(sub_fd, fe->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+                continue;
+            e.dir = de->d_name;
+            e.meta.size = st.st_size;
+            e.meta.mtime = st.st_mtim.tv_sec;
+            e.meta.etag = make_file_etag(st.st_ino, st.st_size, st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+            e.meta.root = root.index();
+            load_file_digest(dir_path + "/" + e.name, e.meta);
+            entries.push_back(std::move(e));
+        }
+        ::closedir(sub);
+        scan_variants(dir_path, entries, first);
+    }
+    ::closedir(top);
+}
+}
+
+string make_file_etag(uint64_t inode, int64_t size, int64_t mtime_ns)
+{
+    char buf[80];
+    int n = snprintf(buf, sizeof(buf), "\"%llx-%llx-%llx\"",
+                     static_cast<unsigned long long>(inode),
+                     static_cast<unsigned long long>(size),
+                     static_cast<unsigned long long>(mtime_ns));
+    return string(buf, n);
+}
+
+bool stat_file_meta(const string& path, size_t root, FileMeta& meta)
+{
+    struct stat st;
+    if(::stat(path.c_str(), &st) != 0)
+        return false;
+    meta.size = st.st_size;
+    meta.mtime = st.st_mtim.tv_sec;
+    meta.etag = make_file_etag(st.st_ino, st.st_size, st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+    meta.root = root;
+    return true;
+}
+
+void save_file_digest(const string& path, const string& digest, FileMeta& meta)
+{
+    if(::setxattr(path.c_str(), DIGEST_XATTR, digest.data(), digest.size(), 0) != 0)
+    {
+        LogWarnExt << "setxattr failed," << strerror(errno) << "," << path;
+    }
+    meta.digest = digest;
+    meta.etag = digest_etag(digest);
+}
+
+void FileIndex::build(Storage& storage)
+{
+    const vector<StorageRootPtr>& roots = storage.roots();
+    vector<vector<ScanEntry>> results(roots.size());
+    vector<std::future<void>> waits;
+    for(size_t i = 0; i < roots.size(); ++i)
+    {
+        auto task = std::make_shared<std::packaged_task<void()>>([&roots, &results, i]() {
+            scan_root(*roots[i], results[i]);
+        });
+        waits.push_back(task->get_future());
+        roots[i]->post([task]() { (*task)(); });
+    }
+    for(auto& w : waits)
+    {
+        w.get();
+    }
+
+    std::unique_lock<std::shared_mutex> lk(m_mutex);
+    for(vector<ScanEntry>& entries : results)
+    {
+        for(ScanEntry& e : entries)
+        {
+            DirEntries& dir = m_dirs[e.dir];
+            auto it = dir.find(e.name);
+            if(it == dir.end())
+            {
+                dir.emplace(std::move(e.name), std::move(e.meta));
+                ++m_count;
+            }
+            else if(e.meta.mtime > it->second.mtime)
+            {
+                //同一路径存在于多块盘时以最新的为准
+                it->second = std::move(e.meta);
+            }
+        }
+    }
+    LogInfo << "file index built, files:" << m_count << ",dirs:" << m_dirs.size();
+}
+
+bool FileIndex::find(const string& dir, const string& name, FileMeta& meta) const
+{
+    std::shared_lock<std::shared_mutex> lk(m_mutex);
+    auto it_dir = m_dirs.find(dir);
+    if(it_dir == m_dirs.end())
+        return false;
+    auto it = it_dir->second.find(name);
+    if(it == it_dir->second.end())
+        return false;
+    meta = it->second;
+    return true;
+}
+
+bool FileIndex::put(const string& dir, const string& name, const FileMeta& meta, FileMeta* old)
+{
+    std::unique_lock<std::shared_mutex> lk(m_mutex);
+    DirEntries& entries = m_dirs[dir];
+    auto it = entries.find(name);
+    if(it == entries.end())
+    {
+        entries.emplace(name, meta);
+        ++m_count;
+        return false;
+    }
+    if(old)
+        *old = it->second;
+    it->second = meta;
+    return true;
+}
+
+bool FileIndex::erase(const string& dir, const string& name, FileMeta* old)
+{
+    std::unique_lock<std::shared_mutex> lk(m_mutex);
+    auto it_dir = m_dirs.find(dir);
+    if(it_dir == m_dirs.end())
+        return false;
+    auto it = it_dir->second.find(name);
+    if(it == it_dir->second.end())
+        return false;
+    if(old)
+        *old = it->second;
+    it_dir->second.erase(it);
+    --m_count;
+    if(it_dir->second.empty())
+        m_dirs.erase(it_dir);
+    return true;
+}
+
+bool FileIndex::addVariant(const string& dir, const string& name, const string& etag, CONTENT_ENCODING e, int64_t size)
+{
+    std::unique_lock<std::shared_mutex> lk(m_mutex);
+    auto it_dir = m_dirs.find(dir);
+    if(it_dir == m_dirs.end())
+        return false;
+    auto it = it_dir->second.find(name);
+    if(it == it_dir->second.end() || it->second.etag != etag)
+        return false;
+    it->second.encodings |= (1u << static_cast<int>(e));
+    it->second.encoded_size[static_cast<int>(e)] = size;
+    return true;
+}
+
+bool FileIndex::dropVariant(const string& dir, const string& name, const string& etag, CONTENT_ENCODING e)
+{
+    std::unique_lock<std::shared_mutex> lk(m_mutex);
+    auto it_dir = m_dirs.find(dir);
+    if(it_dir == m_dirs.end())
+        return false;
+    auto it = it_dir->second.find(name);
+    if(it == it_dir->second.end() || it->second.etag != etag)
+        return false;
+    it->second.encodings &= ~(1u << static_cast<int>(e));
+    it->second.encoded_size[static_cast<int>(e)] = 0;
+    return true;
+}
+
+bool FileIndex::relocate(const string& dir, const string& name, size_t root, uint32_t from_segment, int64_t from_offset,
+                         uint32_t to_segment, int64_t to_offset)
+{
+    std::unique_lock<std::shared_mutex> lk(m_mutex);
+    auto it_dir = m_dirs.find(dir);
+    if(it_dir == m_dirs.end())
+        return false;
+    auto it = it_dir->second.find(name);
+    if(it == it_dir->second.end() || it->second.root != root ||
+            it->second.segment != from_segment || it->second.offset != from_offset)
+        return false;
+    it->second.segment = to_segment;
+    it->second.offset = to_offset;
+    return true;
+}
+
+bool FileIndex::setCrc32(const string& dir, const string& name, const string& etag, uint32_t crc32)
+{
+    std::unique_lock<std::shared_mutex> lk(m_mutex);
+    auto it_dir = m_dirs.find(dir);
+    if(it_dir == m_dirs.end())
+        return false;
+    auto it = it_dir->second.find(name);
+    if(it == it_dir->second.end() || it->second.etag != etag)
+        return false;
+    it->second.has_crc32 = true;
+    it->second.crc32 = crc32;
+    return true;
+}
+
+bool FileIndex::list(const string& dir, const string& prefix, const string& after, size_t limit,
+                     vector<std::pair<string, FileMeta>>& entries, bool& more) const
+{
+    more = false;
+    std::shared_lock<std::shared_mutex> lk(m_mutex);
+    auto it_dir = m_dirs.find(dir);
+    if(it_dir == m_dirs.end())
+        return false;
+    const DirEntries& names = it_dir->second;
+    //游标在前缀范围之前时从前缀开始
+    auto it = after < prefix ? names.lower_bound(prefix) : names.upper_bound(after);
+    for(; it != names.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+    {
+        if(entries.size() == limit)
+        {
+            more = true;
+            break;
+        }
+        entries.emplace_back(it->first, it->second);
+    }
+    return true;
+}
+
+bool FileIndex::listDir(const string& dir, vector<std::pair<string, FileMeta>>& entries) const
+{
+    std::shared_lock<std::shared_mutex> lk(m_mutex);
+    auto it_dir = m_dirs.find(dir);
+    if(it_dir == m_dirs.end())
+        return false;
+    entries.assign(it_dir->second.begin(), it_dir->second.end());
+    return true;
+}
+
+size_t FileIndex::size() const
+{
+    std::shared_lock<std::shared_mutex> lk(m_mutex);
+    return m_count;
+}
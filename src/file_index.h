@@ -0,0 +1,71 @@
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+
+#include "kconfig.h"
+#include "storage.h"
+#include "compressor.h"
+#include <shared_mutex>
+#include <unordered_map>
+
+//已存储文件的元数据
+struct FileMeta
+{
+    int64_t size = 0;
+    time_t mtime = 0;
+    string etag;
+    string digest;      //上传时校验过的内容摘要, Digest 头格式
+    size_t root = 0;    //所在存储根目录下标
+    uint32_t encodings = 0;     //已有的预压缩文件, 按 CONTENT_ENCODING 位掩码
+    int64_t encoded_size[CONTENT_ENCODING_COUNT] = {0};
+    bool has_crc32 = false;     //打包zip时计算后缓存
+    uint32_t crc32 = 0;
+    uint32_t segment = 0;       //0表示独立文件, 否则为打包存储的段文件编号
+    int64_t offset = 0;         //数据在段文件中的偏移
+};
+
+//由 inode,大小,修改时间生成的ETag
+string make_file_etag(uint64_t inode, int64_t size, int64_t mtime_ns);
+//stat 文件得到元数据, 失败返回false
+bool stat_file_meta(const string& path, size_t root, FileMeta& meta);
+//内容摘要保存到文件扩展属性, 有摘要的文件用摘要作为ETag
+void save_file_digest(const string& path, const string& digest, FileMeta& meta);
+
+//内存中的文件索引 {dir} -> {name} -> FileMeta
+//启动时并行扫描所有存储根目录建立, 之后由上传完成与删除维护, 存在性判断与404不访问磁盘
+class FileIndex : private boost::noncopyable
+{
+public:
+    //每个存储根目录在自己的IO线程上扫描, 阻塞到全部完成
+    void build(Storage& storage);
+
+    bool find(const string& dir, const string& name, FileMeta& meta) const;
+    //替换已有的文件时返回true, old 为被替换的元数据
+    bool put(const string& dir, const string& name, const FileMeta& meta, FileMeta* old = nullptr);
+    bool erase(const string& dir, const string& name, FileMeta* old = nullptr);
+    //记录预压缩文件, 文件已被替换(etag不同)时返回false
+    bool addVariant(const string& dir, const string& name, const string& etag, CONTENT_ENCODING e, int64_t size);
+    //预压缩文件已不存在时去掉记录, 文件已被替换(etag不同)时返回false
+    bool dropVariant(const string& dir, const string& name, const string& etag, CONTENT_ENCODING e);
+    //段压缩后更新文件位置, 文件已被删除或替换(不在原位置)时返回false
+    bool relocate(const string& dir, const string& name, size_t root, uint32_t from_segment, int64_t from_offset,
+                  uint32_t to_segment, int64_t to_offset);
+    //缓存文件的CRC32, 文件已被替换(etag不同)时返回false
+    bool setCrc32(const string& dir, const string& name, const string& etag, uint32_t crc32);
+    //按名字分页列目录: 只取以 prefix 开头且大于 after 的最多 limit 个, more 表示后面还有
+    //目录不存在返回false
+    bool list(const string& dir, const string& prefix, const string& after, size_t limit,
+              vector<std::pair<string, FileMeta>>& entries, bool& more) const;
+    //目录下所有文件按名字排序的快照, 目录不存在返回false
+    bool listDir(const string& dir, vector<std::pair<string, FileMeta>>& entries) const;
+
+    size_t size() const;
+
+private:
+    typedef std::map<string, FileMeta> DirEntries;
+
+    mutable std::shared_mutex m_mutex;
+    std::unordered_map<string, DirEntries> m_dirs;
+    size_t m_count = 0;
+};
+
+#endif // FILE_INDEX_H
@@ -0,0 +1,79 @@
+#ifndef HASH_RING_H
+#define HASH_RING_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+//一致性哈希环,节点用下标表示,每个节点放置若干虚拟节点
+//哈希函数固定为FNV-1a,不依赖标准库实现,不同进程,不同机器计算结果一致
+class HashRing
+{
+public:
+    static uint64_t hash(const char* data, size_t size)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        for(size_t i = 0; i < size; ++i)
+        {
+            h ^= static_cast<unsigned char>(data[i]);
+            h *= 1099511628211ULL;
+        }
+        //FNV对短key分布较差,再做一次混合
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+    static uint64_t hash(const std::string& key) { return hash(key.data(), key.size()); }
+
+    //name 用于生成虚拟节点位置,同名节点在任何进程中位置相同
+    void addNode(size_t index, const std::string& name, size_t vnodes = 128)
+    {
+        for(size_t i = 0; i < vnodes; ++i)
+        {
+            std::string vname = name + "#" + std::to_string(i);
+            m_ring.emplace(hash(vname), index);
+        }
+        if(index + 1 > m_node_count)
+            m_node_count = index + 1;
+    }
+
+    bool empty() const { return m_ring.empty(); }
+
+    //key 的首选节点
+    size_t primary(const std::string& key) const
+    {
+        auto it = m_ring.lower_bound(hash(key));
+        if(it == m_ring.end())
+            it = m_ring.begin();
+        return it->second;
+    }
+
+    //按环顺时针方向给出 key 的节点偏好顺序,每个节点只出现一次
+    std::vector<size_t> preference(const std::string& key) const
+    {
+        std::vector<size_t> nodes;
+        if(m_ring.empty())
+            return nodes;
+        std::vector<bool> seen(m_node_count, false);
+        auto it = m_ring.lower_bound(hash(key));
+        for(size_t n = 0; n < m_ring.size() && nodes.size() < m_node_count; ++n, ++it)
+        {
+            if(it == m_ring.end())
+                it = m_ring.begin();
+            if(!seen[it->second])
+            {
+                seen[it->second] = true;
+                nodes.push_back(it->second);
+            }
+        }
+        return nodes;
+    }
+
+private:
+    std::multimap<uint64_t, size_t> m_ring;
+    size_t m_node_count = 0;
+};
+
+#endif // HASH_RING_H
@@ -1,6 +1,8 @@
 #include "kconfig.h"
+#include "compressor.h"
 
 #include <boost/log/attributes.hpp>
+#include <boost/algorithm/string.hpp>
 #include <iostream>
 using std::cout;
 using std::endl;
@@ -16,6 +18,23 @@ std::map<string, boost::log::trivial::severity_level> logger_levels = {
     {"error", boost::log::trivial::error},
     {"fatal", boost::log::trivial::fatal}
 };
+
+std::map<string, REPLICA_ACK> replica_acks = {
+    {"local", REPLICA_ACK::LOCAL},
+    {"quorum", REPLICA_ACK::QUORUM},
+    {"all", REPLICA_ACK::ALL}
+};
+
+std::map<string, CLUSTER_MODE> cluster_modes = {
+    {"redirect", CLUSTER_MODE::REDIRECT},
+    {"proxy", CLUSTER_MODE::PROXY}
+};
+
+std::map<string, UPLOAD_IO_MODE> upload_io_modes = {
+    {"buffered", UPLOAD_IO_MODE::BUFFERED},
+    {"direct", UPLOAD_IO_MODE::DIRECT},
+    {"drop_cache", UPLOAD_IO_MODE::DROP_CACHE}
+};
 }
 
 
@@ -39,6 +58,49 @@ bool init_params(int argc, char **argv, ConfigParams& params)
                 ("http_listen_port", po::value<uint16_t>(), "http listen port")
                 ("http_target_prefix", po::value<string>(), "http upload target prefix")
 
+                ("root_dir", po::value<string>()->default_value("./"), "file storage root dir")
+                ("storage_roots", po::value<string>()->default_value(""), "comma separated storage root dirs, one per disk")
+                ("storage_io_threads", po::value<size_t>()->default_value(2), "io threads per storage root")
+                ("storage_max_fill", po::value<int>()->default_value(950), "storage root fill limit in permille")
+                ("segment_threshold", po::value<int64_t>()->default_value(0), "uploads up to this size are packed into segment files, 0 to disable")
+                ("segment_size", po::value<int64_t>()->default_value(256 * 1024 * 1024), "segment file size before rolling to a new one")
+                ("fiber_stack_size", po::value<size_t>()->default_value(128 * 1024), "fiber stack size in bytes")
+                ("fiber_stack_cached", po::value<size_t>()->default_value(256), "free fiber stacks cached per thread")
+                ("fiber_stack_guard", po::value<bool>()->default_value(true), "protect a guard page below each fiber stack")
+                ("fiber_stack_report", po::value<bool>()->default_value(false), "log fiber stack high water marks")
+                ("compute_threads", po::value<size_t>()->default_value(0), "work stealing threads for digest and compression, 0 to compute inline")
+
+                ("tls_enable", po::value<bool>()->default_value(false), "enable tls on listener, kernel tls when available")
+                ("tls_cert_file", po::value<string>()->default_value(""), "tls certificate chain file(pem)")
+                ("tls_key_file", po::value<string>()->default_value(""), "tls private key file(pem)")
+                ("tls_session_timeout", po::value<long>()->default_value(7200), "tls session ticket lifetime seconds")
+                ("tls_handshake_timeout", po::value<int>()->default_value(10), "seconds allowed to complete the tls handshake")
+
+                ("upload_io_mode", po::value<string>()->default_value("buffered"), "large upload write mode:buffered direct drop_cache")
+                ("upload_io_threshold", po::value<int64_t>()->default_value(64 * 1024 * 1024), "upload size that switches to upload_io_mode")
+                ("upload_io_buffer", po::value<size_t>()->default_value(1024 * 1024), "aligned buffer size for direct io")
+                ("upload_io_buffer_cached", po::value<size_t>()->default_value(64), "max cached aligned buffers")
+                ("upload_tmpfile", po::value<bool>()->default_value(false), "write uploads to O_TMPFILE and linkat on completion")
+                ("upload_journal", po::value<string>()->default_value(""), "upload session journal file, enables resumable uploads")
+                ("upload_journal_interval", po::value<int>()->default_value(1000), "upload journal checkpoint interval milliseconds")
+                ("upload_resume_timeout", po::value<int>()->default_value(86400), "seconds a suspended upload waits to be resumed before it is dropped")
+                ("parallel_upload_timeout", po::value<int>()->default_value(3600), "idle seconds before an unfinished parallel upload is dropped")
+
+                ("compress_encodings", po::value<string>()->default_value(""), "comma separated precompressed encodings:gzip br zstd")
+                ("compress_min_size", po::value<int64_t>()->default_value(1024), "min file size to precompress")
+                ("compress_max_size", po::value<int64_t>()->default_value(64 * 1024 * 1024), "max file size to precompress")
+
+                ("replica_peers", po::value<string>()->default_value(""), "comma separated peer servers host:port to replicate uploads")
+                ("replica_ack", po::value<string>()->default_value("local"), "replication ack mode:local quorum all")
+                ("replica_timeout", po::value<int>()->default_value(10000), "replication ack timeout milliseconds")
+
+                ("cluster_file", po::value<string>()->default_value(""), "cluster member file, one host:port per line")
+                ("cluster_self", po::value<string>()->default_value(""), "host:port of this node in cluster member file")
+                ("cluster_mode", po::value<string>()->default_value("redirect"), "request to other node:redirect proxy")
+
+                ("origin_url", po::value<string>()->default_value(""), "origin server to pull missing files from, http://host:port/prefix")
+                ("origin_timeout", po::value<int>()->default_value(10000), "origin connect and read timeout milliseconds")
+
                 ("body_limit", po::value<int>(), "body buffer max size limit")
                 ("body_duration", po::value<int>(), "body buffer duration seconds")
 
@@ -72,6 +134,95 @@ bool init_params(int argc, char **argv, ConfigParams& params)
         params.http_listen_port = vm["http_listen_port"].as<uint16_t>();
         params.http_target_prefix = vm["http_target_prefix"].as<string>();
 
+        params.root_dir = vm["root_dir"].as<string>();
+        string storage_roots = vm["storage_roots"].as<string>();
+        if(!storage_roots.empty())
+        {
+            boost::split(params.storage_roots, storage_roots, boost::is_any_of(","), boost::token_compress_on);
+            for(string& r : params.storage_roots)
+            {
+                boost::trim(r);
+            }
+            params.storage_roots.erase(std::remove(params.storage_roots.begin(), params.storage_roots.end(), string()),
+                                       params.storage_roots.end());
+        }
+        params.storage_io_threads = vm["storage_io_threads"].as<size_t>();
+        params.storage_max_fill = vm["storage_max_fill"].as<int>();
+        params.segment_threshold = vm["segment_threshold"].as<int64_t>();
+        params.segment_size = vm["segment_size"].as<int64_t>();
+        params.fiber_stack_size = vm["fiber_stack_size"].as<size_t>();
+        params.fiber_stack_cached = vm["fiber_stack_cached"].as<size_t>();
+        params.fiber_stack_guard = vm["fiber_stack_guard"].as<bool>();
+        params.fiber_stack_report = vm["fiber_stack_report"].as<bool>();
+        params.compute_threads = vm["compute_threads"].as<size_t>();
+
+        params.tls_enable = vm["tls_enable"].as<bool>();
+        params.tls_cert_file = vm["tls_cert_file"].as<string>();
+        params.tls_key_file = vm["tls_key_file"].as<string>();
+        params.tls_session_timeout = vm["tls_session_timeout"].as<long>();
+        params.tls_handshake_timeout = vm["tls_handshake_timeout"].as<int>();
+
+        auto it_mode = upload_io_modes.find(vm["upload_io_mode"].as<string>());
+        if(it_mode != upload_io_modes.end())
+        {
+            params.upload_io_mode = it_mode->second;
+        }
+        params.upload_io_threshold = vm["upload_io_threshold"].as<int64_t>();
+        params.upload_io_buffer = vm["upload_io_buffer"].as<size_t>();
+        params.upload_io_buffer_cached = vm["upload_io_buffer_cached"].as<size_t>();
+        params.upload_tmpfile = vm["upload_tmpfile"].as<bool>();
+        params.upload_journal = vm["upload_journal"].as<string>();
+        params.upload_journal_interval = vm["upload_journal_interval"].as<int>();
+        params.upload_resume_timeout = vm["upload_resume_timeout"].as<int>();
+        params.parallel_upload_timeout = vm["parallel_upload_timeout"].as<int>();
+
+        vector<string> encodings;
+        string str_encodings = vm["compress_encodings"].as<string>();
+        boost::split(encodings, str_encodings, boost::is_any_of(", "), boost::token_compress_on);
+        for(const string& name : encodings)
+        {
+            CONTENT_ENCODING e;
+            if(name.empty())
+                continue;
+            if(!parse_encoding(name, e) || !encoding_supported(e))
+            {
+                cout << "unsupported compress encoding: " << name << endl;
+                continue;
+            }
+            params.compress_encodings.push_back(e);
+        }
+        params.compress_min_size = vm["compress_min_size"].as<int64_t>();
+        params.compress_max_size = vm["compress_max_size"].as<int64_t>();
+
+        string replica_peers = vm["replica_peers"].as<string>();
+        if(!replica_peers.empty())
+        {
+            boost::split(params.replica_peers, replica_peers, boost::is_any_of(", "), boost::token_compress_on);
+            params.replica_peers.erase(std::remove(params.replica_peers.begin(), params.replica_peers.end(), string()),
+                                       params.replica_peers.end());
+        }
+        auto it_ack = replica_acks.find(vm["replica_ack"].as<string>());
+        if(it_ack == replica_acks.end())
+        {
+            cout << "unsupported replica ack mode: " << vm["replica_ack"].as<string>() << endl;
+            return false;
+        }
+        params.replica_ack = it_ack->second;
+        params.replica_timeout = vm["replica_timeout"].as<int>();
+
+        params.cluster_file = vm["cluster_file"].as<string>();
+        params.cluster_self = vm["cluster_self"].as<string>();
+        auto it_cluster = cluster_modes.find(vm["cluster_mode"].as<string>());
+        if(it_cluster == cluster_modes.end())
+        {
+            cout << "unsupported cluster mode: " << vm["cluster_mode"].as<string>() << endl;
+            return false;
+        }
+        params.cluster_mode = it_cluster->second;
+
+        params.origin_url = vm["origin_url"].as<string>();
+        params.origin_timeout = vm["origin_timeout"].as<int>();
+
         params.body_limit = vm["body_limit"].as<int>();
         params.body_duration = vm["body_duration"].as<int>();
 
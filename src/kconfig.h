@@ -10,6 +10,7 @@
 #include <iostream>
 #include <set>
 #include <chrono>
+#include <memory_resource>
 #include <boost/date_time.hpp>
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
@@ -39,6 +40,36 @@ typedef boost::system::error_code BSError;
 typedef http::request<http::string_body> StrRequest;
 typedef http::response<http::string_body> StrResponse;
 
+//收到的请求从连接的单调分配区分配头部字段, 两个请求之间整体释放
+typedef std::pmr::polymorphic_allocator<char> RequestAllocator;
+typedef http::basic_fields<RequestAllocator> RequestFields;
+typedef http::request_parser<http::buffer_body, RequestAllocator> RequestParser;
+typedef RequestParser::value_type Request;
+//路由的正则匹配结果, 同样从分配区分配
+typedef boost::match_results<const char*, std::pmr::polymorphic_allocator<boost::sub_match<const char*>>> RouteMatch;
+
+enum class UPLOAD_IO_MODE
+{
+    BUFFERED = 0,   //普通写,数据留在页缓存
+    DIRECT = 1,     //O_DIRECT,绕过页缓存
+    DROP_CACHE = 2  //普通写,写回后 posix_fadvise(DONTNEED) 释放页缓存
+};
+
+enum class CONTENT_ENCODING;
+
+enum class REPLICA_ACK
+{
+    LOCAL = 0,  //本地落盘即应答, 复制在后台完成
+    QUORUM = 1, //本地与对端合计过半确认
+    ALL = 2     //所有对端确认
+};
+
+enum class CLUSTER_MODE
+{
+    REDIRECT = 0,   //307重定向到归属节点
+    PROXY = 1       //本节点转发请求与应答
+};
+
 struct ConfigParams
 {
     uint16_t thread_pool = 1;
@@ -48,6 +79,71 @@ struct ConfigParams
 
     string http_target_prefix;
 
+    string root_dir = "./";
+    //多盘存储根目录,为空时只使用 root_dir
+    vector<string> storage_roots;
+    size_t storage_io_threads = 2;
+    //已用空间超过千分比后不再放置新文件
+    int storage_max_fill = 950;
+    //fiber 栈大小, 每个线程缓存的空闲栈数
+    size_t fiber_stack_size = 128 * 1024;
+    size_t fiber_stack_cached = 256;
+    //栈底保护页
+    bool fiber_stack_guard = true;
+    //统计栈使用的最高水位
+    bool fiber_stack_report = false;
+    //不超过这个大小的上传打包存进段文件, 0 不启用
+    int64_t segment_threshold = 0;
+    //段文件写满这么多字节后换新段
+    int64_t segment_size = 256 * 1024 * 1024;
+    //校验与压缩使用的计算线程数, 0 表示在网络线程与IO线程上直接计算
+    size_t compute_threads = 0;
+
+    //TLS,握手后启用内核TLS(kTLS), 不支持时在用户态加解密
+    bool tls_enable = false;
+    string tls_cert_file;
+    string tls_key_file;
+    long tls_session_timeout = 7200;
+    int tls_handshake_timeout = 10;
+
+    //超过阈值的上传使用的写入模式,小文件始终buffered写
+    UPLOAD_IO_MODE upload_io_mode = UPLOAD_IO_MODE::BUFFERED;
+    int64_t upload_io_threshold = 64 * 1024 * 1024;
+    size_t upload_io_buffer = 1024 * 1024;
+    size_t upload_io_buffer_cached = 64;
+    //上传使用 O_TMPFILE 匿名文件, 完成时 linkat 到最终路径
+    bool upload_tmpfile = false;
+    //上传会话日志, 为空不记录; 记录的上传在崩溃或断开后可以续传
+    string upload_journal;
+    //检查点间隔毫秒数
+    int upload_journal_interval = 1000;
+    //断开后等待续传超过这么多秒的上传被清理
+    int upload_resume_timeout = 86400;
+    //并行分片上传超过这么多秒没有请求时被清理
+    int parallel_upload_timeout = 3600;
+
+    //上传完成后为文本类文件在后台生成的预压缩编码
+    vector<CONTENT_ENCODING> compress_encodings;
+    int64_t compress_min_size = 1024;
+    int64_t compress_max_size = 64 * 1024 * 1024;
+
+    //上传复制到的对端 host:port, 为空不复制
+    vector<string> replica_peers;
+    REPLICA_ACK replica_ack = REPLICA_ACK::LOCAL;
+    //等待对端确认的超时毫秒数
+    int replica_timeout = 10000;
+
+    //集群成员文件, 为空不启用集群
+    string cluster_file;
+    //本节点在成员文件中的 host:port
+    string cluster_self;
+    CLUSTER_MODE cluster_mode = CLUSTER_MODE::REDIRECT;
+
+    //回源地址 http://host:port/prefix, 为空不回源
+    string origin_url;
+    //连接源站与每次读的超时毫秒数
+    int origin_timeout = 10000;
+
     int body_limit = 0;
     int body_duration;
 
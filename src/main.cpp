@@ -1,28 +1,36 @@
 #include "kconfig.h"
 #include "transport_server.h"
+#include "upload_file.h"
+#include "compute_pool.h"
+#include "fiber_stack.h"
 
 int main(int argc, char **argv)
 {
-    namespace po = boost::program_options;
     try
     {
-        IoContextPool::m_pool_size = 8;
-        IoContextPool& pool = IoContextPool::get_instance();
-
-        ConfigParams *params = ConfigParams::GetInstance();
+        static ConfigParams params;
 
         //初始化
-        if (!params->initJsonSetting(argc, argv))
+        if (!init_params(argc, argv, params))
         {
             return -1;
         }
-        init_logging(params->m_setting.at("log_dir").get<string>() + "file_transport_server.log",
-                     static_cast<boost::log::trivial::severity_level>(params->m_setting.at("log_level").get<int>()));
+        g_cfg = &params;
+        init_logging(params.log_path, params.log_level);
+        FiberStackPool::init(params.fiber_stack_size, params.fiber_stack_guard,
+                             params.fiber_stack_cached, params.fiber_stack_report);
+        AlignedBufferPool::instance().init(params.upload_io_buffer, params.upload_io_buffer_cached);
+        ComputePool::instance().init(params.compute_threads);
+
+        IoContextPool::m_pool_size = params.thread_pool;
+        IoContextPool& pool = IoContextPool::get_instance();
 
-        string listen_address = "0.0.0.0";
-        int listen_port = params->m_setting.at("port").get<int>();
-        string root_dir = params->m_setting.at("root_dir").get<string>();
-        FileTransportServer tserver(listen_address, listen_port, root_dir);
+        FileTransportServer tserver(params.http_listen_addr, params.http_listen_port, params.root_dir);
+        if(params.tls_enable)
+        {
+            tserver.enableTls(params.tls_cert_file, params.tls_key_file, params.tls_session_timeout,
+                              params.tls_handshake_timeout);
+        }
         cout << "FileTransportServer::GetInstance()->start()\n";
         tserver.start();
         pool.run();
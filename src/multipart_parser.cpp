@@ -0,0 +1,208 @@
+#include "multipart_parser.h"
+#include <cstring>
+
+namespace {
+//part头最大长度
+const size_t MAX_HEADERS_SIZE = 16 * 1024;
+
+//查找分隔符, 用memchr(SIMD实现)定位首字节CR后再比较, 没找到返回 size
+size_t find_delimiter(const char* data, size_t size, const string& delim)
+{
+    const char* p = data;
+    const char* end = data + size;
+    while(p < end)
+    {
+        p = static_cast<const char*>(memchr(p, delim[0], end - p));
+        if(!p)
+            return size;
+        size_t remain = end - p;
+        if(remain < delim.size())
+        {
+            //可能是跨分片的分隔符前缀
+            if(memcmp(p, delim.data(), remain) == 0)
+                return p - data;
+        }
+        else if(memcmp(p, delim.data(), delim.size()) == 0)
+        {
+            return p - data;
+        }
+        ++p;
+    }
+    return size;
+}
+
+boost::beast::string_view trim(boost::beast::string_view s)
+{
+    while(!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        s.remove_prefix(1);
+    while(!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r'))
+        s.remove_suffix(1);
+    return s;
+}
+
+//取 key=value 或 key="value" 形式的参数
+bool header_param(boost::beast::string_view header, boost::beast::string_view key, string& value)
+{
+    size_t pos = 0;
+    while(pos < header.size())
+    {
+        size_t semi = header.find(';', pos);
+        if(semi == boost::beast::string_view::npos)
+            semi = header.size();
+        boost::beast::string_view item = trim(header.substr(pos, semi - pos));
+        pos = semi + 1;
+        size_t eq = item.find('=');
+        if(eq == boost::beast::string_view::npos || !boost::beast::iequals(trim(item.substr(0, eq)), key))
+            continue;
+        boost::beast::string_view v = trim(item.substr(eq + 1));
+        if(v.size() >= 2 && v.front() == '"')
+        {
+            //带引号的值中可能有 ';', 从原始位置重新找结束引号
+            //浏览器不对 '\\' 转义(IE会带上完整的windows路径), 这里也不做反转义
+            size_t start = v.data() - header.data() + 1;
+            size_t end = header.find('"', start);
+            if(end == boost::beast::string_view::npos)
+                end = header.size();
+            value = header.substr(start, end - start).to_string();
+            return true;
+        }
+        else
+        {
+            value = v.to_string();
+        }
+        return true;
+    }
+    return false;
+}
+}
+
+bool MultipartParser::isMultipart(boost::beast::string_view content_type)
+{
+    return content_type.size() >= 19 && boost::beast::iequals(content_type.substr(0, 19), "multipart/form-data");
+}
+
+bool MultipartParser::init(boost::beast::string_view content_type)
+{
+    string boundary;
+    if(!isMultipart(content_type) || !header_param(content_type, "boundary", boundary) ||
+            boundary.empty() || boundary.size() > 70)
+        return false;
+    m_delimiter = "\r\n--" + boundary;
+    //第一个分隔符前没有CRLF, 补上后所有分隔符一致
+    m_buf = "\r\n";
+    m_state = STATE::PREAMBLE;
+    return true;
+}
+
+bool MultipartParser::feed(const char* data, size_t size)
+{
+    if(m_state == STATE::ERROR)
+        return false;
+    if(m_state == STATE::EPILOGUE)
+        return true;
+    m_buf.append(data, size);
+    if(!process())
+    {
+        m_state = STATE::ERROR;
+        return false;
+    }
+    return true;
+}
+
+bool MultipartParser::process()
+{
+    size_t pos = 0;
+    for(;;)
+    {
+        const char* p = m_buf.data() + pos;
+        size_t n = m_buf.size() - pos;
+        if(m_state == STATE::PREAMBLE || m_state == STATE::BODY)
+        {
+            size_t found = find_delimiter(p, n, m_delimiter);
+            size_t data_len = found;
+            if(m_state == STATE::BODY && data_len > 0 && on_part_data && !on_part_data(p, data_len))
+                return false;
+            pos += data_len;
+            if(found == n || n - found < m_delimiter.size())
+                break;      //没有完整分隔符, 等待更多数据
+            pos += m_delimiter.size();
+            if(m_state == STATE::BODY && on_part_end && !on_part_end())
+                return false;
+            m_state = STATE::BOUNDARY_TAIL;
+        }
+        else if(m_state == STATE::BOUNDARY_TAIL)
+        {
+            //分隔符后可能有空白填充
+            while(n > 0 && (*p == ' ' || *p == '\t'))
+            {
+                ++p;
+                ++pos;
+                --n;
+            }
+            if(n < 2)
+                break;
+            if(p[0] == '-' && p[1] == '-')
+            {
+                m_state = STATE::EPILOGUE;
+                m_buf.clear();
+                return true;
+            }
+            if(p[0] != '\r' || p[1] != '\n')
+                return false;
+            pos += 2;
+            m_state = STATE::HEADERS;
+        }
+        else if(m_state == STATE::HEADERS)
+        {
+            boost::beast::string_view view(p, n);
+            size_t end = view.find("\r\n\r\n");
+            if(end == boost::beast::string_view::npos)
+            {
+                if(n > MAX_HEADERS_SIZE)
+                    return false;
+                break;
+            }
+            Part part;
+            if(!parseHeaders(p, end, part))
+                return false;
+            if(on_part_begin && !on_part_begin(part))
+                return false;
+            pos += end + 4;
+            m_state = STATE::BODY;
+        }
+        else
+        {
+            break;
+        }
+    }
+    m_buf.erase(0, pos);
+    return true;
+}
+
+bool MultipartParser::parseHeaders(const char* data, size_t size, Part& part)
+{
+    boost::beast::string_view block(data, size);
+    bool has_disposition = false;
+    while(!block.empty())
+    {
+        size_t eol = block.find("\r\n");
+        boost::beast::string_view line = block.substr(0, eol);
+        block = eol == boost::beast::string_view::npos ? boost::beast::string_view() : block.substr(eol + 2);
+        size_t colon = line.find(':');
+        if(colon == boost::beast::string_view::npos)
+            continue;
+        boost::beast::string_view key = trim(line.substr(0, colon));
+        boost::beast::string_view value = trim(line.substr(colon + 1));
+        if(boost::beast::iequals(key, "Content-Disposition"))
+        {
+            has_disposition = true;
+            header_param(value, "name", part.name);
+            header_param(value, "filename", part.filename);
+        }
+        else if(boost::beast::iequals(key, "Content-Type"))
+        {
+            part.content_type = value.to_string();
+        }
+    }
+    return has_disposition;
+}
@@ -0,0 +1,51 @@
+#ifndef MULTIPART_PARSER_H
+#define MULTIPART_PARSER_H
+
+#include "kconfig.h"
+#include <functional>
+
+//multipart/form-data 流式解析 (RFC 7578)
+//body分片按到达顺序喂入, 只缓存未能判定是否属于分隔符的尾部字节与part头, 不缓存整个part
+class MultipartParser : private boost::noncopyable
+{
+public:
+    struct Part
+    {
+        string name;
+        string filename;
+        string content_type;
+    };
+
+    //回调返回false时中止解析
+    std::function<bool(const Part&)> on_part_begin;
+    std::function<bool(const char*, size_t)> on_part_data;
+    std::function<bool()> on_part_end;
+
+    //从 Content-Type 中取 boundary, 不是 multipart/form-data 时返回false
+    bool init(boost::beast::string_view content_type);
+    bool feed(const char* data, size_t size);
+    //已经读到结束分隔符
+    bool done() const { return m_state == STATE::EPILOGUE; }
+
+    static bool isMultipart(boost::beast::string_view content_type);
+
+private:
+    enum class STATE
+    {
+        PREAMBLE,
+        BOUNDARY_TAIL,  //分隔符之后的 "--" 或 CRLF
+        HEADERS,
+        BODY,
+        EPILOGUE,
+        ERROR
+    };
+
+    bool parseHeaders(const char* data, size_t size, Part& part);
+    bool process();
+
+    STATE m_state = STATE::ERROR;
+    string m_delimiter;     //CRLF "--" boundary
+    string m_buf;           //尚未处理的字节
+};
+
+#endif // MULTIPART_PARSER_H
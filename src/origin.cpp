@@ -0,0 +1,112 @@
+#include "origin.h"
+
+OriginFetch::OriginFetch(const ReplicaPeerPtr& peer, IoContext& ioc, int timeout_ms) :
+    m_peer(peer), m_ioc(ioc), m_timeout_ms(timeout_ms), m_timer(ioc)
+{
+    m_parser.body_limit(std::numeric_limits<std::uint64_t>::max());
+}
+
+OriginFetch::~OriginFetch()
+{
+    m_timer.cancel();
+}
+
+void OriginFetch::armTimer()
+{
+    SocketPtr socket = m_socket;
+    m_timer.expires_after(std::chrono::milliseconds(m_timeout_ms));
+    m_timer.async_wait([socket](const BSError& ec) {
+        if(ec)
+            return;
+        BSError e;
+        socket->close(e);
+    });
+}
+
+bool OriginFetch::open(const string& target, BSError& ec)
+{
+    m_socket = m_peer->acquire(m_ioc, ec);
+    if(!m_socket)
+        return false;
+    http::request<http::empty_body> req{http::verb::get, target, 11};
+    req.set(http::field::host, m_peer->address());
+    req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+    req.keep_alive(true);
+    armTimer();
+    http::async_write(*m_socket, req, boost::fibers::asio::yield[ec]);
+    if(ec)
+        return false;
+    http::async_read_header(*m_socket, m_buffer, m_parser, boost::fibers::asio::yield[ec]);
+    m_timer.cancel();
+    return !ec;
+}
+
+int64_t OriginFetch::contentLength() const
+{
+    if(m_parser.content_length())
+        return static_cast<int64_t>(*m_parser.content_length());
+    return -1;
+}
+
+bool OriginFetch::read(string& buf, BSError& ec)
+{
+    if(m_parser.is_done())
+    {
+        //body读完, 连接可以给下一次回源使用
+        if(m_parser.get().keep_alive() && m_buffer.size() == 0)
+        {
+            m_peer->release(m_ioc, m_socket);
+        }
+        m_socket.reset();
+        return false;
+    }
+    buf.resize(64 * 1024);
+    m_parser.get().body().data = &buf[0];
+    m_parser.get().body().size = buf.size();
+    armTimer();
+    http::async_read(*m_socket, m_buffer, m_parser, boost::fibers::asio::yield[ec]);
+    m_timer.cancel();
+    if(ec == http::error::need_buffer)
+    {
+        ec = {};
+    }
+    if(ec)
+        return false;
+    buf.resize(buf.size() - m_parser.get().body().size);
+    return true;
+}
+
+Origin::Origin(const string& url, int timeout_ms) : m_timeout_ms(timeout_ms)
+{
+    const string scheme = "http://";
+    if(url.compare(0, scheme.size(), scheme) != 0)
+    {
+        LogErrorExt << "only http origin supported," << url;
+        return;
+    }
+    size_t slash = url.find('/', scheme.size());
+    string address = url.substr(scheme.size(), slash == string::npos ? string::npos : slash - scheme.size());
+    if(address.empty())
+    {
+        LogErrorExt << "invalid origin url," << url;
+        return;
+    }
+    if(slash != string::npos)
+    {
+        m_prefix = url.substr(slash);
+        while(!m_prefix.empty() && m_prefix.back() == '/')
+            m_prefix.pop_back();
+    }
+    m_peer = std::make_shared<ReplicaPeer>(address);
+}
+
+OriginFetchPtr Origin::fetch(IoContext& ioc, const string& rel_path, BSError& ec)
+{
+    OriginFetchPtr f = std::make_shared<OriginFetch>(m_peer, ioc, m_timeout_ms);
+    if(!f->open(m_prefix + "/" + rel_path, ec))
+    {
+        LogErrorExt << "origin request failed," << ec.message() << "," << m_peer->address() << "," << rel_path;
+        return nullptr;
+    }
+    return f;
+}
@@ -0,0 +1,55 @@
+#ifndef ORIGIN_H
+#define ORIGIN_H
+
+#include "kconfig.h"
+#include "replicator.h"
+
+//一次回源请求, 读完应答头后按块读取body
+//只在发起请求的 io_context 线程上使用
+class OriginFetch : private boost::noncopyable
+{
+public:
+    OriginFetch(const ReplicaPeerPtr& peer, IoContext& ioc, int timeout_ms);
+    ~OriginFetch();
+
+    //发送请求并读应答头, 连接或读头失败返回false
+    bool open(const string& target, BSError& ec);
+    http::status status() const { return m_parser.get().result(); }
+    //-1表示源站没有给出大小
+    int64_t contentLength() const;
+    //读下一块body到 buf, body结束或出错返回false, 出错时 ec 非空
+    bool read(string& buf, BSError& ec);
+
+private:
+    //每次读写前重新计时, 超时关闭连接
+    void armTimer();
+
+    ReplicaPeerPtr m_peer;
+    IoContext& m_ioc;
+    int m_timeout_ms;
+    SocketPtr m_socket;
+    boost::asio::steady_timer m_timer;
+    boost::beast::flat_buffer m_buffer;
+    http::response_parser<http::buffer_body> m_parser;
+};
+
+typedef std::shared_ptr<OriginFetch> OriginFetchPtr;
+
+//回源: 本地没有的文件从源站拉取
+//源站地址形如 http://host:port/prefix, 文件 {dir}/{name} 请求 /prefix/{dir}/{name}
+class Origin : private boost::noncopyable
+{
+public:
+    Origin(const string& url, int timeout_ms);
+
+    //url 格式错误返回false
+    bool valid() const { return m_peer != nullptr; }
+    OriginFetchPtr fetch(IoContext& ioc, const string& rel_path, BSError& ec);
+
+private:
+    ReplicaPeerPtr m_peer;
+    string m_prefix;
+    int m_timeout_ms;
+};
+
+#endif // ORIGIN_H
@@ -0,0 +1,44 @@
+#ifndef PARALLEL_UPLOAD_H
+#define PARALLEL_UPLOAD_H
+
+#include "kconfig.h"
+
+class UploadTask;
+typedef std::shared_ptr<UploadTask> UploadTaskPtr;
+
+//并行分片上传的状态, 由 FileTransportServer::m_mutex 保护
+//除最后一片外每片大小都是 part_size, 第n片(从1开始)写在 (n-1)*part_size 处
+struct ParallelUpload
+{
+    enum PART_STATE : uint8_t
+    {
+        PART_MISSING = 0,
+        PART_RECEIVING = 1,
+        PART_DONE = 2
+    };
+
+    string id;
+    string rel_path;
+    int64_t size = 0;
+    int64_t part_size = 0;
+    vector<uint8_t> parts;
+    UploadTaskPtr task;
+    time_t active_time = 0;     //最后一次收到请求的时间, 超时未完成的上传被清理
+
+    size_t partCount() const { return static_cast<size_t>((size + part_size - 1) / part_size); }
+    int64_t partOffset(size_t n) const { return static_cast<int64_t>(n - 1) * part_size; }
+    int64_t partLength(size_t n) const { return std::min(part_size, size - partOffset(n)); }
+    bool complete() const
+    {
+        for(uint8_t s : parts)
+        {
+            if(s != PART_DONE)
+                return false;
+        }
+        return true;
+    }
+};
+
+typedef std::shared_ptr<ParallelUpload> ParallelUploadPtr;
+
+#endif // PARALLEL_UPLOAD_H
@@ -0,0 +1,226 @@
+#include "replicator.h"
+#include "fiber_stack.h"
+#include <sys/socket.h>
+
+ReplicaPeer::ReplicaPeer(const string& address) : m_address(address)
+{
+    size_t colon = address.rfind(':');
+    if(colon == string::npos)
+    {
+        m_host = address;
+        m_port = "80";
+    }
+    else
+    {
+        m_host = address.substr(0, colon);
+        m_port = address.substr(colon + 1);
+    }
+}
+
+SocketPtr ReplicaPeer::acquire(IoContext& ioc, BSError& ec)
+{
+    {
+        std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+        vector<SocketPtr>& idle = m_idle[&ioc];
+        while(!idle.empty())
+        {
+            SocketPtr socket = idle.back();
+            idle.pop_back();
+            //对端关闭的连接可读且读到0字节, 正常的空闲连接不可读
+            char c;
+            ssize_t n = ::recv(socket->native_handle(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return socket;
+        }
+    }
+
+    SocketPtr socket = std::make_shared<tcp::socket>(ioc);
+    tcp::resolver resolver(ioc);
+    auto endpoints = resolver.async_resolve(m_host, m_port, boost::fibers::asio::yield[ec]);
+    if(ec)
+        return nullptr;
+    boost::asio::async_connect(*socket, endpoints, boost::fibers::asio::yield[ec]);
+    if(ec)
+        return nullptr;
+    socket->set_option(tcp::no_delay(true), ec);
+    return socket;
+}
+
+void ReplicaPeer::release(IoContext& ioc, const SocketPtr& socket)
+{
+    std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+    m_idle[&ioc].push_back(socket);
+}
+
+ReplicaStream::ReplicaStream(const ReplicaPeerPtr& peer, const string& rel_path, int64_t file_size,
+                             const string& marker) :
+    m_peer(peer), m_rel_path(rel_path), m_file_size(file_size), m_marker(marker)
+{
+    m_result = m_promise.get_future();
+}
+
+void ReplicaStream::start(IoContext& ioc)
+{
+    auto self(shared_from_this());
+    make_fiber([this, self, &ioc]() {
+        BSError ec;
+        SocketPtr socket = m_peer->acquire(ioc, ec);
+        if(!socket)
+        {
+            LogErrorExt << "connect replica peer failed," << ec.message() << "," << m_peer->address();
+            m_promise.set_value(false);
+            return;
+        }
+        bool keep_alive = false;
+        bool ok = transfer(*socket, keep_alive);
+        if(ok && keep_alive)
+        {
+            m_peer->release(ioc, socket);
+        }
+        else
+        {
+            socket->close(ec);
+        }
+        m_promise.set_value(ok);
+    }).detach();
+}
+
+void ReplicaStream::finish(bool commit)
+{
+    m_commit = commit;
+    //空指针表示结束
+    m_buffers.push(nullptr);
+}
+
+bool ReplicaStream::transfer(tcp::socket& socket, bool& keep_alive)
+{
+    BSError ec;
+    http::request<http::buffer_body> req{http::verb::post, "/" + m_rel_path, 11};
+    req.set(http::field::host, m_peer->address());
+    req.set(m_marker, "1");
+    req.keep_alive(true);
+    if(m_file_size >= 0)
+        req.content_length(m_file_size);
+    else
+        req.chunked(true);
+    req.body().data = nullptr;
+    req.body().more = true;
+    http::request_serializer<http::buffer_body> sr{req};
+    http::async_write_header(socket, sr, boost::fibers::asio::yield[ec]);
+    if(ec)
+    {
+        LogErrorExt << "replica write header failed," << ec.message() << "," << m_peer->address();
+        return false;
+    }
+
+    for(;;)
+    {
+        std::shared_ptr<string> buf = m_buffers.pop();
+        if(!buf)
+            break;
+        req.body().data = const_cast<char*>(buf->data());
+        req.body().size = buf->size();
+        req.body().more = true;
+        http::async_write(socket, sr, boost::fibers::asio::yield[ec]);
+        if(ec == http::error::need_buffer)
+        {
+            ec = {};
+        }
+        if(ec)
+        {
+            LogErrorExt << "replica write failed," << ec.message() << "," << m_peer->address();
+            return false;
+        }
+    }
+    if(!m_commit)
+        return false;
+
+    req.body().data = nullptr;
+    req.body().more = false;
+    http::async_write(socket, sr, boost::fibers::asio::yield[ec]);
+    if(ec == http::error::need_buffer)
+    {
+        ec = {};
+    }
+    if(ec)
+    {
+        LogErrorExt << "replica write failed," << ec.message() << "," << m_peer->address();
+        return false;
+    }
+
+    boost::beast::flat_buffer buffer;
+    http::response<http::string_body> res;
+    http::async_read(socket, buffer, res, boost::fibers::asio::yield[ec]);
+    if(ec)
+    {
+        LogErrorExt << "replica read response failed," << ec.message() << "," << m_peer->address();
+        return false;
+    }
+    keep_alive = res.keep_alive();
+    if(res.result() != http::status::ok)
+    {
+        LogErrorExt << "replica rejected," << res.result_int() << "," << m_peer->address() << "," << m_rel_path;
+        return false;
+    }
+    return true;
+}
+
+ReplicaGroup::ReplicaGroup(vector<ReplicaStreamPtr> streams, REPLICA_ACK ack, int timeout_ms) :
+    m_streams(std::move(streams)), m_ack(ack), m_timeout_ms(timeout_ms)
+{
+}
+
+void ReplicaGroup::send(const std::shared_ptr<string>& buf)
+{
+    for(ReplicaStreamPtr& s : m_streams)
+    {
+        s->send(buf);
+    }
+}
+
+bool ReplicaGroup::finish(bool local_ok)
+{
+    for(ReplicaStreamPtr& s : m_streams)
+    {
+        s->finish(local_ok);
+    }
+    if(!local_ok)
+        return false;
+    if(m_ack == REPLICA_ACK::LOCAL)
+        return true;
+
+    //quorum: 本地算一票, 还需要 (对端数+1)/2 个对端
+    size_t need = m_ack == REPLICA_ACK::ALL ? m_streams.size() : (m_streams.size() + 1) / 2;
+    size_t acked = 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_timeout_ms);
+    for(ReplicaStreamPtr& s : m_streams)
+    {
+        if(acked >= need)
+            break;
+        boost::fibers::future<bool>& result = s->result();
+        if(result.wait_until(deadline) == boost::fibers::future_status::ready && result.get())
+            ++acked;
+    }
+    return acked >= need;
+}
+
+Replicator::Replicator(const vector<string>& peers, REPLICA_ACK ack, int timeout_ms) :
+    m_ack(ack), m_timeout_ms(timeout_ms)
+{
+    for(const string& address : peers)
+    {
+        m_peers.push_back(std::make_shared<ReplicaPeer>(address));
+    }
+}
+
+ReplicaGroupPtr Replicator::open(IoContext& ioc, const string& rel_path, int64_t file_size)
+{
+    vector<ReplicaStreamPtr> streams;
+    for(ReplicaPeerPtr& peer : m_peers)
+    {
+        ReplicaStreamPtr s = std::make_shared<ReplicaStream>(peer, rel_path, file_size);
+        s->start(ioc);
+        streams.push_back(s);
+    }
+    return std::make_shared<ReplicaGroup>(std::move(streams), m_ack, m_timeout_ms);
+}
@@ -0,0 +1,97 @@
+#ifndef REPLICATOR_H
+#define REPLICATOR_H
+
+#include "kconfig.h"
+#include "fiber_unbounded_buffer.h"
+#include <boost/fiber/future.hpp>
+
+//复制请求带上此头, 对端收到后不再继续复制
+#define REPLICA_HEADER "X-Fts-Replica"
+
+//到一个对端的持久连接
+//连接只在创建它的 io_context 线程上使用, 空闲连接按 io_context 分别缓存
+class ReplicaPeer : private boost::noncopyable
+{
+public:
+    //address 形如 host:port
+    explicit ReplicaPeer(const string& address);
+
+    const string& address() const { return m_address; }
+    //优先复用空闲连接, 已被对端关闭的丢弃
+    SocketPtr acquire(IoContext& ioc, BSError& ec);
+    void release(IoContext& ioc, const SocketPtr& socket);
+
+private:
+    string m_address;
+    string m_host;
+    string m_port;
+    boost::fibers::mutex m_mutex;
+    std::map<IoContext*, vector<SocketPtr>> m_idle;
+};
+
+typedef std::shared_ptr<ReplicaPeer> ReplicaPeerPtr;
+
+//一个上传到一个对端的复制流, 作为对端的普通POST请求
+//数据块入队后由发送fiber连续写出, 不等待逐块确认, 结束时读一次应答
+//marker 为请求带上的头, 集群中转发给归属节点时是 FORWARDED_HEADER
+class ReplicaStream : public std::enable_shared_from_this<ReplicaStream>
+{
+public:
+    ReplicaStream(const ReplicaPeerPtr& peer, const string& rel_path, int64_t file_size,
+                  const string& marker = REPLICA_HEADER);
+
+    void start(IoContext& ioc);
+    void send(const std::shared_ptr<string>& buf) { m_buffers.push(buf); }
+    //commit 为false时断开连接, 对端丢弃未完成的文件
+    void finish(bool commit);
+    //对端应答200后为true
+    boost::fibers::future<bool>& result() { return m_result; }
+
+private:
+    bool transfer(tcp::socket& socket, bool& keep_alive);
+
+    ReplicaPeerPtr m_peer;
+    string m_rel_path;
+    int64_t m_file_size;
+    string m_marker;
+    fiber_unbounded_queue<std::shared_ptr<string>> m_buffers;
+    std::atomic_bool m_commit{false};
+    boost::fibers::promise<bool> m_promise;
+    boost::fibers::future<bool> m_result;
+};
+
+typedef std::shared_ptr<ReplicaStream> ReplicaStreamPtr;
+
+//一个上传到所有对端的复制
+class ReplicaGroup : private boost::noncopyable
+{
+public:
+    ReplicaGroup(vector<ReplicaStreamPtr> streams, REPLICA_ACK ack, int timeout_ms);
+
+    void send(const std::shared_ptr<string>& buf);
+    //local_ok 为false时中止所有复制; 否则按ack模式等待对端确认, 满足要求返回true
+    bool finish(bool local_ok);
+
+private:
+    vector<ReplicaStreamPtr> m_streams;
+    REPLICA_ACK m_ack;
+    int m_timeout_ms;
+};
+
+typedef std::shared_ptr<ReplicaGroup> ReplicaGroupPtr;
+
+class Replicator : private boost::noncopyable
+{
+public:
+    Replicator(const vector<string>& peers, REPLICA_ACK ack, int timeout_ms);
+
+    //为一个上传建立到所有对端的复制流, 连接在 ioc 上发起, ioc 必须是当前fiber所在线程的
+    ReplicaGroupPtr open(IoContext& ioc, const string& rel_path, int64_t file_size);
+
+private:
+    vector<ReplicaPeerPtr> m_peers;
+    REPLICA_ACK m_ack;
+    int m_timeout_ms;
+};
+
+#endif // REPLICATOR_H
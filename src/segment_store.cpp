@@ -0,0 +1,560 @@
+#include "segment_store.h"
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+namespace {
+const uint32_t SEGMENT_MAGIC = 0x47535446;  //"FTSG"
+const size_t HEADER_SIZE = 35;
+//每隔这么多秒检查一次有没有需要压缩的段
+const int COMPACT_INTERVAL = 60;
+
+enum RECORD_TYPE : uint8_t
+{
+    RECORD_PUT = 1,
+    RECORD_DELETE = 2
+};
+
+struct RecordHeader
+{
+    uint32_t crc;
+    uint64_t seq;
+    uint8_t type;
+    uint16_t path_len;
+    int64_t size;
+    int64_t mtime;
+};
+
+void put_le(string& out, uint64_t v, int bytes)
+{
+    for(int i = 0; i < bytes; ++i)
+        out.push_back(static_cast<char>(v >> (8 * i)));
+}
+
+uint64_t get_le(const char* p, int bytes)
+{
+    uint64_t v = 0;
+    for(int i = 0; i < bytes; ++i)
+        v |= static_cast<uint64_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+    return v;
+}
+
+int64_t record_length(size_t path_len, int64_t size)
+{
+    return static_cast<int64_t>(HEADER_SIZE + path_len) + size;
+}
+
+//头与路径, crc 覆盖 crc 之后的头, 路径与数据
+string encode_header(uint64_t seq, uint8_t type, const string& rel_path, const char* data, int64_t size, time_t mtime)
+{
+    string out;
+    put_le(out, SEGMENT_MAGIC, 4);
+    put_le(out, 0, 4);
+    put_le(out, seq, 8);
+    put_le(out, type, 1);
+    put_le(out, rel_path.size(), 2);
+    put_le(out, static_cast<uint64_t>(size), 8);
+    put_le(out, static_cast<uint64_t>(mtime), 8);
+    out.append(rel_path);
+    uLong crc = ::crc32(0L, reinterpret_cast<const Bytef*>(out.data() + 8), static_cast<uInt>(out.size() - 8));
+    if(size > 0)
+        crc = ::crc32(crc, reinterpret_cast<const Bytef*>(data), static_cast<uInt>(size));
+    for(int i = 0; i < 4; ++i)
+        out[4 + i] = static_cast<char>(crc >> (8 * i));
+    return out;
+}
+
+bool decode_header(const char* p, RecordHeader& h)
+{
+    if(get_le(p, 4) != SEGMENT_MAGIC)
+        return false;
+    h.crc = static_cast<uint32_t>(get_le(p + 4, 4));
+    h.seq = get_le(p + 8, 8);
+    h.type = static_cast<uint8_t>(p[16]);
+    h.path_len = static_cast<uint16_t>(get_le(p + 17, 2));
+    h.size = static_cast<int64_t>(get_le(p + 19, 8));
+    h.mtime = static_cast<int64_t>(get_le(p + 27, 8));
+    return (h.type == RECORD_PUT || h.type == RECORD_DELETE) && h.size >= 0;
+}
+
+bool pread_all(int fd, char* buf, size_t size, int64_t offset)
+{
+    while(size > 0)
+    {
+        ssize_t n = ::pread(fd, buf, size, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        buf += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+//从 offset 到文件尾是否全为0
+bool zero_tail(int fd, int64_t offset, int64_t file_size)
+{
+    char buf[4096];
+    while(offset < file_size)
+    {
+        size_t n = static_cast<size_t>(std::min<int64_t>(sizeof(buf), file_size - offset));
+        if(!pread_all(fd, buf, n, offset))
+            return false;
+        for(size_t i = 0; i < n; ++i)
+        {
+            if(buf[i])
+                return false;
+        }
+        offset += n;
+    }
+    return true;
+}
+
+string segment_path(const string& dir, uint32_t id)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%08u.seg", id);
+    return dir + "/" + name;
+}
+}
+
+SegmentFile::~SegmentFile()
+{
+    if(fd >= 0)
+        ::close(fd);
+}
+
+SegmentStore::SegmentStore(const string& dir, int64_t segment_size) :
+    m_dir(dir), m_segment_size(segment_size)
+{
+}
+
+SegmentStore::~SegmentStore()
+{
+    if(m_thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_one();
+        m_thread.join();
+    }
+}
+
+bool SegmentStore::open(vector<SegmentRecord>& records)
+{
+    boost::system::error_code e;
+    fs::create_directories(m_dir, e);
+    DIR* d = ::opendir(m_dir.c_str());
+    if(!d)
+    {
+        LogErrorExt << "open segment dir failed," << strerror(errno) << "," << m_dir;
+        return false;
+    }
+    vector<uint32_t> ids;
+    while(struct dirent* de = ::readdir(d))
+    {
+        unsigned id = 0;
+        char suffix[8] = {0};
+        if(sscanf(de->d_name, "%u.%4s", &id, suffix) == 2 && strcmp(suffix, "seg") == 0 && id > 0)
+            ids.push_back(id);
+    }
+    ::closedir(d);
+    std::sort(ids.begin(), ids.end());
+
+    //启动时还没有其他线程访问, 段全部扫描完再加入段表
+    std::map<string, std::pair<SegmentRecord, uint8_t>> latest;
+    map<uint32_t, SegmentFilePtr> segments;
+    for(uint32_t id : ids)
+    {
+        string path = segment_path(m_dir, id);
+        int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+        struct stat st;
+        if(fd < 0 || ::fstat(fd, &st) != 0)
+        {
+            LogErrorExt << "open segment failed," << strerror(errno) << "," << path;
+            if(fd >= 0)
+                ::close(fd);
+            return false;
+        }
+        SegmentFilePtr seg = std::make_shared<SegmentFile>(id, path, fd);
+        if(!scan(seg, st.st_size, latest))
+            return false;
+        segments[id] = seg;
+    }
+    for(auto& kv : latest)
+    {
+        const SegmentRecord& r = kv.second.first;
+        //删除记录也算有效, 压缩时可能还要保留
+        segments[r.segment]->live += record_length(r.rel_path.size(), r.size);
+        if(kv.second.second == RECORD_PUT)
+            records.push_back(r);
+    }
+    std::lock_guard<std::mutex> wlk(m_write_mutex);
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_segments.swap(segments);
+    if(!m_segments.empty())
+    {
+        m_next_id = m_segments.rbegin()->first + 1;
+        if(m_segments.rbegin()->second->size < m_segment_size)
+            m_active = m_segments.rbegin()->second;
+    }
+    LogInfo << "segment store opened," << m_segments.size() << "," << records.size() << "," << m_dir;
+    return true;
+}
+
+void SegmentStore::startCompaction(LiveCheck is_live, Relocate relocate)
+{
+    m_is_live = std::move(is_live);
+    m_relocate = std::move(relocate);
+    m_thread = std::thread([this]() { compactLoop(); });
+}
+
+bool SegmentStore::scan(const SegmentFilePtr& seg, int64_t file_size,
+                        std::map<string, std::pair<SegmentRecord, uint8_t>>& latest)
+{
+    int64_t offset = 0;
+    char buf[HEADER_SIZE];
+    //写入时崩溃只会损坏最后一条记录: 头不完整, 数据超出文件尾, 校验不对, 或文件系统分配了块但没写入的全零尾部
+    bool torn = false;
+    while(offset < file_size)
+    {
+        if(offset + static_cast<int64_t>(HEADER_SIZE) > file_size)
+        {
+            torn = true;
+            break;
+        }
+        RecordHeader h;
+        if(!pread_all(seg->fd, buf, HEADER_SIZE, offset))
+        {
+            LogErrorExt << "read segment failed," << strerror(errno) << "," << seg->path;
+            return false;
+        }
+        if(!decode_header(buf, h))
+        {
+            if(zero_tail(seg->fd, offset, file_size))
+            {
+                torn = true;
+                break;
+            }
+            LogErrorExt << "segment record corrupted," << offset << "," << seg->path;
+            return false;
+        }
+        int64_t length = record_length(h.path_len, h.size);
+        if(offset + length > file_size)
+        {
+            torn = true;
+            break;
+        }
+        string rel_path(h.path_len, '\0');
+        if(h.path_len > 0 && !pread_all(seg->fd, &rel_path[0], h.path_len, offset + HEADER_SIZE))
+        {
+            LogErrorExt << "read segment failed," << strerror(errno) << "," << seg->path;
+            return false;
+        }
+        //只有最后一条记录可能写了一半, 读出数据校验
+        if(offset + length == file_size)
+        {
+            string data(static_cast<size_t>(h.size), '\0');
+            if(h.size > 0 && !pread_all(seg->fd, &data[0], data.size(), offset + HEADER_SIZE + h.path_len))
+            {
+                LogErrorExt << "read segment failed," << strerror(errno) << "," << seg->path;
+                return false;
+            }
+            string check = encode_header(h.seq, h.type, rel_path, data.data(), h.size, h.mtime);
+            if(get_le(check.data() + 4, 4) != h.crc)
+            {
+                torn = true;
+                break;
+            }
+        }
+        SegmentRecord r;
+        r.rel_path = rel_path;
+        r.segment = seg->id;
+        r.offset = offset + HEADER_SIZE + h.path_len;
+        r.size = h.size;
+        r.mtime = h.mtime;
+        r.seq = h.seq;
+        auto it = latest.find(rel_path);
+        if(it == latest.end() || it->second.first.seq < h.seq)
+            latest[rel_path] = std::make_pair(r, h.type);
+        seg->min_seq = std::min(seg->min_seq, h.seq);
+        m_next_seq = std::max(m_next_seq, h.seq + 1);
+        offset += length;
+    }
+    if(torn)
+    {
+        LogWarnExt << "segment tail truncated," << file_size - offset << "," << seg->path;
+        if(::ftruncate(seg->fd, offset) != 0)
+        {
+            LogErrorExt << "truncate segment failed," << strerror(errno) << "," << seg->path;
+            return false;
+        }
+    }
+    seg->size = offset;
+    return true;
+}
+
+SegmentFilePtr SegmentStore::activeSegment()
+{
+    if(m_active && m_active->size < m_segment_size)
+        return m_active;
+    uint32_t id = m_next_id++;
+    string path = segment_path(m_dir, id);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        LogErrorExt << "create segment failed," << strerror(errno) << "," << path;
+        return nullptr;
+    }
+    SegmentFilePtr seg = std::make_shared<SegmentFile>(id, path, fd);
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_active = seg;
+        m_segments[id] = seg;
+    }
+    //旧的段写满了, 可以开始压缩
+    m_cond.notify_one();
+    return seg;
+}
+
+bool SegmentStore::append(const SegmentFilePtr& seg, uint64_t seq, uint8_t type, const string& rel_path,
+                          const char* data, int64_t size, time_t mtime, SegmentRecord& record)
+{
+    string header = encode_header(seq, type, rel_path, data, size, mtime);
+    struct iovec iov[2];
+    iov[0].iov_base = &header[0];
+    iov[0].iov_len = header.size();
+    iov[1].iov_base = const_cast<char*>(data);
+    iov[1].iov_len = static_cast<size_t>(size);
+    int64_t length = record_length(rel_path.size(), size);
+    //size 只有持有 m_write_mutex 的写入方修改, 这里不需要 m_mutex
+    int64_t base = seg->size;
+    int64_t written = 0;
+    while(written < length)
+    {
+        //短写时从已写完的位置继续
+        struct iovec rest[2];
+        int count = 0;
+        int64_t skip = written;
+        for(int i = 0; i < 2; ++i)
+        {
+            if(skip >= static_cast<int64_t>(iov[i].iov_len))
+            {
+                skip -= iov[i].iov_len;
+                continue;
+            }
+            rest[count].iov_base = static_cast<char*>(iov[i].iov_base) + skip;
+            rest[count].iov_len = iov[i].iov_len - skip;
+            skip = 0;
+            ++count;
+        }
+        ssize_t n = ::pwritev(seg->fd, rest, count, base + written);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+        {
+            LogErrorExt << "write segment failed," << strerror(errno) << "," << seg->path;
+            //去掉写了一半的记录
+            if(::ftruncate(seg->fd, base) != 0)
+            {
+                LogErrorExt << "truncate segment failed," << strerror(errno) << "," << seg->path;
+            }
+            return false;
+        }
+        written += n;
+    }
+    record.rel_path = rel_path;
+    record.segment = seg->id;
+    record.offset = base + static_cast<int64_t>(header.size());
+    record.size = size;
+    record.mtime = mtime;
+    record.seq = seq;
+    std::lock_guard<std::mutex> lk(m_mutex);
+    seg->size += length;
+    seg->live += length;
+    seg->min_seq = std::min(seg->min_seq, seq);
+    return true;
+}
+
+bool SegmentStore::put(const string& rel_path, const string& data, time_t mtime, SegmentRecord& record)
+{
+    std::lock_guard<std::mutex> wlk(m_write_mutex);
+    SegmentFilePtr seg = activeSegment();
+    if(!seg)
+        return false;
+    return append(seg, m_next_seq++, RECORD_PUT, rel_path, data.data(), static_cast<int64_t>(data.size()), mtime, record);
+}
+
+void SegmentStore::remove(const SegmentRecord& record)
+{
+    release(record);
+    std::lock_guard<std::mutex> wlk(m_write_mutex);
+    SegmentFilePtr seg = activeSegment();
+    SegmentRecord tomb;
+    //写失败时重启后文件会重新出现, 只能记录日志
+    if(!seg || !append(seg, m_next_seq++, RECORD_DELETE, record.rel_path, nullptr, 0, time(nullptr), tomb))
+    {
+        LogErrorExt << "write segment delete record failed," << record.rel_path;
+    }
+}
+
+void SegmentStore::release(const SegmentRecord& record)
+{
+    std::lock_guard<std::mutex> lk(m_mutex);
+    auto it = m_segments.find(record.segment);
+    if(it != m_segments.end())
+        it->second->live -= record_length(record.rel_path.size(), record.size);
+}
+
+SegmentFilePtr SegmentStore::segment(uint32_t id)
+{
+    std::lock_guard<std::mutex> lk(m_mutex);
+    auto it = m_segments.find(id);
+    if(it == m_segments.end())
+        return nullptr;
+    return it->second;
+}
+
+void SegmentStore::compactLoop()
+{
+    std::unique_lock<std::mutex> lk(m_mutex);
+    while(!m_stop)
+    {
+        m_cond.wait_for(lk, std::chrono::seconds(COMPACT_INTERVAL));
+        if(m_stop)
+            break;
+        //有效数据不到一半的已写满的段
+        SegmentFilePtr victim;
+        for(auto& kv : m_segments)
+        {
+            if(kv.second != m_active && kv.second->live * 2 < kv.second->size)
+            {
+                victim = kv.second;
+                break;
+            }
+        }
+        if(!victim)
+            continue;
+        lk.unlock();
+        compact(victim);
+        lk.lock();
+    }
+}
+
+void SegmentStore::compact(const SegmentFilePtr& seg)
+{
+    int64_t size;
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        size = seg->size;
+    }
+    int64_t offset = 0;
+    int64_t moved = 0;
+    char buf[HEADER_SIZE];
+    string data;
+    //复制写入过的段, 删除旧段前要落盘
+    vector<SegmentFilePtr> written;
+    auto const copy = [&](uint64_t seq, uint8_t type, const string& rel_path, int64_t len, time_t mtime,
+                          SegmentRecord& to) {
+        std::lock_guard<std::mutex> wlk(m_write_mutex);
+        SegmentFilePtr active = activeSegment();
+        if(!active || !append(active, seq, type, rel_path, data.data(), len, mtime, to))
+            return false;
+        if(written.empty() || written.back() != active)
+            written.push_back(active);
+        return true;
+    };
+    while(offset < size)
+    {
+        RecordHeader h;
+        if(!pread_all(seg->fd, buf, HEADER_SIZE, offset) || !decode_header(buf, h))
+        {
+            LogErrorExt << "read segment failed," << offset << "," << seg->path;
+            return;
+        }
+        SegmentRecord from;
+        from.rel_path.resize(h.path_len);
+        if(h.path_len > 0 && !pread_all(seg->fd, &from.rel_path[0], h.path_len, offset + HEADER_SIZE))
+        {
+            LogErrorExt << "read segment failed," << offset << "," << seg->path;
+            return;
+        }
+        from.segment = seg->id;
+        from.offset = offset + HEADER_SIZE + h.path_len;
+        from.size = h.size;
+        from.mtime = h.mtime;
+        from.seq = h.seq;
+        offset += record_length(h.path_len, h.size);
+
+        if(h.type == RECORD_PUT)
+        {
+            if(!m_is_live(from))
+                continue;
+            data.resize(static_cast<size_t>(h.size));
+            if(h.size > 0 && !pread_all(seg->fd, &data[0], data.size(), from.offset))
+            {
+                LogErrorExt << "read segment failed," << from.offset << "," << seg->path;
+                return;
+            }
+            SegmentRecord to;
+            if(!copy(h.seq, RECORD_PUT, from.rel_path, h.size, h.mtime, to))
+                return;
+            //复制期间文件被删除或替换
+            if(!m_relocate(from, to))
+                release(to);
+            ++moved;
+        }
+        else
+        {
+            //其他段中可能还有序号更小的同名文件, 删除记录要保留
+            bool needed = false;
+            {
+                std::lock_guard<std::mutex> lk(m_mutex);
+                for(auto& kv : m_segments)
+                {
+                    if(kv.second != seg && kv.second->min_seq < h.seq)
+                    {
+                        needed = true;
+                        break;
+                    }
+                }
+            }
+            SegmentRecord to;
+            if(needed && !copy(h.seq, RECORD_DELETE, from.rel_path, 0, h.mtime, to))
+                return;
+        }
+    }
+    //复制的记录与新建的段落盘后才能删除旧段, 否则掉电会丢失已经持久的文件
+    for(const SegmentFilePtr& w : written)
+    {
+        if(::fdatasync(w->fd) != 0)
+        {
+            LogErrorExt << "sync segment failed," << strerror(errno) << "," << w->path;
+            return;
+        }
+    }
+    int dir_fd = ::open(m_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dir_fd >= 0)
+    {
+        ::fsync(dir_fd);
+    }
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_segments.erase(seg->id);
+    }
+    //正在读的请求持有 fd, 删除后仍可读完
+    ::unlink(seg->path.c_str());
+    if(dir_fd >= 0)
+    {
+        ::fsync(dir_fd);
+        ::close(dir_fd);
+    }
+    LogInfo << "segment compacted," << moved << "," << size << "," << seg->path;
+}
@@ -0,0 +1,101 @@
+#ifndef SEGMENT_STORE_H
+#define SEGMENT_STORE_H
+
+#include "kconfig.h"
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+
+//一个段文件, 读取方持有期间段被压缩删除仍可以继续读
+//id, path, fd 不变, 其余字段由 SegmentStore::m_mutex 保护, size 只在同时持有 m_write_mutex 时修改
+struct SegmentFile : private boost::noncopyable
+{
+    SegmentFile(uint32_t id, const string& path, int fd) : id(id), path(path), fd(fd) {}
+    ~SegmentFile();
+
+    const uint32_t id;
+    const string path;
+    const int fd;
+    int64_t size = 0;   //已写入长度
+    int64_t live = 0;   //仍然有效的记录长度
+    uint64_t min_seq = std::numeric_limits<uint64_t>::max();   //段中记录的最小序号
+};
+
+typedef std::shared_ptr<SegmentFile> SegmentFilePtr;
+
+//段中的一个文件
+struct SegmentRecord
+{
+    string rel_path;
+    uint32_t segment = 0;
+    int64_t offset = 0;     //数据在段文件中的偏移
+    int64_t size = 0;
+    time_t mtime = 0;
+    uint64_t seq = 0;       //写入序号, 压缩搬移后不变
+};
+
+//小文件打包存储: 上传完成的小文件追加到存储盘 {root}/.segments 下的大文件, 不再每个文件占一个inode
+//记录格式(小端): u32 magic, u32 crc32(之后的头, 路径与数据), u64 序号, u8 类型, u16 路径长度, u64 数据长度, i64 修改时间, 路径, 数据
+//删除记录没有数据; 重放时同一路径序号最大的记录有效, 只校验每个段最后一条记录, 写入时崩溃的尾部被截掉
+//段中间的记录损坏时 open 失败, 不截断
+//段文件写满 segment_size 后换一个新段; 有效数据不到一半的段由后台线程压缩: 有效记录复制到当前段, 落盘后删除旧段
+//追加由 m_write_mutex 串行, 段表由 m_mutex 保护且持有时不做IO, 读取方取段不会等待写盘
+class SegmentStore : private boost::noncopyable
+{
+public:
+    //记录是否仍被索引引用
+    typedef std::function<bool(const SegmentRecord&)> LiveCheck;
+    //记录复制到新位置后更新索引, 索引已经变化时返回false
+    typedef std::function<bool(const SegmentRecord& from, const SegmentRecord& to)> Relocate;
+
+    SegmentStore(const string& dir, int64_t segment_size);
+    ~SegmentStore();
+
+    //扫描所有段得到有效的文件记录
+    bool open(vector<SegmentRecord>& records);
+    //记录加入索引后启动压缩线程
+    void startCompaction(LiveCheck is_live, Relocate relocate);
+
+    //追加一个文件, 阻塞操作, 在存储盘的IO线程上调用
+    bool put(const string& rel_path, const string& data, time_t mtime, SegmentRecord& record);
+    //文件被删除或被独立文件替换: 追加删除记录, 旧记录不再有效
+    void remove(const SegmentRecord& record);
+    //文件被段中新的记录替换, 新记录序号更大, 不需要删除记录
+    void release(const SegmentRecord& record);
+
+    //读取文件用, 段已被压缩删除时返回空, 调用方重新查索引
+    SegmentFilePtr segment(uint32_t id);
+
+private:
+    //以下调用方持有 m_write_mutex
+    SegmentFilePtr activeSegment();
+    bool append(const SegmentFilePtr& seg, uint64_t seq, uint8_t type, const string& rel_path,
+                const char* data, int64_t size, time_t mtime, SegmentRecord& record);
+
+    bool scan(const SegmentFilePtr& seg, int64_t file_size, std::map<string, std::pair<SegmentRecord, uint8_t>>& latest);
+    void compactLoop();
+    void compact(const SegmentFilePtr& seg);
+
+    string m_dir;
+    int64_t m_segment_size;
+    LiveCheck m_is_live;
+    Relocate m_relocate;
+
+    //串行追加, 写盘期间持有
+    std::mutex m_write_mutex;
+    uint64_t m_next_seq = 1;
+    uint32_t m_next_id = 1;
+
+    //段表与各段的统计
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_stop = false;
+    map<uint32_t, SegmentFilePtr> m_segments;
+    SegmentFilePtr m_active;    //两个锁都持有时修改
+    std::thread m_thread;
+};
+
+typedef std::shared_ptr<SegmentStore> SegmentStorePtr;
+
+#endif // SEGMENT_STORE_H
@@ -0,0 +1,71 @@
+#include "send_file.h"
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+bool send_file(tcp::socket& socket, int fd, int64_t offset, int64_t size, BSError& ec)
+{
+    if(!socket.native_non_blocking())
+    {
+        socket.native_non_blocking(true, ec);
+        if(ec)
+            return false;
+    }
+    off_t off = offset;
+    while(size > 0)
+    {
+        ssize_t n = ::sendfile(socket.native_handle(), fd, &off, static_cast<size_t>(std::min<int64_t>(size, 1 << 30)));
+        if(n > 0)
+        {
+            size -= n;
+            continue;
+        }
+        if(n == 0)
+        {
+            ec = boost::asio::error::eof;
+            return false;
+        }
+        if(errno == EINTR)
+            continue;
+        if(errno == EAGAIN)
+        {
+            socket.async_wait(tcp::socket::wait_write, boost::fibers::asio::yield[ec]);
+            if(ec)
+                return false;
+            continue;
+        }
+        ec.assign(errno, boost::system::system_category());
+        return false;
+    }
+    return true;
+}
+
+bool send_file(Connection& conn, int fd, int64_t offset, int64_t size, BSError& ec)
+{
+    if(conn.raw())
+        return send_file(conn.socket(), fd, offset, size, ec);
+    const size_t CHUNK_SIZE = 64 * 1024;
+    std::unique_ptr<char[]> buf(new char[CHUNK_SIZE]);
+    while(size > 0)
+    {
+        ssize_t n = ::pread(fd, buf.get(), static_cast<size_t>(std::min<int64_t>(size, CHUNK_SIZE)), offset);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            ec.assign(errno, boost::system::system_category());
+            return false;
+        }
+        if(n == 0)
+        {
+            ec = boost::asio::error::eof;
+            return false;
+        }
+        boost::asio::async_write(conn, boost::asio::buffer(buf.get(), static_cast<size_t>(n)),
+                                 boost::fibers::asio::yield[ec]);
+        if(ec)
+            return false;
+        offset += n;
+        size -= n;
+    }
+    return true;
+}
@@ -0,0 +1,14 @@
+#ifndef SEND_FILE_H
+#define SEND_FILE_H
+
+#include "kconfig.h"
+#include "connection.h"
+
+//sendfile 把文件 [offset, offset+size) 从页缓存直接发到socket, 不经过用户态缓冲
+//socket发送缓冲满时挂起当前fiber等待可写, kTLS连接同样适用
+//文件比 size 短时 ec 为 eof
+bool send_file(tcp::socket& socket, int fd, int64_t offset, int64_t size, BSError& ec);
+//用户态TLS的连接不能 sendfile, 分块读出后经过TLS层发送
+bool send_file(Connection& conn, int fd, int64_t offset, int64_t size, BSError& ec);
+
+#endif // SEND_FILE_H
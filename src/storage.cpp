@@ -0,0 +1,150 @@
+#include "storage.h"
+#include <sys/statvfs.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+//大文件每次截断的长度
+const off_t TRUNCATE_STEP = 1024LL * 1024 * 1024;
+
+int64_t now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//大文件先从尾部分段截断再 unlink, 避免一次释放大量extent长时间占住文件系统日志
+void unlink_large(const string& path)
+{
+    struct stat st;
+    if(::stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > TRUNCATE_STEP)
+    {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if(fd >= 0)
+        {
+            for(off_t len = (st.st_size - 1) / TRUNCATE_STEP * TRUNCATE_STEP; len > 0; len -= TRUNCATE_STEP)
+            {
+                ::ftruncate(fd, len);
+            }
+            ::close(fd);
+        }
+    }
+    if(::unlink(path.c_str()) != 0 && errno != ENOENT)
+    {
+        LogWarnExt << "unlink failed," << strerror(errno) << "," << path;
+    }
+}
+
+//清理上次退出时没有删完的文件
+void purge_trash(const string& trash_dir)
+{
+    DIR* d = ::opendir(trash_dir.c_str());
+    if(!d)
+        return;
+    while(struct dirent* de = ::readdir(d))
+    {
+        if(de->d_name[0] == '.')
+            continue;
+        unlink_large(trash_dir + "/" + de->d_name);
+    }
+    ::closedir(d);
+}
+}
+
+StorageRoot::StorageRoot(size_t index, const string& path, size_t io_threads) :
+    m_index(index), m_path(path), m_io_pool(io_threads), m_trash_pool(1)
+{
+    while(m_path.size() > 1 && m_path.back() == '/')
+    {
+        m_path.pop_back();
+    }
+    boost::system::error_code e;
+    fs::create_directories(m_path, e);
+    m_healthy = true;
+    m_fill_permille = 0;
+    m_refresh_time = 0;
+    refresh(0);
+
+    m_trash_seq = 0;
+    m_start_time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+    string trash_dir = m_path + "/.trash";
+    fs::create_directory(trash_dir, e);
+    boost::asio::post(m_trash_pool, [trash_dir]() {
+        purge_trash(trash_dir);
+    });
+}
+
+StorageRoot::~StorageRoot()
+{
+    m_io_pool.join();
+    m_trash_pool.join();
+}
+
+bool StorageRoot::trash(const string& path)
+{
+    string trash_path = m_path + "/.trash/" + std::to_string(m_start_time) + "-" + std::to_string(m_trash_seq++);
+    if(::rename(path.c_str(), trash_path.c_str()) != 0)
+    {
+        if(errno != ENOENT)
+        {
+            LogWarnExt << "rename to trash failed," << strerror(errno) << "," << path;
+        }
+        return false;
+    }
+    boost::asio::post(m_trash_pool, [trash_path]() {
+        unlink_large(trash_path);
+    });
+    return true;
+}
+
+void StorageRoot::refresh(int64_t interval_ms)
+{
+    int64_t now = now_ms();
+    int64_t last = m_refresh_time;
+    if(now - last < interval_ms || !m_refresh_time.compare_exchange_strong(last, now))
+        return;
+
+    struct statvfs st;
+    if(::statvfs(m_path.c_str(), &st) != 0 || st.f_blocks == 0 || (st.f_flag & ST_RDONLY))
+    {
+        if(m_healthy)
+        {
+            LogErrorExt << "storage root unhealthy," << m_path;
+        }
+        m_healthy = false;
+        return;
+    }
+    m_healthy = true;
+    m_fill_permille = static_cast<int>((st.f_blocks - st.f_bavail) * 1000 / st.f_blocks);
+}
+
+Storage::Storage(const vector<string>& roots, size_t io_threads, int max_fill_permille) :
+    m_max_fill_permille(max_fill_permille)
+{
+    for(size_t i = 0; i < roots.size(); ++i)
+    {
+        m_roots.push_back(std::make_shared<StorageRoot>(i, roots[i], io_threads));
+        m_ring.addNode(i, m_roots.back()->path());
+    }
+}
+
+StorageRootPtr Storage::place(const string& rel_path)
+{
+    StorageRootPtr fallback;
+    for(size_t i : m_ring.preference(rel_path))
+    {
+        StorageRootPtr& root = m_roots[i];
+        root->refresh();
+        if(!root->healthy())
+            continue;
+        if(root->fillPermille() < m_max_fill_permille)
+            return root;
+        //都超过水位时选最空的盘
+        if(!fallback || root->fillPermille() < fallback->fillPermille())
+            fallback = root;
+    }
+    return fallback;
+}
@@ -0,0 +1,84 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "kconfig.h"
+#include "hash_ring.h"
+#include <boost/asio/thread_pool.hpp>
+#include <boost/fiber/future.hpp>
+
+//一个存储根目录,通常对应一块盘
+//阻塞的文件操作投递到这块盘自己的IO线程执行,慢盘不会占住网络线程,也不会拖慢其他盘
+class StorageRoot : private boost::noncopyable
+{
+public:
+    StorageRoot(size_t index, const string& path, size_t io_threads);
+    ~StorageRoot();
+
+    size_t index() const { return m_index; }
+    const string& path() const { return m_path; }
+    //rel_path 形如 {dir}/{name}
+    string fullPath(const string& rel_path) const { return m_path + "/" + rel_path; }
+
+    bool healthy() const { return m_healthy; }
+    //已用空间比例 0-1000
+    int fillPermille() const { return m_fill_permille; }
+    //statvfs 更新健康状态与水位, 距离上次更新不足 interval_ms 时直接返回
+    void refresh(int64_t interval_ms = 1000);
+
+    //在IO线程执行 f, 当前fiber挂起等待结果
+    template<typename F>
+    auto run(F&& f) -> decltype(f())
+    {
+        typedef decltype(f()) R;
+        boost::fibers::packaged_task<R()> task(std::forward<F>(f));
+        boost::fibers::future<R> fut = task.get_future();
+        boost::asio::post(m_io_pool, std::move(task));
+        return fut.get();
+    }
+
+    //把文件移到 {root}/.trash 后由后台删除线程 unlink, 删除大文件不占用IO线程
+    //rename 本身在调用方线程执行, 文件不存在返回false
+    bool trash(const string& path);
+
+    //在IO线程执行 f, 不等待
+    template<typename F>
+    void post(F&& f)
+    {
+        boost::asio::post(m_io_pool, std::forward<F>(f));
+    }
+
+private:
+    size_t m_index;
+    string m_path;
+    boost::asio::thread_pool m_io_pool;
+    boost::asio::thread_pool m_trash_pool;
+    std::atomic<uint64_t> m_trash_seq;
+    int64_t m_start_time;
+    std::atomic_bool m_healthy;
+    std::atomic_int m_fill_permille;
+    std::atomic<int64_t> m_refresh_time;
+};
+
+typedef std::shared_ptr<StorageRoot> StorageRootPtr;
+
+//多根目录存储,{dir}/{name} 按一致性哈希分布到各个根目录
+//写入时跳过不健康或超过水位的盘,读取时按同样的偏好顺序查找
+class Storage : private boost::noncopyable
+{
+public:
+    Storage(const vector<string>& roots, size_t io_threads, int max_fill_permille);
+
+    const vector<StorageRootPtr>& roots() const { return m_roots; }
+
+    //新文件写入的位置, 所有盘都不可用时返回空
+    StorageRootPtr place(const string& rel_path);
+
+private:
+    vector<StorageRootPtr> m_roots;
+    HashRing m_ring;
+    int m_max_fill_permille;
+};
+
+typedef std::shared_ptr<Storage> StoragePtr;
+
+#endif // STORAGE_H
@@ -0,0 +1,394 @@
+#include "tar_ingest.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace {
+const size_t BLOCK_SIZE = 512;
+//长文件名与pax头的上限
+const int64_t MAX_EXT_SIZE = 64 * 1024;
+//每批提交的条目数与字节数
+const size_t BATCH_FILES = 256;
+const int64_t BATCH_BYTES = 64 * 1024 * 1024;
+
+//八进制数字段, 首字节最高位为1时是 base-256 编码 (GNU)
+bool parse_number(const char* field, size_t len, int64_t& value)
+{
+    value = 0;
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(field);
+    if(p[0] & 0x80)
+    {
+        if(p[0] & 0x40)
+            return false;   //负数
+        value = p[0] & 0x3f;
+        for(size_t i = 1; i < len; ++i)
+        {
+            if(value > (INT64_MAX >> 8))
+                return false;
+            value = (value << 8) | p[i];
+        }
+        return true;
+    }
+    size_t i = 0;
+    while(i < len && (p[i] == ' ' || p[i] == '\0'))
+        ++i;
+    for(; i < len && p[i] >= '0' && p[i] <= '7'; ++i)
+    {
+        value = (value << 3) | (p[i] - '0');
+    }
+    return true;
+}
+
+string field_string(const char* field, size_t len)
+{
+    return string(field, strnlen(field, len));
+}
+
+bool zero_block(const char* block)
+{
+    for(size_t i = 0; i < BLOCK_SIZE; ++i)
+    {
+        if(block[i])
+            return false;
+    }
+    return true;
+}
+}
+
+TarIngest::TarIngest(const StorageRootPtr& root, const string& dir_name, const boost::regex& name_regex) :
+    m_root(root), m_dir_name(dir_name), m_name_regex(name_regex)
+{
+}
+
+TarIngest::~TarIngest()
+{
+    abort();
+    if(m_dir_fd >= 0)
+    {
+        ::close(m_dir_fd);
+    }
+}
+
+bool TarIngest::open(BSError& ec)
+{
+    string dir_path = m_root->fullPath(m_dir_name);
+    if(::mkdir(dir_path.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        ec.assign(errno, boost::system::system_category());
+        LogErrorExt << "mkdir failed," << ec.message() << "," << dir_path;
+        return false;
+    }
+    m_dir_fd = ::open(dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(m_dir_fd < 0)
+    {
+        ec.assign(errno, boost::system::system_category());
+        LogErrorExt << "open dir failed," << ec.message() << "," << dir_path;
+        return false;
+    }
+    return true;
+}
+
+bool TarIngest::feed(const char* data, size_t size)
+{
+    if(!m_error.empty())
+        return false;
+    while(size > 0 && m_state != STATE::END)
+    {
+        size_t n = 0;
+        if(m_state == STATE::HEADER)
+        {
+            n = std::min(BLOCK_SIZE - m_header_used, size);
+            memcpy(m_header + m_header_used, data, n);
+            m_header_used += n;
+            if(m_header_used == BLOCK_SIZE)
+            {
+                m_header_used = 0;
+                if(!parseHeader())
+                    return false;
+            }
+        }
+        else if(m_state == STATE::PADDING)
+        {
+            n = static_cast<size_t>(std::min<int64_t>(m_padding, size));
+            m_padding -= n;
+            if(m_padding == 0)
+                m_state = STATE::HEADER;
+        }
+        else
+        {
+            n = static_cast<size_t>(std::min<int64_t>(m_remain, size));
+            if(m_state == STATE::DATA)
+            {
+                const char* p = data;
+                size_t left = n;
+                while(left > 0)
+                {
+                    ssize_t w = ::write(m_fd, p, left);
+                    if(w < 0)
+                    {
+                        if(errno == EINTR)
+                            continue;
+                        int err = errno;
+                        ::close(m_fd);
+                        m_fd = -1;
+                        ::unlinkat(m_dir_fd, m_tmp_name.c_str(), 0);
+                        m_entries.back().error = strerror(err);
+                        m_state = STATE::SKIP;
+                        if(err == ENOSPC || err == EDQUOT)
+                            return fail("Insufficient storage");
+                        break;
+                    }
+                    p += w;
+                    left -= w;
+                }
+            }
+            else if(m_state == STATE::FORWARD)
+            {
+                forward(data, n, false);
+            }
+            else if(m_state == STATE::LONGNAME || m_state == STATE::PAX)
+            {
+                m_ext.append(data, n);
+            }
+            m_remain -= n;
+            if(m_remain == 0 && !contentDone())
+                return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool TarIngest::parseHeader()
+{
+    if(zero_block(m_header))
+    {
+        //两个全零块表示结束
+        if(++m_zero_blocks >= 2)
+            m_state = STATE::END;
+        return true;
+    }
+    m_zero_blocks = 0;
+
+    int64_t checksum = 0;
+    if(!parse_number(m_header + 148, 8, checksum))
+        return fail("Malformed tar header");
+    int64_t sum = 0;
+    for(size_t i = 0; i < BLOCK_SIZE; ++i)
+    {
+        sum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(m_header[i]);
+    }
+    if(sum != checksum)
+        return fail("Tar header checksum mismatch");
+
+    int64_t size = 0;
+    if(!parse_number(m_header + 124, 12, size))
+        return fail("Malformed tar header");
+    m_remain = size;
+    m_padding = (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE;
+
+    char type = m_header[156];
+    if(type == 'L' || type == 'x')
+    {
+        if(size > MAX_EXT_SIZE)
+            return fail("Tar extended header too long");
+        m_ext.clear();
+        m_state = type == 'L' ? STATE::LONGNAME : STATE::PAX;
+    }
+    else
+    {
+        string path;
+        if(!m_next_name.empty())
+        {
+            path.swap(m_next_name);
+        }
+        else
+        {
+            path = field_string(m_header, 100);
+            //ustar 的 prefix 字段
+            if(memcmp(m_header + 257, "ustar", 5) == 0 && m_header[345])
+                path = field_string(m_header + 345, 155) + "/" + path;
+        }
+        if(type == '0' || type == '\0' || type == '7')
+        {
+            beginFile(path, size);
+        }
+        else
+        {
+            //目录与全局pax头不算条目, 链接 设备文件等不支持
+            if(type != '5' && type != 'g')
+            {
+                Entry e;
+                e.name = path;
+                e.error = "unsupported entry type";
+                m_entries.push_back(std::move(e));
+            }
+            m_state = STATE::SKIP;
+        }
+    }
+    if(m_remain == 0)
+        return contentDone();
+    return true;
+}
+
+bool TarIngest::contentDone()
+{
+    if(m_state == STATE::DATA)
+    {
+        if(!endFile())
+            return false;
+    }
+    else if(m_state == STATE::FORWARD)
+    {
+        forward(nullptr, 0, true);
+    }
+    else if(m_state == STATE::LONGNAME)
+    {
+        m_next_name = field_string(m_ext.data(), m_ext.size());
+    }
+    else if(m_state == STATE::PAX)
+    {
+        //记录格式 "{len} {key}={value}\n"
+        size_t pos = 0;
+        while(pos < m_ext.size())
+        {
+            size_t space = m_ext.find(' ', pos);
+            if(space == string::npos)
+                break;
+            size_t len = strtoul(m_ext.c_str() + pos, nullptr, 10);
+            if(len == 0 || pos + len > m_ext.size())
+                break;
+            boost::beast::string_view record(m_ext.data() + space + 1, pos + len - space - 2);
+            if(record.starts_with("path="))
+                m_next_name = record.substr(5).to_string();
+            pos += len;
+        }
+    }
+    m_state = m_padding > 0 ? STATE::PADDING : STATE::HEADER;
+    return true;
+}
+
+void TarIngest::beginFile(const string& path, int64_t size)
+{
+    //只保存文件名, 包内的目录层次去掉
+    if(path.empty() || path.back() == '/')
+    {
+        m_state = STATE::SKIP;
+        return;
+    }
+    Entry e;
+    size_t slash = path.rfind('/');
+    e.name = slash == string::npos ? path : path.substr(slash + 1);
+    m_state = STATE::SKIP;
+    if(!boost::regex_match(e.name, m_name_regex))
+    {
+        e.error = "illegal name";
+    }
+    else if(m_local && !m_local(e.name))
+    {
+        e.forwarded = true;
+        m_state = STATE::FORWARD;
+    }
+    else
+    {
+        //同一个包里可能有同名条目, 临时文件名带上条目序号
+        m_tmp_name = "." + e.name + "." + std::to_string(m_entries.size()) + ".ingest";
+        m_fd = ::openat(m_dir_fd, m_tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(m_fd < 0)
+            e.error = strerror(errno);
+        else
+            m_state = STATE::DATA;
+    }
+    e.meta.size = size;
+    m_entries.push_back(std::move(e));
+}
+
+bool TarIngest::endFile()
+{
+    Entry& e = m_entries.back();
+    struct stat st;
+    if(::fstat(m_fd, &st) == 0)
+    {
+        e.meta.size = st.st_size;
+        e.meta.mtime = st.st_mtim.tv_sec;
+        e.meta.etag = make_file_etag(st.st_ino, st.st_size, st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+    }
+    e.meta.root = m_root->index();
+    //先开始回写, 提交时的 fdatasync 只需等待
+    ::sync_file_range(m_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    m_batch.push_back(BatchItem{m_entries.size() - 1, m_tmp_name, m_fd});
+    m_fd = -1;
+    m_batch_bytes += e.meta.size;
+    if(m_batch.size() >= BATCH_FILES || m_batch_bytes >= BATCH_BYTES)
+        return commitBatch();
+    return true;
+}
+
+void TarIngest::forward(const char* data, size_t size, bool end)
+{
+    size_t entry = m_entries.size() - 1;
+    if(m_forward.empty() || m_forward.back().entry != entry)
+        m_forward.push_back(ForwardPiece{entry, string(), false});
+    m_forward.back().data.append(data, size);
+    m_forward.back().end = end;
+}
+
+bool TarIngest::commitBatch()
+{
+    if(m_batch.empty())
+        return true;
+    //数据落盘后才 rename, 掉电不会留下不完整的文件; 回写在写完每个文件时已经开始
+    for(BatchItem& item : m_batch)
+    {
+        Entry& e = m_entries[item.entry];
+        int ret = ::fdatasync(item.fd);
+        int err = errno;
+        ::close(item.fd);
+        item.fd = -1;
+        if(ret != 0 || ::renameat(m_dir_fd, item.tmp_name.c_str(), m_dir_fd, e.name.c_str()) != 0)
+        {
+            e.error = strerror(ret != 0 ? err : errno);
+            ::unlinkat(m_dir_fd, item.tmp_name.c_str(), 0);
+        }
+    }
+    ::fsync(m_dir_fd);
+    m_batch.clear();
+    m_batch_bytes = 0;
+    return true;
+}
+
+bool TarIngest::finish()
+{
+    if(!m_error.empty())
+        return false;
+    //没有结束块但停在条目边界上也接受
+    if(m_state != STATE::END && !(m_state == STATE::HEADER && m_header_used == 0))
+        return fail("Incomplete tar archive");
+    return commitBatch();
+}
+
+void TarIngest::abort()
+{
+    if(m_fd >= 0)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+        ::unlinkat(m_dir_fd, m_tmp_name.c_str(), 0);
+        m_entries.back().error = "aborted";
+    }
+    for(BatchItem& item : m_batch)
+    {
+        ::close(item.fd);
+        ::unlinkat(m_dir_fd, item.tmp_name.c_str(), 0);
+        m_entries[item.entry].error = "aborted";
+    }
+    m_batch.clear();
+    m_batch_bytes = 0;
+}
+
+bool TarIngest::fail(const string& why)
+{
+    m_error = why;
+    return false;
+}
@@ -0,0 +1,107 @@
+#ifndef TAR_INGEST_H
+#define TAR_INGEST_H
+
+#include "kconfig.h"
+#include "storage.h"
+#include "file_index.h"
+#include <functional>
+
+//tar流式解包到 {dir}/{name}, 用于一次请求上传大量小文件
+//整个请求只检查一次目录, 条目先写成 .{name}.{序号}.ingest 临时文件, 包内同名的条目后面的覆盖前面的
+//每个文件写完时 sync_file_range 开始回写, 每批提交时逐个 fdatasync 后 rename 并 fsync 目录,
+//只同步本批的文件, 不拖慢同一块盘上的其他上传
+//所有方法都是阻塞的文件操作, 在存储盘的IO线程上调用
+class TarIngest : private boost::noncopyable
+{
+public:
+    struct Entry
+    {
+        string name;
+        string error;   //为空表示已提交
+        FileMeta meta;
+        bool forwarded = false;     //内容交给调用方转发, 不写盘
+    };
+
+    //转发条目的一段内容, end 为true时这个条目结束
+    struct ForwardPiece
+    {
+        size_t entry;       //m_entries下标
+        string data;
+        bool end;
+    };
+
+    TarIngest(const StorageRootPtr& root, const string& dir_name, const boost::regex& name_regex);
+    ~TarIngest();
+
+    bool open(BSError& ec);
+    //包格式错误或写盘失败返回false, 之后不再接收数据
+    bool feed(const char* data, size_t size);
+    //提交最后一批, 包不完整时返回false
+    bool finish();
+    //删除未提交的临时文件
+    void abort();
+
+    //集群中 local 返回false的条目不写盘, 内容按顺序放入 forwardPieces(), 调用方每次 feed 之后取走并清空
+    //local 在IO线程上调用, 必须在 feed 之前设置
+    void setLocalFilter(std::function<bool(const string& name)> local) { m_local = std::move(local); }
+    vector<ForwardPiece>& forwardPieces() { return m_forward; }
+
+    const vector<Entry>& entries() const { return m_entries; }
+    const string& error() const { return m_error; }
+
+private:
+    enum class STATE
+    {
+        HEADER,
+        DATA,       //普通文件内容
+        LONGNAME,   //GNU 'L' 长文件名
+        PAX,        //pax 'x' 扩展头
+        SKIP,       //不保存的条目内容
+        FORWARD,    //转发的条目内容
+        PADDING,
+        END
+    };
+
+    bool parseHeader();
+    //条目内容读完
+    bool contentDone();
+    void beginFile(const string& path, int64_t size);
+    bool endFile();
+    void forward(const char* data, size_t size, bool end);
+    bool commitBatch();
+    bool fail(const string& why);
+
+    StorageRootPtr m_root;
+    string m_dir_name;
+    const boost::regex& m_name_regex;
+    int m_dir_fd = -1;
+
+    STATE m_state = STATE::HEADER;
+    char m_header[512];
+    size_t m_header_used = 0;
+    int64_t m_remain = 0;
+    int64_t m_padding = 0;
+    string m_ext;           //长文件名或pax头内容
+    string m_next_name;     //下一个条目的名字, 由长文件名或pax头给出
+    int m_zero_blocks = 0;
+
+    struct BatchItem
+    {
+        size_t entry;       //m_entries下标
+        string tmp_name;
+        int fd;             //提交时 fdatasync 后关闭
+    };
+
+    int m_fd = -1;          //当前写入的临时文件
+    string m_tmp_name;
+    vector<BatchItem> m_batch;  //待提交的条目
+    int64_t m_batch_bytes = 0;
+
+    std::function<bool(const string& name)> m_local;
+    vector<ForwardPiece> m_forward;
+
+    vector<Entry> m_entries;
+    string m_error;
+};
+
+#endif // TAR_INGEST_H
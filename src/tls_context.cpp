@@ -0,0 +1,178 @@
+#include "tls_context.h"
+#include <fstream>
+
+namespace ssl = boost::asio::ssl;
+
+namespace {
+bool kernel_tls_available()
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    std::ifstream in("/proc/sys/net/ipv4/tcp_available_ulp");
+    string ulp;
+    while(in >> ulp)
+    {
+        if(ulp == "tls")
+            return true;
+    }
+#endif
+    return false;
+}
+
+//SSL_* 返回 r 后按需要等待socket可读或可写, 不能继续时设置 ec
+void ssl_wait(SSL* conn, tcp::socket& socket, int r, boost::system::error_code& ec)
+{
+    int err = SSL_get_error(conn, r);
+    if(err == SSL_ERROR_WANT_READ)
+    {
+        socket.async_wait(tcp::socket::wait_read, boost::fibers::asio::yield[ec]);
+    }
+    else if(err == SSL_ERROR_WANT_WRITE)
+    {
+        socket.async_wait(tcp::socket::wait_write, boost::fibers::asio::yield[ec]);
+    }
+    else
+    {
+        ec = ssl_error(conn, r);
+    }
+}
+
+//握手超时关闭socket, 挂起的等待随之返回; 对象析构后定时器回调不再访问socket
+class HandshakeDeadline : private boost::noncopyable
+{
+public:
+    HandshakeDeadline(tcp::socket& socket, int seconds) :
+        m_timer(socket.get_executor()), m_state(std::make_shared<State>())
+    {
+        std::shared_ptr<State> state = m_state;
+        tcp::socket* s = &socket;
+        m_timer.expires_after(std::chrono::seconds(seconds));
+        m_timer.async_wait([state, s](const boost::system::error_code& ec) {
+            if(ec || state->done)
+                return;
+            state->expired = true;
+            boost::system::error_code e;
+            s->close(e);
+        });
+    }
+
+    ~HandshakeDeadline()
+    {
+        m_state->done = true;
+        m_timer.cancel();
+    }
+
+    //超时导致的失败改成 timed_out
+    void check(boost::system::error_code& ec) const
+    {
+        if(ec && m_state->expired)
+            ec = boost::asio::error::timed_out;
+    }
+
+private:
+    struct State
+    {
+        bool done = false;
+        bool expired = false;
+    };
+    boost::asio::steady_timer m_timer;
+    std::shared_ptr<State> m_state;
+};
+
+}
+
+TlsContext::TlsContext(const string& cert_file, const string& key_file, long session_timeout, int handshake_timeout) :
+    m_ctx(ssl::context::tls_server),
+    m_handshake_timeout(handshake_timeout),
+    m_ktls(kernel_tls_available())
+{
+    m_ctx.set_options(ssl::context::default_workarounds |
+                      ssl::context::no_sslv2 |
+                      ssl::context::no_sslv3 |
+                      ssl::context::no_tlsv1 |
+                      ssl::context::no_tlsv1_1 |
+                      ssl::context::single_dh_use);
+    m_ctx.use_certificate_chain_file(cert_file);
+    m_ctx.use_private_key_file(key_file, ssl::context::pem);
+
+    SSL_CTX* native = m_ctx.native_handle();
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(native, SSL_OP_ENABLE_KTLS);
+#endif
+    if(!m_ktls)
+    {
+        LogWarnExt << "kernel tls not available(openssl without ktls or tls module not loaded), tls runs in user space";
+    }
+    //内核TLS只支持AES-GCM/CHACHA20-POLY1305
+    SSL_CTX_set_cipher_list(native, "ECDHE+AESGCM:ECDHE+CHACHA20");
+
+    //会话恢复: 无状态ticket(TLS1.3/1.2) + 服务端session缓存(TLS1.2 session id)
+    static const unsigned char sid_ctx[] = "file_transfer_server";
+    SSL_CTX_set_session_id_context(native, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_timeout(native, session_timeout);
+    SSL_CTX_clear_options(native, SSL_OP_NO_TICKET);
+    SSL_CTX_set_num_tickets(native, 1);
+}
+
+bool TlsContext::handshake(Connection& conn, boost::system::error_code& ec)
+{
+    return m_ktls ? handshakeFd(conn, ec) : handshakeStream(conn, ec);
+}
+
+bool TlsContext::handshakeFd(Connection& conn, boost::system::error_code& ec)
+{
+    tcp::socket& socket = conn.socket();
+    std::unique_ptr<SSL, decltype(&SSL_free)> ssl_conn(SSL_new(m_ctx.native_handle()), &SSL_free);
+    if(!ssl_conn)
+    {
+        ec.assign(static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category());
+        return false;
+    }
+
+    //OpenSSL必须直接持有socket fd才能在握手后设置kTLS, 所以不使用asio的ssl::stream(内存BIO)
+    socket.non_blocking(true, ec);
+    if(ec)
+        return false;
+    SSL_set_fd(ssl_conn.get(), socket.native_handle());
+    SSL_set_accept_state(ssl_conn.get());
+
+    {
+        HandshakeDeadline deadline(socket, m_handshake_timeout);
+        for(;;)
+        {
+            ERR_clear_error();
+            int r = SSL_do_handshake(ssl_conn.get());
+            if(r == 1)
+                break;
+            ssl_wait(ssl_conn.get(), socket, r, ec);
+            if(ec)
+            {
+                deadline.check(ec);
+                return false;
+            }
+        }
+    }
+
+#ifdef SSL_OP_ENABLE_KTLS
+    if(BIO_get_ktls_send(SSL_get_wbio(ssl_conn.get())) && BIO_get_ktls_recv(SSL_get_rbio(ssl_conn.get())))
+    {
+        //密钥已经在内核中,不调用SSL_shutdown,直接释放SSL对象
+        socket.non_blocking(false, ec);
+        return !ec;
+    }
+#endif
+    LogDebug << "ktls not enabled after handshake, tls in user space, cipher:" << SSL_get_cipher_name(ssl_conn.get())
+             << ",version:" << SSL_get_version(ssl_conn.get());
+    //socket保持非阻塞, 读写时等待就绪后重试
+    conn.useSsl(ssl_conn.release());
+    return true;
+}
+
+bool TlsContext::handshakeStream(Connection& conn, boost::system::error_code& ec)
+{
+    ssl::stream<tcp::socket&>& stream = conn.useStream(m_ctx);
+    HandshakeDeadline deadline(conn.socket(), m_handshake_timeout);
+    stream.async_handshake(ssl::stream_base::server, boost::fibers::asio::yield[ec]);
+    deadline.check(ec);
+    return !ec;
+}
@@ -0,0 +1,35 @@
+#ifndef TLS_CONTEXT_H
+#define TLS_CONTEXT_H
+
+#include "kconfig.h"
+#include "connection.h"
+
+//TLS终结
+//握手由OpenSSL直接在socket fd上完成,成功后把会话密钥交给内核(kTLS),
+//之后socket当作普通tcp socket使用,读写和零拷贝发送都由内核加解密,不经过用户态缓冲
+//内核或OpenSSL不支持kTLS时用 asio ssl::stream 在用户态加解密; 握手后的协商结果不支持kTLS时用同一个SSL对象在用户态加解密
+//用户态加解密由 Connection 在会话读写时直接完成
+//支持session ticket会话恢复,短连接下载不需要完整握手
+class TlsContext
+{
+public:
+    TlsContext(const string& cert_file, const string& key_file, long session_timeout, int handshake_timeout);
+    ~TlsContext() = default;
+
+    //在当前fiber中完成握手, 超过 handshake_timeout 秒未完成时失败, 失败时连接不可再使用
+    //返回后 conn 上读写的都是明文, conn.raw() 为true时内核加解密
+    bool handshake(Connection& conn, boost::system::error_code& ec);
+
+private:
+    bool handshakeFd(Connection& conn, boost::system::error_code& ec);
+    bool handshakeStream(Connection& conn, boost::system::error_code& ec);
+
+    boost::asio::ssl::context m_ctx;
+    int m_handshake_timeout;
+    //启动时检查一次: OpenSSL 编译了kTLS且内核加载了 tls 模块
+    bool m_ktls = false;
+};
+
+typedef std::shared_ptr<TlsContext> TlsContextPtr;
+
+#endif // TLS_CONTEXT_H
@@ -7,6 +7,12 @@
 #include "transport_server.h"
 #include "down_task.h"
 #include "upload_task.h"
+#include "multipart_parser.h"
+#include "tar_ingest.h"
+#include "compute_pool.h"
+#include "fiber_stack.h"
+#include "send_file.h"
+#include <random>
 
 typedef std::shared_ptr<DownTask> DownTaskPtr;
 
@@ -44,6 +50,74 @@ boost::beast::string_view mime_type(boost::beast::string_view path)
     return "application/octet-stream";
 }
 
+//If-None-Match 与 If-Modified-Since 条件成立时返回true, 应答304 (RFC 7232)
+bool not_modified(const RequestFields& headers, const FileMeta& meta)
+{
+    auto it_inm = headers.find(http::field::if_none_match);
+    if(it_inm != headers.end())
+    {
+        //If-None-Match 使用弱比较, 存在时忽略 If-Modified-Since
+        boost::beast::string_view list = it_inm->value();
+        boost::beast::string_view etag = meta.etag;
+        size_t pos = 0;
+        while(pos < list.size())
+        {
+            size_t end = list.find(',', pos);
+            if(end == boost::beast::string_view::npos)
+                end = list.size();
+            boost::beast::string_view tag = list.substr(pos, end - pos);
+            while(!tag.empty() && (tag.front() == ' ' || tag.front() == '\t'))
+                tag.remove_prefix(1);
+            while(!tag.empty() && (tag.back() == ' ' || tag.back() == '\t'))
+                tag.remove_suffix(1);
+            if(tag.starts_with("W/"))
+                tag.remove_prefix(2);
+            if(tag == "*" || tag == etag)
+                return true;
+            pos = end + 1;
+        }
+        return false;
+    }
+
+    auto it_ims = headers.find(http::field::if_modified_since);
+    time_t since = 0;
+    if(it_ims != headers.end() && kkurl::parse_http_date(it_ims->value(), since))
+    {
+        return meta.mtime <= since;
+    }
+    return false;
+}
+
+//边上传边下载的加入位置: ?live_edge 最新数据, ?offset=N 字节偏移, ?since=T unix毫秒之后收到的数据
+bool parse_down_join(const kkurl::QueryParams& params, DownJoin& join)
+{
+    auto const int_value = [](boost::beast::string_view v, int64_t& n)
+    {
+        string str = v.to_string();
+        char* end = nullptr;
+        n = strtoll(str.c_str(), &end, 10);
+        return !str.empty() && *end == '\0' && n >= 0;
+    };
+    if(params.has("live_edge"))
+    {
+        join.mode = DownJoin::LIVE_EDGE;
+        return true;
+    }
+    boost::optional<boost::beast::string_view> v = params.find("offset");
+    if(v)
+    {
+        join.mode = DownJoin::OFFSET;
+        return int_value(*v, join.value);
+    }
+    v = params.find("since");
+    if(v)
+    {
+        join.mode = DownJoin::TIME;
+        return int_value(*v, join.value);
+    }
+    return true;
+}
+
 std::string path_cat(boost::beast::string_view base, boost::beast::string_view path)
 {
     if(base.empty())
@@ -66,11 +140,64 @@ std::string path_cat(boost::beast::string_view base, boost::beast::string_view p
     return result;
 }
 
+//rel_path 拆成目录名与文件名
+bool split_rel_path(const string& rel_path, string& dir_name, string& file_name)
+{
+    size_t pos = rel_path.find('/');
+    if(pos == string::npos)
+        return false;
+    dir_name = rel_path.substr(0, pos);
+    file_name = rel_path.substr(pos + 1);
+    return true;
+}
+
+//段中的文件在索引中的元数据, 序号在压缩搬移后不变, 用来生成ETag
+FileMeta segment_meta(const SegmentRecord& r, size_t root)
+{
+    FileMeta meta;
+    meta.size = r.size;
+    meta.mtime = r.mtime;
+    meta.etag = make_file_etag(r.seq, r.size, static_cast<int64_t>(r.mtime) * 1000000000LL);
+    meta.root = root;
+    meta.segment = r.segment;
+    meta.offset = r.offset;
+    return meta;
+}
+
+SegmentRecord segment_record(const string& rel_path, const FileMeta& meta)
+{
+    SegmentRecord r;
+    r.rel_path = rel_path;
+    r.segment = meta.segment;
+    r.offset = meta.offset;
+    r.size = meta.size;
+    r.mtime = meta.mtime;
+    return r;
+}
+
 FileTransportServer::FileTransportServer(string listen_address, int listen_port, const string& root_dir) :
     m_pool(IoContextPool::get_instance()),
     m_accept(m_pool.get_io_context(), tcp::endpoint(boost::asio::ip::address::from_string(listen_address), listen_port)),
-    m_doc_root(root_dir)
+    m_storage(std::make_shared<Storage>(g_cfg->storage_roots.empty() ? vector<string>{root_dir} : g_cfg->storage_roots,
+                                        g_cfg->storage_io_threads, g_cfg->storage_max_fill))
 {
+    if(!g_cfg->replica_peers.empty())
+    {
+        m_replicator = std::make_shared<Replicator>(g_cfg->replica_peers, g_cfg->replica_ack, g_cfg->replica_timeout);
+    }
+    if(!g_cfg->cluster_file.empty())
+    {
+        m_cluster = std::make_shared<Cluster>(g_cfg->cluster_file, g_cfg->cluster_self, g_cfg->tls_enable);
+        //成员不确定时不能决定文件放在哪个节点
+        if(!m_cluster->load())
+            throw std::runtime_error("load cluster member file failed");
+    }
+    if(!g_cfg->origin_url.empty())
+    {
+        m_origin = std::make_shared<Origin>(g_cfg->origin_url, g_cfg->origin_timeout);
+        if(!m_origin->valid())
+            throw std::runtime_error("invalid origin url");
+    }
 }
 
 
@@ -79,316 +206,2256 @@ FileTransportServer::~FileTransportServer()
 
 }
 
-void FileTransportServer::session(SocketPtr socket)
+void FileTransportServer::resetParser(SessionState& st)
+{
+    //上一个请求的解析器析构后才能释放分配区
+    st.parser.reset();
+    st.arena.release();
+    st.parser.emplace(std::piecewise_construct, std::make_tuple(), std::make_tuple(RequestAllocator(&st.arena)));
+    st.parser->body_limit(m_body_limit);
+}
+
+bool FileTransportServer::serveRequest(const ConnectionPtr& socket, SessionState& st)
 {
     bool close = false;
     boost::system::error_code ec;
 
-    // This buffer is required to persist across reads
-    boost::beast::multi_buffer buffer;
-
     // This lambda is used to send messages
-    send_lambda<tcp::socket> send{*socket, close, ec};
+    send_lambda<Connection> send{*socket, close, ec};
+
+    try
+    {
+        RequestParser& p = *st.parser;
+        bool detached = false;
+        handleRequest(socket, p, st.buffer, send, close, detached);
+        if(detached)
+        {
+            //连接已交给 DownTask 发送
+            return false;
+        }
+        if(ec)
+        {
+            LogErrorExt << ec.message();
+            return false;
+        }
+        //body没有读完时无法找到下一个请求的开始
+        if(!p.is_done())
+        {
+            close = true;
+        }
+        if(!close)
+        {
+            return true;
+        }
+
+        // This means we should close the connection, usually because
+        // the response indicated the "Connection: close" semantic.
+        // Send a TCP shutdown
+        socket->shutdown(tcp::socket::shutdown_send, ec);
+    }
+    catch(std::exception& e)
+    {
+        LogErrorExt << e.what();
+    }
+    return false;
+}
+
+bool FileTransportServer::handshake(Connection& conn)
+{
+    boost::system::error_code ec;
+    if(!m_tls->handshake(conn, ec))
+    {
+        LogErrorExt << "tls handshake failed," << ec.message();
+        return false;
+    }
+    return true;
+}
 
+#ifdef FTS_AWAITABLE
+boost::asio::awaitable<void> FileTransportServer::session(ConnectionPtr socket)
+{
     try
     {
+        if(m_tls)
+        {
+            bool ok = false;
+            co_await async_run_fiber([&]() { ok = handshake(*socket); }, boost::asio::use_awaitable);
+            if(!ok)
+                co_return;
+        }
+        SessionState st;
         for(;;)
         {
             // Read a request
-            http::request_parser<http::buffer_body> p;
-            p.body_limit(m_body_limit);
-            http::async_read_header(*socket, buffer, p, boost::fibers::asio::yield[ec]);
+            resetParser(st);
+            boost::system::error_code ec;
+            co_await http::async_read_header(*socket, st.buffer, *st.parser,
+                                             boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            //用户态TLS时对方没有发送 close_notify 就关闭连接得到 stream_truncated
+            if(ec == http::error::end_of_stream || ec == boost::asio::ssl::error::stream_truncated)
+            {
+                //keep-alive 连接由对方关闭
+                socket->shutdown(tcp::socket::shutdown_send, ec);
+                co_return;
+            }
             if(ec)
             {
                 LogErrorExt << ec.message();
+                co_return;
+            }
+            bool keep = false;
+            co_await async_run_fiber([&]() { keep = serveRequest(socket, st); }, boost::asio::use_awaitable);
+            if(!keep)
+                co_return;
+        }
+    }
+    catch(std::exception& e)
+    {
+        LogErrorExt << e.what();
+    }
+}
+#else
+void FileTransportServer::session(ConnectionPtr socket)
+{
+    try
+    {
+        if(m_tls && !handshake(*socket))
+            return;
+        SessionState st;
+        for(;;)
+        {
+            // Read a request
+            resetParser(st);
+            boost::system::error_code ec;
+            http::async_read_header(*socket, st.buffer, *st.parser, boost::fibers::asio::yield[ec]);
+            //用户态TLS时对方没有发送 close_notify 就关闭连接得到 stream_truncated
+            if(ec == http::error::end_of_stream || ec == boost::asio::ssl::error::stream_truncated)
+            {
+                //keep-alive 连接由对方关闭
+                socket->shutdown(tcp::socket::shutdown_send, ec);
                 return;
             }
-            auto& req = p.get();
-
-            // Returns a bad request response
-            auto const bad_request =
-                    [&req](boost::beast::string_view why)
+            if(ec)
             {
-                http::response<http::string_body> res{http::status::bad_request, req.version()};
-                res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-                res.set(http::field::content_type, "text/html");
-                res.keep_alive(req.keep_alive());
-                res.body() = why.to_string();
-                res.prepare_payload();
-                return res;
-            };
+                LogErrorExt << ec.message();
+                return;
+            }
+            if(!serveRequest(socket, st))
+                return;
+        }
+    }
+    catch(std::exception& e)
+    {
+        LogErrorExt << e.what();
+    }
+}
+#endif
 
-            // Returns a not found response
-            auto const not_found =
-                    [&req](boost::beast::string_view target)
-            {
-                http::response<http::string_body> res{http::status::not_found, req.version()};
-                res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-                res.set(http::field::content_type, "text/html");
-                res.keep_alive(req.keep_alive());
-                res.body() = "The resource '" + target.to_string() + "' was not found.";
-                res.prepare_payload();
-                return res;
-            };
+//把 res 改成 text/html 的错误应答, 保留已设置的其他头
+//body_done 为false时请求body没有读完, 找不到下一个请求的开始, 连接不能复用
+http::response<http::string_body> error_response(http::response<http::string_body>& res, http::status status,
+                                                 const string& why, bool body_done = true)
+{
+    res.result(status);
+    if(!body_done)
+        res.keep_alive(false);
+    res.set(http::field::content_type, "text/html");
+    res.body() = why;
+    res.prepare_payload();
+    return res;
+}
+
+//对 req 的新错误应答
+http::response<http::string_body> error_response(const Request& req, http::status status,
+                                                 const string& why, bool body_done = true)
+{
+    http::response<http::string_body> res{status, req.version()};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.keep_alive(req.keep_alive());
+    return error_response(res, status, why, body_done);
+}
+
+http::response<http::string_body> not_found_response(const Request& req)
+{
+    return error_response(req, http::status::not_found, "The resource '" + req.target().to_string() + "' was not found.");
+}
+
+http::response<http::empty_body> not_modified_response(const Request& req, const FileMeta& meta)
+{
+    http::response<http::empty_body> res{http::status::not_modified, req.version()};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.set(http::field::etag, meta.etag);
+    res.set(http::field::last_modified, kkurl::http_date(meta.mtime));
+    res.keep_alive(req.keep_alive());
+    return res;
+}
+
+void FileTransportServer::handleRequest(const ConnectionPtr& socket, RequestParser& p,
+                                        boost::beast::multi_buffer& buffer, send_lambda<Connection>& send,
+                                        bool& close, bool& detached)
+{
+    boost::system::error_code ec;
+    auto& req = p.get();
+
+    //客户端等待 100-continue 时,确认可以接收后再让其发送body
+    auto const send_continue =
+            [&req, &socket, &ec]()
+    {
+        if(!boost::beast::iequals(req[http::field::expect], "100-continue"))
+            return true;
+        http::response<http::empty_body> res{http::status::continue_, req.version()};
+        http::async_write(*socket, res, boost::fibers::asio::yield[ec]);
+        if(ec)
+        {
+            LogErrorExt << ec.message();
+            return false;
+        }
+        return true;
+    };
 
-            // Request path must be absolute and not contain "..".
-            if( req.target().empty() ||
-                    req.target()[0] != '/' ||
-                    req.target().find("..") != boost::beast::string_view::npos)
-                return send(bad_request("Illegal request-target"));
+    // Request path must be absolute and not contain "..".
+    if( req.target().empty() ||
+            req.target()[0] != '/' ||
+            req.target().find("..") != boost::beast::string_view::npos)
+        return send(error_response(req, http::status::bad_request, "Illegal request-target"));
 
-            string path;
-            string query_string;
-            if(!parseTarget(req.target(), path, query_string))
+    boost::beast::string_view path;
+    boost::beast::string_view query_string;
+    kkurl::parse_target(req.target(), path, query_string);
+
+    RouteMatch sm_res{RouteMatch::allocator_type(req.get_allocator().resource())};
+    bool dir_target = false;
+    if(!boost::regex_match(path.begin(), path.end(), sm_res, m_target_file_regex))
+    {
+        if(!boost::regex_match(path.begin(), path.end(), sm_res, m_target_dir_regex))
+        {
+            LogErrorExt << "regex_match error,target:" << req.target();
+            return send(error_response(req, http::status::bad_request, "Illegal request-target"));
+        }
+        dir_target = true;
+    }
+    TransportContext cxt;
+    cxt.socket = socket;
+    cxt.query_params.parse(query_string);
+    cxt.dir_name = sm_res[1];
+    if(!dir_target)
+    {
+        cxt.file_name = sm_res[2];
+        cxt.rel_path = cxt.dir_name + "/" + cxt.file_name;
+    }
+    //集群中归属其他节点的文件, 重定向或转发过去
+    if(!dir_target && m_cluster && req[FORWARDED_HEADER].empty() && req[REPLICA_HEADER].empty())
+    {
+        ClusterNodePtr node = m_cluster->owner(cxt.rel_path);
+        if(node && g_cfg->cluster_mode == CLUSTER_MODE::REDIRECT)
+        {
+            LogDebug << "redirect," << req.target() << "," << node->address;
+            http::response<http::empty_body> res{http::status::temporary_redirect, req.version()};
+            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+            res.set(http::field::location, node->url + req.target().to_string());
+            res.keep_alive(req.keep_alive());
+            res.prepare_payload();
+            return send(std::move(res));
+        }
+        if(node)
+        {
+            LogDebug << "proxy," << req.target() << "," << node->address;
+            if(!send_continue())
+                return;
+            if(!proxy_request(*socket, p, buffer, *node, close))
             {
-                LogErrorExt << "parse target error,target:" << req.target().data();
-                return send(bad_request("Parse target failed"));
+                return send(error_response(req, http::status::bad_gateway, "cluster node unavailable"));
             }
-
-            boost::smatch sm_res;
-            if(!boost::regex_match(path, sm_res, m_target_file_regex))
+            return;
+        }
+    }
+    if(req.method() == http::verb::post && dir_target &&
+            (cxt.query_params.has("ingest") ||
+             boost::beast::iequals(req[http::field::content_type], "application/x-tar")))
+    {
+        LogDebug << "post tar," << req.target();
+        if(!send_continue())
+            return;
+        return send(recvTar(cxt, p, buffer));
+    }
+    if(req.method() == http::verb::post && MultipartParser::isMultipart(req[http::field::content_type]))
+    {
+        LogDebug << "post multipart," << req.target();
+        if(!send_continue())
+            return;
+        return send(recvMultipart(cxt, p, buffer));
+    }
+    if(req.method() == http::verb::post && dir_target && cxt.query_params.has("delete"))
+    {
+        LogDebug << "delete batch," << req.target();
+        if(!send_continue())
+            return;
+        return send(deleteBatch(cxt, p, buffer));
+    }
+    if(req.method() == http::verb::get && dir_target && cxt.query_params.has("list"))
+    {
+        LogDebug << "list," << req.target();
+        return send(listDirectory(cxt, req.version(), req.keep_alive()));
+    }
+    if(req.method() == http::verb::get && dir_target && cxt.query_params.has("archive"))
+    {
+        LogDebug << "get archive," << req.target();
+        ARCHIVE_FORMAT format;
+        if(!parse_archive_format(*cxt.query_params.find("archive"), format))
+            return send(error_response(req, http::status::bad_request, "Unsupported archive format"));
+        std::shared_ptr<ArchiveWriter> writer = makeArchive(cxt, format);
+        if(!writer)
+            return send(not_found_response(req));
+        http::response<http::empty_body> res{http::status::ok, req.version()};
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        res.set(http::field::content_type, writer->contentType());
+        res.set(http::field::content_disposition,
+                "attachment; filename=\"" + cxt.dir_name + writer->extension() + "\"");
+        res.content_length(writer->contentLength());
+        res.keep_alive(req.keep_alive());
+        http::response_serializer<http::empty_body> sr{res};
+        http::async_write_header(*socket, sr, boost::fibers::asio::yield[ec]);
+        //文件内容直接从页缓存发到socket
+        if(ec || !writer->write(*socket, ec))
+        {
+            LogErrorExt << ec.message();
+            close = true;
+        }
+        return;
+    }
+    if(dir_target)
+    {
+        return send(error_response(req, http::status::bad_request, "Illegal request-target"));
+    }
+    if(req.method() == http::verb::post && cxt.query_params.has("uploads"))
+    {
+        LogDebug << "init parallel upload," << req.target();
+        return send(initParallelUpload(cxt, req));
+    }
+    if(cxt.query_params.has("uploadId"))
+    {
+        if(req.method() == http::verb::put)
+        {
+            if(!send_continue())
+                return;
+            return send(recvPart(cxt, p, buffer));
+        }
+        if(req.method() == http::verb::post || req.method() == http::verb::delete_)
+        {
+            LogDebug << "finish parallel upload," << req.target();
+            return send(finishParallelUpload(cxt, req, req.method() == http::verb::post));
+        }
+        return send(error_response(req, http::status::bad_request, "not support method"));
+    }
+    if(req.method() == http::verb::get)
+    {
+        LogDebug <<"get," << req.target();
+        boost::beast::error_code ec;
+        http::file_body::value_type body;
+        FileMeta meta;
+        CONTENT_ENCODING encoding = CONTENT_ENCODING::IDENTITY;
+        if(m_index.find(cxt.dir_name, cxt.file_name, meta))
+        {
+            string identity_etag = meta.etag;
+            encoding = choose_encoding(req[http::field::accept_encoding], meta.encodings);
+            meta.etag = variant_etag(meta.etag, encoding);
+            //缓存仍然有效, 只回应答头, 不打开文件
+            if(not_modified(req, meta))
             {
-                LogErrorExt << "regex_match error,target:" << req.target().data();
-                return send(bad_request("Illegal request-target"));
+                return send(not_modified_response(req, meta));
             }
-            TransportContext cxt;
-            cxt.socket = socket;
-            cxt.query_params = parseQueryString(query_string);
-            cxt.path_params = sm_res;
-            cxt.file_dir = m_doc_root + sm_res[1];
-            cxt.file_path = cxt.file_dir + "/" + sm_res[2];
-            if(req.method() == http::verb::get)
+            setFileRoot(cxt, m_storage->roots()[meta.root]);
+            if(meta.segment != 0)
             {
-                LogDebug <<"get," << req.target();
-                boost::beast::error_code ec;
-                http::file_body::value_type body;
-                body.open(cxt.file_path.c_str(), boost::beast::file_mode::scan, ec);
-                //本地文件不存在
-                if(ec == boost::system::errc::no_such_file_or_directory)
+                //打包存储的文件: 从段文件中的偏移处 sendfile
+                SegmentFilePtr seg = findSegment(cxt, meta);
+                if(!seg)
+                    return send(not_found_response(req));
+                http::response<http::empty_body> res{http::status::ok, req.version()};
+                res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+                res.set(http::field::content_type, mime_type(cxt.rel_path));
+                res.set(http::field::etag, meta.etag);
+                res.set(http::field::last_modified, kkurl::http_date(meta.mtime));
+                res.content_length(meta.size);
+                res.keep_alive(req.keep_alive());
+                http::response_serializer<http::empty_body> sr{res};
+                http::async_write_header(*socket, sr, boost::fibers::asio::yield[ec]);
+                if(ec || !send_file(*socket, seg->fd, meta.offset, meta.size, ec))
                 {
-                    UploadTaskPtr upload_task;
-                    {
-                        std::lock_guard<boost::fibers::mutex> lk(m_mutex);
-                        auto it = m_upload_tasks.find(cxt.file_path);
-                        if(it != m_upload_tasks.end())
-                        {
-                            upload_task = it->second;
-                        }
-                    }
-                    if(!upload_task)
-                        return send(not_found(req.target()));
-
-                    cxt.file_size = upload_task->getFileSize();
-                    DownTaskPtr down_task = std::make_shared<DownTask>(cxt);
-                    upload_task->addDownTask(down_task);
+                    LogErrorExt << ec.message();
+                    close = true;
                 }
                 else
                 {
-                    //本地文件存在
-                    http::response<http::file_body> res
-                    {
-                        std::piecewise_construct,
-                                std::make_tuple(std::move(body)),
-                                std::make_tuple(http::status::ok, req.version())
-                    };
-                    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-                    res.set(http::field::content_type, mime_type(cxt.file_path));
-                    res.content_length(body.size());
-                    res.keep_alive(req.keep_alive());
-                    return send(std::move(res));
+                    close = res.need_eof();
                 }
+                return;
             }
-            else if(req.method() == http::verb::post)
+            if(encoding == CONTENT_ENCODING::IDENTITY)
             {
-                auto it_clen = req.find("Content-Length");
-                if(it_clen == req.end())
-                {
-                    LogErrorExt << "not has Content-Length, file:" << cxt.file_path;
-                    return;
-                }
-                cxt.file_size = std::stoi((*it_clen).value().data());
-                if(cxt.file_size == 0)
-                {
-                    LogErrorExt << "file size is 0";
-                    return;
-                }
-                UploadTaskPtr upload_task;
+                body.open(cxt.file_path.c_str(), boost::beast::file_mode::scan, ec);
+            }
+            else
+            {
+                //预压缩的文件与原文件走同样的发送路径
+                string variant = variant_path(cxt.file_dir, cxt.file_name, encoding);
+                body.open(variant.c_str(), boost::beast::file_mode::scan, ec);
+                if(ec == boost::system::errc::no_such_file_or_directory)
                 {
-                    std::lock_guard<boost::fibers::mutex> lk(m_mutex);
-                    auto it = m_upload_tasks.find(cxt.file_path);
-                    if(it != m_upload_tasks.end())
+                    //预压缩文件被删除, 原文件还在: 去掉索引中的记录, 发送原文件, 不能当作本地没有而404或回源
+                    LogWarnExt << "variant missing, send identity," << variant;
+                    m_index.dropVariant(cxt.dir_name, cxt.file_name, identity_etag, encoding);
+                    meta.encodings &= ~(1u << static_cast<int>(encoding));
+                    encoding = CONTENT_ENCODING::IDENTITY;
+                    meta.etag = identity_etag;
+                    if(not_modified(req, meta))
                     {
-                        it->second->stop(STOP_REASEON::ERROR);
-                        m_upload_tasks.erase(it);
+                        return send(not_modified_response(req, meta));
                     }
-                    upload_task = std::make_shared<UploadTask>(cxt);
-                    m_upload_tasks[cxt.file_path] = upload_task;
+                    ec = {};
+                    body.open(cxt.file_path.c_str(), boost::beast::file_mode::scan, ec);
                 }
-
-                upload_task->start();
-                int recv_size = 0;
-                while(!p.is_done())
+            }
+        }
+        else
+        {
+            ec = boost::system::errc::make_error_code(boost::system::errc::no_such_file_or_directory);
+        }
+        //本地文件不存在
+        if(ec == boost::system::errc::no_such_file_or_directory)
+        {
+            UploadTaskPtr upload_task;
+            {
+                std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+                auto it = m_upload_tasks.find(cxt.rel_path);
+                if(it != m_upload_tasks.end())
                 {
-                    char buf[1024];
-                    p.get().body().data = buf;
-                    p.get().body().size = sizeof(buf);
-                    http::async_read(*socket, buffer, p, boost::fibers::asio::yield[ec]);
-                    if(ec == http::error::need_buffer)
-                    {
-                        ec.assign(0, ec.category());
-                    }
-                    if(ec)
-                    {
-                        LogErrorExt << ec.message();
-                        upload_task->stop(STOP_REASEON::ERROR);
-
-                        std::lock_guard<boost::fibers::mutex> lk(m_mutex);
-                        m_upload_tasks.erase(cxt.file_path);
-                        return;
-                    }
-                    recv_size += (sizeof(buf) - p.get().body().size);
-                    string recv_buf(buf, sizeof(buf) - p.get().body().size);
-                    upload_task->recv(std::move(recv_buf));
+                    upload_task = it->second;
                 }
-                if(recv_size != cxt.file_size)
+            }
+            //同一路径同时只回源一次, 其他请求等待源站应答后共享数据
+            if(!upload_task && m_origin)
+            {
+                http::status status = http::status::not_found;
+                upload_task = pullOrigin(cxt, status);
+                if(!upload_task && status != http::status::not_found)
                 {
-                    LogErrorExt << "recv size not eq upload-size," << recv_size << "," << cxt.file_size;
-                    upload_task->stop(STOP_REASEON::ERROR);
-
-                    {
-                        std::lock_guard<boost::fibers::mutex> lk(m_mutex);
-                        m_upload_tasks.erase(cxt.file_path);
-                    }
-                    return send(bad_request("recv size not eq content-length"));
+                    return send(error_response(req, status, "origin pull failed"));
                 }
-                else
-                {
-                    LogErrorExt << "recv file success," << cxt.file_path;
-                    upload_task->stop(STOP_REASEON::NORMAL);
+            }
+            if(!upload_task || !upload_task->waitReady())
+                return send(not_found_response(req));
+            DownJoin join;
+            if(!parse_down_join(cxt.query_params, join))
+                return send(error_response(req, http::status::bad_request, "Invalid join position"));
 
-                    {
-                        std::lock_guard<boost::fibers::mutex> lk(m_mutex);
-                        m_upload_tasks.erase(cxt.file_path);
-                    }
-                    http::response<http::empty_body> res{http::status::ok, req.version()};
-                    return send(std::move(res));;
-                }
+            cxt.file_size = upload_task->getFileSize();
+            DownTaskPtr down_task = std::make_shared<DownTask>(cxt);
+            int64_t start_offset = upload_task->addDownTask(down_task, join);
+            LogDebug << "join live download," << start_offset << "," << cxt.rel_path;
+            detached = true;
+        }
+        else
+        {
+            //本地文件存在
+            http::response<http::file_body> res
+            {
+                std::piecewise_construct,
+                        std::make_tuple(std::move(body)),
+                        std::make_tuple(http::status::ok, req.version())
+            };
+            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+            res.set(http::field::content_type, mime_type(cxt.file_path));
+            res.set(http::field::etag, meta.etag);
+            res.set(http::field::last_modified, kkurl::http_date(meta.mtime));
+            if(encoding != CONTENT_ENCODING::IDENTITY)
+            {
+                res.set(http::field::content_encoding, encoding_name(encoding));
             }
-            else
+            else if(!meta.digest.empty())
             {
-                return send(bad_request("not support method"));;
+                res.set(http::field::digest, meta.digest);
             }
-            if(close)
+            if(meta.encodings)
             {
-                // This means we should close the connection, usually because
-                // the response indicated the "Connection: close" semantic.
-                break;
+                res.set(http::field::vary, "Accept-Encoding");
             }
+            res.content_length(body.size());
+            res.keep_alive(req.keep_alive());
+            return send(std::move(res));
         }
-
-        // Send a TCP shutdown
-        socket->shutdown(tcp::socket::shutdown_send, ec);
-    }
-    catch(std::exception& e)
-    {
-        LogErrorExt << e.what();
     }
-}
-
-void FileTransportServer::accept()
-{
-    try
+    else if(req.method() == http::verb::head)
     {
-        for (;;)
+        //只查索引与上传中的任务, 不访问磁盘
+        http::response<http::empty_body> res{http::status::ok, req.version()};
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        res.keep_alive(req.keep_alive());
+        if(cxt.query_params.has("upload"))
         {
-            SocketPtr socket(new tcp::socket(m_pool.get_io_context()));
-            boost::system::error_code ec;
-            m_accept.async_accept(
-                        *socket,
-                        boost::fibers::asio::yield[ec]);
-            if (ec)
+            //续传位置
+            JournalEntry entry;
+            bool found = false;
             {
-                throw boost::system::system_error(ec); //some other error
+                std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+                auto it = m_resumable.find(cxt.rel_path);
+                if(it != m_resumable.end())
+                {
+                    entry = it->second;
+                    found = true;
+                }
+            }
+            if(!found)
+            {
+                res.result(http::status::not_found);
             }
             else
             {
-                boost::asio::post(socket->get_executor(), [socket, this](){
-                    boost::fibers::fiber([socket, this]() {
-                        try
-                        {
-                            this->session(socket);
-                        }
-                        catch (std::exception const &e)
-                        {
-                            LogErrorExt << e.what();
-                        }
-                    }).detach();
-                });
+                res.set("Upload-Offset", std::to_string(entry.offset));
+                res.set("Upload-Length", std::to_string(entry.size));
             }
+            res.content_length(0);
+            return send(std::move(res));
         }
-    }
-    catch (std::exception const &e)
-    {
-        LogErrorExt << e.what();
-    }
-    //m_pool->stop();
-}
-
-void FileTransportServer::start()
-{
-    boost::fibers::fiber([this](){
-        this->accept();
-    }).detach();
+        FileMeta meta;
+        if(m_index.find(cxt.dir_name, cxt.file_name, meta))
+        {
+            CONTENT_ENCODING encoding = choose_encoding(req[http::field::accept_encoding], meta.encodings);
+            meta.etag = variant_etag(meta.etag, encoding);
+            if(not_modified(req, meta))
+            {
+                return send(not_modified_response(req, meta));
+            }
+            res.set(http::field::content_type, mime_type(cxt.rel_path));
+            res.set(http::field::etag, meta.etag);
+            res.set(http::field::last_modified, kkurl::http_date(meta.mtime));
+            if(encoding != CONTENT_ENCODING::IDENTITY)
+            {
+                res.set(http::field::content_encoding, encoding_name(encoding));
+            }
+            if(meta.encodings)
+            {
+                res.set(http::field::vary, "Accept-Encoding");
+            }
+            res.content_length(encoding == CONTENT_ENCODING::IDENTITY ? meta.size :
+                                                                       meta.encoded_size[static_cast<int>(encoding)]);
+            return send(std::move(res));
+        }
+        UploadTaskPtr upload_task;
+        {
+            std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+            auto it = m_upload_tasks.find(cxt.rel_path);
+            if(it != m_upload_tasks.end())
+            {
+                upload_task = it->second;
+            }
+        }
+        if(upload_task && upload_task->waitReady())
+        {
+            res.set(http::field::content_type, mime_type(cxt.rel_path));
+            if(upload_task->getFileSize() >= 0)
+            {
+                res.content_length(upload_task->getFileSize());
+            }
+            return send(std::move(res));
+        }
+        res.result(http::status::not_found);
+        res.content_length(0);
+        return send(std::move(res));
+    }
+    else if(req.method() == http::verb::post)
+    {
+        //chunked 上传(如复制对端转发的multipart part)大小未知
+        if(p.content_length())
+        {
+            cxt.file_size = static_cast<int64_t>(*p.content_length());
+        }
+        else if(p.chunked())
+        {
+            cxt.file_size = -1;
+        }
+        else
+        {
+            LogErrorExt << "not has Content-Length, file:" << cxt.rel_path;
+            return send(error_response(req, http::status::length_required, "Content-Length required", false));
+        }
+        //续传, body 为 offset 之后的部分
+        int64_t resume_offset = 0;
+        boost::optional<boost::beast::string_view> offset_param = cxt.query_params.find("offset");
+        if(offset_param)
+        {
+            string str_offset = offset_param->to_string();
+            char* end = nullptr;
+            resume_offset = strtoll(str_offset.c_str(), &end, 10);
+            if(str_offset.empty() || *end != '\0' || resume_offset < 0)
+                return send(error_response(req, http::status::bad_request, "Invalid offset"));
+            JournalEntry entry;
+            bool found = false;
+            {
+                std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+                auto it = m_resumable.find(cxt.rel_path);
+                if(it != m_resumable.end())
+                {
+                    entry = it->second;
+                    found = true;
+                    if(entry.offset == resume_offset && entry.size - entry.offset == cxt.file_size)
+                        m_resumable.erase(it);
+                }
+            }
+            if(!found)
+                return send(not_found_response(req));
+            if(entry.offset != resume_offset || entry.size - entry.offset != cxt.file_size)
+            {
+                LogErrorExt << "resume offset mismatch," << resume_offset << "," << entry.offset << "," << cxt.rel_path;
+                http::response<http::string_body> res = error_response(req, http::status::conflict,
+                                                                        "Upload offset mismatch", false);
+                res.set("Upload-Offset", std::to_string(entry.offset));
+                res.set("Upload-Length", std::to_string(entry.size));
+                return send(std::move(res));
+            }
+            setFileRoot(cxt, m_storage->roots()[entry.root]);
+            cxt.file_size = entry.size;
+        }
+        else if(cxt.file_size == 0)
+        {
+            LogErrorExt << "file size is 0";
+            return send(error_response(req, http::status::bad_request, "Empty file"));
+        }
+        else if(!m_segments.empty() && cxt.file_size > 0 && cxt.file_size <= g_cfg->segment_threshold &&
+                (!m_replicator || !req[REPLICA_HEADER].empty()))
+        {
+            //小文件打包存储, 需要复制到对端的上传仍走独立文件
+            LogDebug << "post small file," << req.target();
+            if(!send_continue())
+                return;
+            return send(recvSmallFile(cxt, p, buffer));
+        }
+        else if(!prepareUpload(cxt))
+        {
+            return send(error_response(req, http::status::insufficient_storage, "Insufficient storage", false));
+        }
+        UploadTaskPtr upload_task = registerUpload(cxt);
+        if(m_journal)
+        {
+            upload_task->setJournal(m_journal);
+            upload_task->setResumeOffset(resume_offset);
+        }
+
+        if(!upload_task->initDigest(req))
+        {
+            unregisterUpload(cxt.rel_path, upload_task);
+            return send(error_response(req, http::status::bad_request, "Invalid checksum header"));
+        }
+        BSError start_ec;
+        if(!upload_task->start(start_ec))
+        {
+            unregisterUpload(cxt.rel_path, upload_task);
+            if(start_ec == boost::system::errc::no_space_on_device)
+            {
+                return send(error_response(req, http::status::insufficient_storage, "Insufficient storage", false));
+            }
+            return send(error_response(req, http::status::internal_server_error, "create upload file failed"));
+        }
+        startReplication(cxt, upload_task, req);
+
+        if(!send_continue())
+        {
+            upload_task->stop(STOP_REASEON::ERROR);
+            unregisterUpload(cxt.rel_path, upload_task);
+            return;
+        }
+        int64_t recv_size = 0;
+        //块足够大时校验才会交给计算线程池
+        std::vector<char> buf(64 * 1024);
+        while(!p.is_done())
+        {
+            p.get().body().data = buf.data();
+            p.get().body().size = buf.size();
+            http::async_read(*socket, buffer, p, boost::fibers::asio::yield[ec]);
+            if(ec == http::error::need_buffer)
+            {
+                ec.assign(0, ec.category());
+            }
+            if(ec)
+            {
+                LogErrorExt << ec.message();
+                //已接收的数据保留, 客户端之后可以续传
+                JournalEntry entry;
+                if(upload_task->suspend(entry))
+                {
+                    LogInfo << "upload suspended," << entry.offset << "," << cxt.rel_path;
+                    std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+                    m_resumable[cxt.rel_path] = entry;
+                }
+                unregisterUpload(cxt.rel_path, upload_task);
+                close = true;
+                return;
+            }
+            //被删除或被新的上传替换
+            if(upload_task->cancelled())
+            {
+                LogInfo << "upload cancelled," << cxt.rel_path;
+                return send(error_response(req, http::status::conflict, "upload cancelled", false));
+            }
+            size_t size = buf.size() - p.get().body().size;
+            if(size == 0)
+                continue;
+            recv_size += size;
+            string recv_buf(buf.data(), size);
+            upload_task->recv(std::move(recv_buf));
+        }
+        if(cxt.file_size >= 0 && recv_size != cxt.file_size - resume_offset)
+        {
+            LogErrorExt << "recv size not eq upload-size," << recv_size << "," << cxt.file_size;
+            upload_task->stop(STOP_REASEON::ERROR);
+
+            unregisterUpload(cxt.rel_path, upload_task);
+            return send(error_response(req, http::status::bad_request, "recv size not eq content-length"));
+        }
+        else
+        {
+            LogErrorExt << "recv file success," << cxt.file_path;
+            bool stored = upload_task->stop(STOP_REASEON::NORMAL);
+            //先加入索引再移除任务, 中间到达的GET不会找不到文件而404或回源
+            if(stored)
+            {
+                putIndex(cxt.dir_name, cxt.file_name, upload_task->getFileMeta());
+            }
+            unregisterUpload(cxt.rel_path, upload_task);
+            if(!stored && upload_task->cancelled())
+            {
+                //提交前被删除或被替换, 不能动索引中新的文件
+                return send(error_response(req, http::status::conflict, "upload cancelled", false));
+            }
+            if(!stored)
+            {
+                eraseIndex(cxt.dir_name, cxt.file_name);
+                if(upload_task->digestMismatch())
+                {
+                    return send(error_response(req, http::status::bad_request, "Checksum mismatch"));
+                }
+                return send(error_response(req, http::status::internal_server_error, "store file failed"));
+            }
+            compressAsync(cxt, upload_task->getFileMeta());
+            if(!upload_task->replicated())
+            {
+                //本地已保存, 客户端可以重试
+                return send(error_response(req, http::status::service_unavailable,
+                                           "replication not acknowledged"));
+            }
+            http::response<http::empty_body> res{http::status::ok, req.version()};
+            res.keep_alive(req.keep_alive());
+            return send(std::move(res));
+        }
+    }
+    else if(req.method() == http::verb::delete_)
+    {
+        LogDebug << "delete," << req.target();
+        http::response<http::empty_body> res{http::status::no_content, req.version()};
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        res.keep_alive(req.keep_alive());
+        if(!removeFile(cxt.dir_name, cxt.file_name))
+        {
+            return send(not_found_response(req));
+        }
+        return send(std::move(res));
+    }
+    else
+    {
+        return send(error_response(req, http::status::bad_request, "not support method"));;
+    }
+}
+
+#ifdef FTS_AWAITABLE
+boost::asio::awaitable<void> FileTransportServer::accept()
+{
+    try
+    {
+        for (;;)
+        {
+            ConnectionPtr socket(new Connection(m_pool.get_io_context()));
+            //出错时抛出异常
+            co_await m_accept.async_accept(socket->socket(), boost::asio::use_awaitable);
+            boost::asio::co_spawn(socket->get_executor(), [socket, this]() {
+                return this->session(socket);
+            }, boost::asio::detached);
+        }
+    }
+    catch (std::exception const &e)
+    {
+        LogErrorExt << e.what();
+    }
+}
+#else
+void FileTransportServer::accept()
+{
+    try
+    {
+        for (;;)
+        {
+            ConnectionPtr socket(new Connection(m_pool.get_io_context()));
+            boost::system::error_code ec;
+            m_accept.async_accept(
+                        socket->socket(),
+                        boost::fibers::asio::yield[ec]);
+            if (ec)
+            {
+                throw boost::system::system_error(ec); //some other error
+            }
+            else
+            {
+                boost::asio::post(socket->get_executor(), [socket, this](){
+                    make_fiber([socket, this]() {
+                        this->session(socket);
+                    }).detach();
+                });
+            }
+        }
+    }
+    catch (std::exception const &e)
+    {
+        LogErrorExt << e.what();
+    }
+    //m_pool->stop();
+}
+#endif
+
+void FileTransportServer::enableTls(const string& cert_file, const string& key_file, long session_timeout,
+                                    int handshake_timeout)
+{
+    m_tls = std::make_shared<TlsContext>(cert_file, key_file, session_timeout, handshake_timeout);
+}
+
+void FileTransportServer::setFileRoot(TransportContext& cxt, const StorageRootPtr& root)
+{
+    cxt.root = root;
+    cxt.file_dir = root->fullPath(cxt.dir_name);
+    cxt.file_path = root->fullPath(cxt.rel_path);
+}
+
+bool FileTransportServer::prepareUpload(TransportContext& cxt)
+{
+    StorageRootPtr root = m_storage->place(cxt.rel_path);
+    if(!root)
+    {
+        LogErrorExt << "no storage root available," << cxt.rel_path;
+        return false;
+    }
+    setFileRoot(cxt, root);
+    //盘水位变化后同一路径可能放到另一块盘上, 删除旧位置的文件
+    FileMeta old_meta;
+    if(m_index.find(cxt.dir_name, cxt.file_name, old_meta) && old_meta.root != root->index())
+    {
+        //旧盘上的文件与预压缩文件在旧盘的IO线程上移到 .trash, 段中的文件由 eraseIndex 写删除记录
+        if(old_meta.segment == 0)
+        {
+            trashFile(cxt.dir_name, cxt.file_name, old_meta);
+        }
+        eraseIndex(cxt.dir_name, cxt.file_name);
+    }
+    return true;
+}
+
+UploadTaskPtr FileTransportServer::registerUpload(const TransportContext& cxt)
+{
+    UploadTaskPtr upload_task = std::make_shared<UploadTask>(cxt);
+    std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+    //新的上传覆盖等待续传的临时文件
+    if(m_resumable.erase(cxt.rel_path) && m_journal)
+    {
+        m_journal->remove(cxt.rel_path);
+    }
+    auto it = m_upload_tasks.find(cxt.rel_path);
+    if(it != m_upload_tasks.end())
+    {
+        it->second->cancel();
+    }
+    m_upload_tasks[cxt.rel_path] = upload_task;
+    return upload_task;
+}
+
+void FileTransportServer::startReplication(const TransportContext& cxt, const UploadTaskPtr& task, const RequestFields& headers)
+{
+    //对端转发来的复制请求不再复制
+    if(!m_replicator || !headers[REPLICA_HEADER].empty())
+        return;
+    IoContext& ioc = static_cast<IoContext&>(cxt.socket->get_executor().context());
+    task->setReplicas(m_replicator->open(ioc, cxt.rel_path, cxt.file_size));
+}
+
+UploadTaskPtr FileTransportServer::pullOrigin(TransportContext& cxt, http::status& status)
+{
+    if(!prepareUpload(cxt))
+    {
+        status = http::status::insufficient_storage;
+        return nullptr;
+    }
+    cxt.file_size = -1;
+    //回源任务不属于任何一个客户端连接
+    TransportContext fill_cxt = cxt;
+    fill_cxt.socket.reset();
+    UploadTaskPtr task = std::make_shared<UploadTask>(fill_cxt);
+    task->setPending();
+    {
+        std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+        auto it = m_upload_tasks.find(cxt.rel_path);
+        if(it != m_upload_tasks.end())
+        {
+            //其他请求已经开始回源
+            return it->second;
+        }
+        m_upload_tasks[cxt.rel_path] = task;
+    }
+
+    IoContext& ioc = static_cast<IoContext&>(cxt.socket->get_executor().context());
+    BSError ec;
+    OriginFetchPtr fetch = m_origin->fetch(ioc, cxt.rel_path, ec);
+    if(!fetch || fetch->status() != http::status::ok)
+    {
+        if(!fetch)
+        {
+            status = http::status::bad_gateway;
+        }
+        else if(fetch->status() != http::status::not_found)
+        {
+            LogWarnExt << "origin response," << static_cast<unsigned>(fetch->status()) << "," << cxt.rel_path;
+            status = http::status::bad_gateway;
+        }
+        task->setReady(false);
+        unregisterUpload(cxt.rel_path, task);
+        return nullptr;
+    }
+
+    cxt.file_size = fetch->contentLength();
+    fill_cxt.file_size = cxt.file_size;
+    task->setFileSize(cxt.file_size);
+    BSError start_ec;
+    if(!task->start(start_ec) || task->cancelled())
+    {
+        if(start_ec == boost::system::errc::no_space_on_device)
+            status = http::status::insufficient_storage;
+        else if(!task->cancelled())
+            status = http::status::internal_server_error;
+        task->setReady(false);
+        unregisterUpload(cxt.rel_path, task);
+        return nullptr;
+    }
+    task->setReady(true);
+    LogInfo << "origin pull," << cxt.rel_path << "," << cxt.file_size;
+    //当前请求与其他等待的请求一样作为下载方加入, 客户端断开不影响回源
+    make_fiber([this, fill_cxt, task, fetch]() {
+        fillFromOrigin(fill_cxt, task, fetch);
+    }).detach();
+    return task;
+}
+
+void FileTransportServer::fillFromOrigin(const TransportContext& cxt, const UploadTaskPtr& task, const OriginFetchPtr& fetch)
+{
+    BSError ec;
+    int64_t recv_size = 0;
+    string buf;
+    while(fetch->read(buf, ec))
+    {
+        //被删除或被新的上传替换
+        if(task->cancelled())
+        {
+            LogInfo << "origin pull cancelled," << cxt.rel_path;
+            return;
+        }
+        if(buf.empty())
+            continue;
+        recv_size += buf.size();
+        task->recv(std::move(buf));
+    }
+    bool ok = !ec && (cxt.file_size < 0 || recv_size == cxt.file_size);
+    if(!ok)
+    {
+        LogErrorExt << "origin pull failed," << ec.message() << "," << recv_size << "," << cxt.file_size << "," << cxt.rel_path;
+    }
+    if(task->stop(ok ? STOP_REASEON::NORMAL : STOP_REASEON::ERROR))
+    {
+        //先加入索引再移除任务, 中间到达的请求不会再次回源
+        putIndex(cxt.dir_name, cxt.file_name, task->getFileMeta());
+        compressAsync(cxt, task->getFileMeta());
+    }
+    unregisterUpload(cxt.rel_path, task);
+}
+
+void FileTransportServer::unregisterUpload(const string& rel_path, const UploadTaskPtr& task)
+{
+    std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+    auto it = m_upload_tasks.find(rel_path);
+    if(it != m_upload_tasks.end() && it->second == task)
+    {
+        m_upload_tasks.erase(it);
+    }
+}
+
+http::response<http::string_body> FileTransportServer::recvMultipart(const TransportContext& cxt,
+                                                                     RequestParser& p,
+                                                                     boost::beast::multi_buffer& buffer)
+{
+    auto& req = p.get();
+    http::response<http::string_body> res{http::status::ok, req.version()};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    //只保留第一个错误, 回调中返回false停止解析
+    auto const fail = [&res](http::status s, const string& why)
+    {
+        if(res.result() == http::status::ok)
+            error_response(res, s, why, false);
+        return false;
+    };
+
+    MultipartParser parser;
+    if(!parser.init(req[http::field::content_type]))
+    {
+        fail(http::status::bad_request, "Invalid multipart boundary");
+    }
+
+    UploadTaskPtr upload_task;
+    //集群中归属其他节点的part转发过去
+    Cluster::MembershipPtr members = m_cluster ? m_cluster->membership() : nullptr;
+    IoContext& ioc = static_cast<IoContext&>(cxt.socket->get_executor().context());
+    ReplicaStreamPtr forward;
+    ClusterNodePtr forward_node;
+    TransportContext part_cxt;
+    vector<string> stored;
+    bool first_file = true;
+    parser.on_part_begin = [&](const MultipartParser::Part& part)
+    {
+        //普通表单字段不保存
+        if(part.filename.empty())
+            return true;
+        part_cxt = cxt;
+        if(first_file && !cxt.file_name.empty())
+        {
+            part_cxt.file_name = cxt.file_name;
+        }
+        else
+        {
+            //部分浏览器会带上客户端的完整路径
+            string name = part.filename;
+            size_t slash = name.find_last_of("/\\");
+            if(slash != string::npos)
+                name = name.substr(slash + 1);
+            if(!boost::regex_match(name, m_file_name_regex))
+            {
+                LogErrorExt << "illegal part filename," << part.filename;
+                return fail(http::status::bad_request, "Illegal file name");
+            }
+            part_cxt.file_name = name;
+        }
+        first_file = false;
+        part_cxt.rel_path = part_cxt.dir_name + "/" + part_cxt.file_name;
+        part_cxt.file_size = -1;
+        forward_node = members && forwardable_name(part_cxt.file_name) ? members->owner(part_cxt.rel_path) : nullptr;
+        if(forward_node)
+        {
+            forward = forward_upload(ioc, *forward_node, part_cxt.rel_path, -1);
+            return true;
+        }
+        if(!prepareUpload(part_cxt))
+        {
+            return fail(http::status::insufficient_storage, "Insufficient storage");
+        }
+        upload_task = registerUpload(part_cxt);
+        BSError start_ec;
+        if(!upload_task->start(start_ec))
+        {
+            unregisterUpload(part_cxt.rel_path, upload_task);
+            upload_task.reset();
+            if(start_ec == boost::system::errc::no_space_on_device)
+                return fail(http::status::insufficient_storage, "Insufficient storage");
+            return fail(http::status::internal_server_error, "create upload file failed");
+        }
+        startReplication(part_cxt, upload_task, req);
+        return true;
+    };
+    parser.on_part_data = [&](const char* data, size_t size)
+    {
+        if(forward)
+            forward->send(std::make_shared<string>(data, size));
+        if(upload_task)
+            upload_task->recv(string(data, size));
+        return true;
+    };
+    parser.on_part_end = [&]()
+    {
+        if(forward)
+        {
+            ReplicaStreamPtr stream = std::move(forward);
+            stream->finish(true);
+            if(!stream->result().get())
+            {
+                return fail(http::status::bad_gateway, "cluster node unavailable," + forward_node->address);
+            }
+            LogInfo << "forward part success," << part_cxt.rel_path << "," << forward_node->address;
+            stored.push_back(part_cxt.rel_path);
+            return true;
+        }
+        if(!upload_task)
+            return true;
+        UploadTaskPtr task = std::move(upload_task);
+        bool ok = task->stop(STOP_REASEON::NORMAL);
+        //先加入索引再移除任务
+        if(ok)
+        {
+            putIndex(part_cxt.dir_name, part_cxt.file_name, task->getFileMeta());
+        }
+        unregisterUpload(part_cxt.rel_path, task);
+        if(!ok && task->cancelled())
+        {
+            return fail(http::status::conflict, "upload cancelled");
+        }
+        if(!ok)
+        {
+            eraseIndex(part_cxt.dir_name, part_cxt.file_name);
+            return fail(http::status::internal_server_error, "store file failed");
+        }
+        LogInfo << "recv part success," << part_cxt.file_path;
+        compressAsync(part_cxt, task->getFileMeta());
+        stored.push_back(part_cxt.rel_path);
+        if(!task->replicated())
+        {
+            return fail(http::status::service_unavailable, "replication not acknowledged");
+        }
+        return true;
+    };
+
+    boost::system::error_code ec;
+    std::vector<char> buf(64 * 1024);
+    while(res.result() == http::status::ok && !p.is_done())
+    {
+        req.body().data = buf.data();
+        req.body().size = buf.size();
+        http::async_read(*cxt.socket, buffer, p, boost::fibers::asio::yield[ec]);
+        if(ec == http::error::need_buffer)
+        {
+            ec.assign(0, ec.category());
+        }
+        if(ec)
+        {
+            LogErrorExt << ec.message();
+            fail(http::status::bad_request, ec.message());
+            break;
+        }
+        if(!parser.feed(buf.data(), buf.size() - req.body().size))
+        {
+            fail(http::status::bad_request, "Malformed multipart body");
+        }
+    }
+    if(res.result() == http::status::ok && !parser.done())
+    {
+        fail(http::status::bad_request, "Incomplete multipart body");
+    }
+    //中途失败的part不提交
+    if(upload_task)
+    {
+        upload_task->stop(STOP_REASEON::ERROR);
+        unregisterUpload(part_cxt.rel_path, upload_task);
+    }
+    if(forward)
+    {
+        forward->finish(false);
+    }
+
+    if(res.result() != http::status::ok)
+    {
+        return res;
+    }
+    else
+    {
+        res.set(http::field::content_type, "application/json");
+        res.keep_alive(req.keep_alive());
+        string& body = res.body();
+        body = "{\"files\":[";
+        for(size_t i = 0; i < stored.size(); ++i)
+        {
+            if(i > 0)
+                body += ',';
+            body += '"';
+            kkurl::json_escape(stored[i], body);
+            body += '"';
+        }
+        body += "]}";
+    }
+    res.prepare_payload();
+    return res;
+}
+
+http::response<http::string_body> FileTransportServer::recvTar(const TransportContext& cxt,
+                                                               RequestParser& p,
+                                                               boost::beast::multi_buffer& buffer)
+{
+    auto& req = p.get();
+    http::response<http::string_body> res{http::status::ok, req.version()};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.keep_alive(false);
+
+    StorageRootPtr root = m_storage->place(cxt.dir_name);
+    if(!root)
+    {
+        LogErrorExt << "no storage root available," << cxt.dir_name;
+        res.result(http::status::insufficient_storage);
+        res.set(http::field::content_type, "text/html");
+        res.body() = "Insufficient storage";
+        res.prepare_payload();
+        return res;
+    }
+    TarIngest ingest(root, cxt.dir_name, m_file_name_regex);
+    //集群中归属其他节点的条目逐个转发过去, 转发失败记为该条目的错误
+    Cluster::MembershipPtr members = m_cluster ? m_cluster->membership() : nullptr;
+    IoContext& ioc = static_cast<IoContext&>(cxt.socket->get_executor().context());
+    struct Forward
+    {
+        ClusterNodePtr node;
+        ReplicaStreamPtr stream;
+        bool ended = false;
+        string error;
+    };
+    map<size_t, Forward> forwards;
+    if(members)
+    {
+        string dir_name = cxt.dir_name;
+        ingest.setLocalFilter([members, dir_name](const string& name) {
+            return !forwardable_name(name) || !members->owner(dir_name + "/" + name);
+        });
+    }
+    auto const drain_forward = [&]()
+    {
+        for(TarIngest::ForwardPiece& piece : ingest.forwardPieces())
+        {
+            Forward& f = forwards[piece.entry];
+            if(!f.stream)
+            {
+                const TarIngest::Entry& e = ingest.entries()[piece.entry];
+                string rel_path = cxt.dir_name + "/" + e.name;
+                f.node = members->owner(rel_path);
+                //归属节点不接受 Content-Length 为0的上传, 空文件用chunked
+                f.stream = forward_upload(ioc, *f.node, rel_path, e.meta.size > 0 ? e.meta.size : -1);
+            }
+            if(!piece.data.empty())
+                f.stream->send(std::make_shared<string>(std::move(piece.data)));
+            if(piece.end)
+            {
+                f.stream->finish(true);
+                f.ended = true;
+            }
+        }
+        ingest.forwardPieces().clear();
+    };
+    BSError open_ec;
+    if(!root->run([&]() { return ingest.open(open_ec); }))
+    {
+        res.result(http::status::internal_server_error);
+        res.set(http::field::content_type, "text/html");
+        res.body() = "create dir failed";
+        res.prepare_payload();
+        return res;
+    }
+
+    boost::system::error_code ec;
+    std::vector<char> buf(64 * 1024);
+    bool ok = true;
+    string reason;
+    while(ok && !p.is_done())
+    {
+        req.body().data = buf.data();
+        req.body().size = buf.size();
+        http::async_read(*cxt.socket, buffer, p, boost::fibers::asio::yield[ec]);
+        if(ec == http::error::need_buffer)
+        {
+            ec.assign(0, ec.category());
+        }
+        if(ec)
+        {
+            LogErrorExt << ec.message();
+            reason = ec.message();
+            ok = false;
+            break;
+        }
+        //每次读到的数据整块交给IO线程解包, 一块中的多个小文件只切换一次线程
+        size_t size = buf.size() - req.body().size;
+        ok = root->run([&]() { return ingest.feed(buf.data(), size); });
+        drain_forward();
+    }
+    ok = ok && root->run([&]() { return ingest.finish(); });
+    if(!ok)
+    {
+        root->run([&]() { ingest.abort(); });
+        if(reason.empty())
+            reason = ingest.error();
+        LogErrorExt << "tar ingest failed," << reason << "," << cxt.dir_name;
+    }
+    //没有读完的转发条目中止, 归属节点丢弃
+    for(auto& kv : forwards)
+    {
+        Forward& f = kv.second;
+        if(!f.ended)
+        {
+            f.stream->finish(false);
+            f.error = "aborted";
+        }
+        else if(!f.stream->result().get())
+        {
+            f.error = "cluster node unavailable," + f.node->address;
+        }
+    }
+
+    TransportContext entry_cxt = cxt;
+    string& body = res.body();
+    body = "{\"files\":[";
+    bool first = true;
+    for(size_t i = 0; i < ingest.entries().size(); ++i)
+    {
+        const TarIngest::Entry& e = ingest.entries()[i];
+        body += first ? "{\"name\":\"" : ",{\"name\":\"";
+        first = false;
+        kkurl::json_escape(e.name, body);
+        auto forward = forwards.find(i);
+        string error = e.error;
+        if(e.forwarded)
+            error = forward == forwards.end() ? "aborted" : forward->second.error;
+        if(!error.empty())
+        {
+            body += "\",\"error\":\"";
+            kkurl::json_escape(error, body);
+            body += "\"}";
+            continue;
+        }
+        body += "\",\"size\":" + std::to_string(e.meta.size);
+        if(e.forwarded)
+        {
+            //ETag 由归属节点生成
+            body += ",\"node\":\"";
+            kkurl::json_escape(forward->second.node->address, body);
+            body += "\"}";
+            continue;
+        }
+        body += ",\"etag\":\"";
+        kkurl::json_escape(e.meta.etag, body);
+        body += "\"}";
+
+        entry_cxt.file_name = e.name;
+        entry_cxt.rel_path = cxt.dir_name + "/" + e.name;
+        setFileRoot(entry_cxt, root);
+        //同名的上传或等待续传的上传之后不能再覆盖包里的文件
+        abortUpload(entry_cxt.rel_path);
+        //旧文件在另一块盘上时连同预压缩文件移到 .trash
+        FileMeta old_meta;
+        if(m_index.find(cxt.dir_name, e.name, old_meta) && old_meta.root != root->index() && old_meta.segment == 0)
+        {
+            trashFile(cxt.dir_name, e.name, old_meta);
+        }
+        putIndex(cxt.dir_name, e.name, e.meta);
+        compressAsync(entry_cxt, e.meta);
+    }
+    body += "]";
+    if(!ok)
+    {
+        body += ",\"error\":\"";
+        kkurl::json_escape(reason, body);
+        body += "\"";
+        res.result(ingest.error() == "Insufficient storage" ? http::status::insufficient_storage :
+                                                              http::status::bad_request);
+    }
+    else
+    {
+        res.keep_alive(req.keep_alive());
+    }
+    body += "}";
+    res.set(http::field::content_type, "application/json");
+    res.prepare_payload();
+    return res;
 }
 
-bool FileTransportServer::parseTarget(const boost::beast::string_view& target, std::string &path, std::string &query_string)
+bool FileTransportServer::abortUpload(const string& rel_path)
 {
-    size_t query_start = target.find('?');
-    if(query_start != boost::beast::string_view::npos)
+    bool found = false;
+    UploadTaskPtr upload_task;
     {
-        path = target.substr(0, query_start).to_string();
-        query_string = target.substr(query_start + 1).to_string();
+        std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+        auto it = m_upload_tasks.find(rel_path);
+        if(it != m_upload_tasks.end())
+        {
+            upload_task = it->second;
+            m_upload_tasks.erase(it);
+        }
     }
-    else
+    //先中止上传, 之后不会再提交到索引; 正在边上传边下载的连接随之结束
+    if(upload_task)
+    {
+        upload_task->cancel();
+        found = true;
+    }
+    JournalEntry entry;
+    bool resumable = false;
+    {
+        std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+        auto it = m_resumable.find(rel_path);
+        if(it != m_resumable.end())
+        {
+            entry = it->second;
+            resumable = true;
+            m_resumable.erase(it);
+        }
+    }
+    if(resumable)
+    {
+        discardResumable(entry);
+        found = true;
+    }
+    return found;
+}
+
+bool FileTransportServer::removeFile(const string& dir_name, const string& file_name)
+{
+    string rel_path = dir_name + "/" + file_name;
+    bool found = abortUpload(rel_path);
+
+    FileMeta meta;
+    if(!eraseIndex(dir_name, file_name, &meta))
+        return found;
+    //段中的文件由 eraseIndex 写入删除记录
+    if(meta.segment == 0)
+    {
+        trashFile(dir_name, file_name, meta);
+    }
+    LogInfo << "file deleted," << m_storage->roots()[meta.root]->fullPath(rel_path);
+    return true;
+}
+
+void FileTransportServer::trashFile(const string& dir_name, const string& file_name, const FileMeta& meta)
+{
+    StorageRootPtr root = m_storage->roots()[meta.root];
+    string file_dir = root->fullPath(dir_name);
+    string file_path = root->fullPath(dir_name + "/" + file_name);
+    //只在IO线程上做rename, unlink由后台线程完成
+    root->run([&]() {
+        root->trash(file_path);
+        trashVariants(root, file_dir, file_name, meta);
+    });
+}
+
+void FileTransportServer::trashVariants(const StorageRootPtr& root, const string& file_dir, const string& file_name,
+                                        const FileMeta& meta)
+{
+    for(int i = 1; i < CONTENT_ENCODING_COUNT; ++i)
+    {
+        CONTENT_ENCODING e = static_cast<CONTENT_ENCODING>(i);
+        if(meta.encodings & (1u << i))
+            root->trash(variant_path(file_dir, file_name, e));
+    }
+}
+
+void FileTransportServer::putIndex(const string& dir_name, const string& file_name, const FileMeta& meta)
+{
+    FileMeta old;
+    if(!m_index.put(dir_name, file_name, meta, &old))
+        return;
+    if(old.segment != 0)
+    {
+        //同一块盘上段中新的记录序号更大, 重放时自然覆盖旧记录
+        retireSegment(dir_name + "/" + file_name, old, meta.segment != 0 && meta.root == old.root);
+    }
+    else if(meta.segment != 0)
+    {
+        trashFile(dir_name, file_name, old);
+    }
+    else if(old.encodings != 0 && old.root == meta.root)
+    {
+        //文件已被新上传原地替换, 旧内容的预压缩文件随之移走
+        //索引先更新, 旧文件还在进行的压缩在etag检查时放弃, 已记录的都在 old.encodings 中
+        StorageRootPtr root = m_storage->roots()[old.root];
+        root->run([&]() { trashVariants(root, root->fullPath(dir_name), file_name, old); });
+    }
+}
+
+bool FileTransportServer::eraseIndex(const string& dir_name, const string& file_name, FileMeta* old)
+{
+    FileMeta meta;
+    if(!m_index.erase(dir_name, file_name, &meta))
+        return false;
+    if(meta.segment != 0)
     {
-        path = target.to_string();
+        retireSegment(dir_name + "/" + file_name, meta, false);
     }
+    if(old)
+        *old = meta;
     return true;
 }
 
-CaseInsensitiveMultimap FileTransportServer::parseQueryString(const std::string &query_string)
+void FileTransportServer::retireSegment(const string& rel_path, const FileMeta& old, bool replaced_in_segment)
+{
+    const SegmentStorePtr& store = m_segments[old.root];
+    SegmentRecord record = segment_record(rel_path, old);
+    if(replaced_in_segment)
+    {
+        store->release(record);
+        return;
+    }
+    //删除记录要写文件, 在盘的IO线程上追加
+    m_storage->roots()[old.root]->run([&]() { store->remove(record); });
+}
+
+SegmentFilePtr FileTransportServer::findSegment(const TransportContext& cxt, FileMeta& meta)
+{
+    SegmentFilePtr seg = m_segments[meta.root]->segment(meta.segment);
+    if(seg)
+        return seg;
+    //查索引之后段被压缩删除, 文件已搬到新的段
+    if(!m_index.find(cxt.dir_name, cxt.file_name, meta) || meta.segment == 0)
+        return nullptr;
+    return m_segments[meta.root]->segment(meta.segment);
+}
+
+http::response<http::string_body> FileTransportServer::recvSmallFile(TransportContext& cxt, RequestParser& p,
+                                                                     boost::beast::multi_buffer& buffer)
+{
+    auto& req = p.get();
+    http::response<http::string_body> res{http::status::ok, req.version()};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.keep_alive(req.keep_alive());
+    UploadDigest digest;
+    if(!digest.init(req))
+        return error_response(res, http::status::bad_request, "Invalid checksum header", p.is_done());
+
+    //整个读入内存, 不产生临时文件
+    boost::system::error_code ec;
+    string data(static_cast<size_t>(cxt.file_size), '\0');
+    size_t received = 0;
+    while(!p.is_done())
+    {
+        req.body().data = &data[received];
+        req.body().size = data.size() - received;
+        http::async_read(*cxt.socket, buffer, p, boost::fibers::asio::yield[ec]);
+        if(ec == http::error::need_buffer)
+        {
+            ec.assign(0, ec.category());
+        }
+        if(ec)
+        {
+            LogErrorExt << ec.message();
+            return error_response(res, http::status::bad_request, "recv file failed", p.is_done());
+        }
+        received = data.size() - req.body().size;
+    }
+    if(received != data.size())
+    {
+        LogErrorExt << "recv size not eq upload-size," << received << "," << cxt.file_size;
+        return error_response(res, http::status::bad_request, "recv size not eq content-length", p.is_done());
+    }
+    if(digest.enabled())
+    {
+        digest.update(data.data(), data.size());
+        if(!digest.verify())
+        {
+            LogErrorExt << "upload digest mismatch," << digest.digest() << "," << cxt.rel_path;
+            return error_response(res, http::status::bad_request, "Checksum mismatch", p.is_done());
+        }
+    }
+
+    //覆盖正在进行或等待续传的上传
+    abortUpload(cxt.rel_path);
+    if(!prepareUpload(cxt))
+        return error_response(res, http::status::insufficient_storage, "Insufficient storage", p.is_done());
+    const SegmentStorePtr& store = m_segments[cxt.root->index()];
+    SegmentRecord record;
+    time_t now = time(nullptr);
+    if(!cxt.root->run([&]() { return store->put(cxt.rel_path, data, now, record); }))
+    {
+        LogErrorExt << "store file to segment failed," << cxt.rel_path;
+        return error_response(res, http::status::internal_server_error, "store file failed", p.is_done());
+    }
+    putIndex(cxt.dir_name, cxt.file_name, segment_meta(record, cxt.root->index()));
+    LogDebug << "recv small file success," << record.segment << "," << record.offset << "," << cxt.rel_path;
+    res.content_length(0);
+    return res;
+}
+
+http::response<http::string_body> FileTransportServer::deleteBatch(const TransportContext& cxt,
+                                                                   RequestParser& p,
+                                                                   boost::beast::multi_buffer& buffer)
+{
+    const size_t MAX_BODY = 1024 * 1024;
+    auto& req = p.get();
+    http::response<http::string_body> res{http::status::ok, req.version()};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.keep_alive(req.keep_alive());
+
+    string names;
+    boost::system::error_code ec;
+    char buf[4096];
+    while(!p.is_done())
+    {
+        req.body().data = buf;
+        req.body().size = sizeof(buf);
+        http::async_read(*cxt.socket, buffer, p, boost::fibers::asio::yield[ec]);
+        if(ec == http::error::need_buffer)
+        {
+            ec.assign(0, ec.category());
+        }
+        if(ec || names.size() > MAX_BODY)
+        {
+            LogErrorExt << "read delete list failed," << ec.message();
+            res.result(http::status::bad_request);
+            res.set(http::field::content_type, "text/html");
+            res.keep_alive(false);
+            res.body() = ec ? ec.message() : "Delete list too large";
+            res.prepare_payload();
+            return res;
+        }
+        names.append(buf, sizeof(buf) - req.body().size);
+    }
+
+    enum RESULT
+    {
+        DELETED,
+        NOT_FOUND,
+        FAILED      //归属节点不可用
+    };
+    vector<string> list;
+    size_t pos = 0;
+    while(pos < names.size())
+    {
+        size_t end = names.find('\n', pos);
+        if(end == string::npos)
+            end = names.size();
+        string name = names.substr(pos, end - pos);
+        pos = end + 1;
+        if(!name.empty() && name.back() == '\r')
+            name.pop_back();
+        if(!name.empty())
+            list.push_back(std::move(name));
+    }
+
+    //集群中归属其他节点的文件按节点分组, 转发到归属节点删除
+    vector<RESULT> results(list.size(), NOT_FOUND);
+    map<string, std::pair<ClusterNodePtr, vector<size_t>>> remote;
+    Cluster::MembershipPtr members = m_cluster ? m_cluster->membership() : nullptr;
+    for(size_t i = 0; i < list.size(); ++i)
+    {
+        const string& name = list[i];
+        if(!boost::regex_match(name, m_file_name_regex))
+            continue;
+        ClusterNodePtr node = members && forwardable_name(name) ? members->owner(cxt.dir_name + "/" + name) : nullptr;
+        if(node)
+        {
+            auto& group = remote[node->address];
+            group.first = node;
+            group.second.push_back(i);
+        }
+        else if(removeFile(cxt.dir_name, name))
+        {
+            results[i] = DELETED;
+        }
+    }
+    IoContext& ioc = static_cast<IoContext&>(cxt.socket->get_executor().context());
+    for(auto& kv : remote)
+    {
+        vector<size_t>& indexes = kv.second.second;
+        vector<string> node_names;
+        for(size_t i : indexes)
+            node_names.push_back(list[i]);
+        vector<bool> deleted;
+        bool ok = forward_delete(ioc, *kv.second.first, cxt.dir_name, node_names, deleted);
+        for(size_t k = 0; k < indexes.size(); ++k)
+            results[indexes[k]] = deleted[k] ? DELETED : (ok ? NOT_FOUND : FAILED);
+    }
+
+    string json[3];
+    for(size_t i = 0; i < list.size(); ++i)
+    {
+        string& out = json[results[i]];
+        out += out.empty() ? "\"" : ",\"";
+        kkurl::json_escape(list[i], out);
+        out += "\"";
+    }
+    res.set(http::field::content_type, "application/json");
+    res.body() = "{\"deleted\":[" + json[DELETED] + "],\"not_found\":[" + json[NOT_FOUND] + "],\"failed\":[" +
+            json[FAILED] + "]}";
+    res.prepare_payload();
+    return res;
+}
+
+http::response<http::string_body> FileTransportServer::listDirectory(const TransportContext& cxt, unsigned version, bool keep_alive)
 {
-    CaseInsensitiveMultimap result;
+    const size_t DEFAULT_LIMIT = 1000;
+    const size_t MAX_LIMIT = 10000;
+
+    http::response<http::string_body> res{http::status::ok, version};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.keep_alive(keep_alive);
+
+    auto param = [&cxt](const char* key)
+    {
+        boost::optional<boost::beast::string_view> v = cxt.query_params.find(key);
+        return v ? v->to_string() : string();
+    };
+    string prefix = param("prefix");
+    string cursor = param("cursor");
+    string format = param("format");
+    size_t limit = DEFAULT_LIMIT;
+    string limit_str = param("limit");
+    if(!limit_str.empty())
+    {
+        char* end = nullptr;
+        unsigned long v = strtoul(limit_str.c_str(), &end, 10);
+        if(*end != '\0' || v == 0)
+            return error_response(res, http::status::bad_request, "Invalid limit");
+        limit = std::min<size_t>(v, MAX_LIMIT);
+    }
+    bool binary = false;
+    if(format == "binary")
+        binary = true;
+    else if(!format.empty() && format != "json")
+        return error_response(res, http::status::bad_request, "Unsupported list format");
 
-    if(query_string.empty())
-        return result;
+    vector<std::pair<string, FileMeta>> entries;
+    entries.reserve(std::min<size_t>(limit, 256));
+    bool more = false;
+    if(!m_index.list(cxt.dir_name, prefix, cursor, limit, entries, more))
+        return error_response(res, http::status::not_found, "The resource '/" + cxt.dir_name + "/' was not found.");
 
-    size_t name_pos = 0;
-    size_t name_end_pos = -1;
-    size_t value_pos = -1;
-    for(size_t c = 0; c < query_string.size(); ++c) {
-        if(query_string[c] == '&') {
-            auto name = query_string.substr(name_pos, (name_end_pos == std::string::npos ? c : name_end_pos) - name_pos);
-            if(!name.empty()) {
-                auto value = value_pos == std::string::npos ? std::string() : query_string.substr(value_pos, c - value_pos);
-                result.emplace(std::move(name), Percent::decode(value));
+    string& body = res.body();
+    if(binary)
+    {
+        auto put = [&body](uint64_t v, int bytes)
+        {
+            for(int i = 0; i < bytes; ++i)
+            {
+                body += static_cast<char>((v >> (8 * i)) & 0xff);
             }
-            name_pos = c + 1;
-            name_end_pos = -1;
-            value_pos = -1;
+        };
+        body.reserve(5 + entries.size() * 48);
+        put(entries.size(), 4);
+        put(more ? 1 : 0, 1);
+        for(const auto& e : entries)
+        {
+            put(e.first.size(), 2);
+            body += e.first;
+            put(e.second.size, 8);
+            put(e.second.mtime, 8);
+        }
+        res.set(http::field::content_type, "application/octet-stream");
+    }
+    else
+    {
+        body.reserve(32 + entries.size() * 96);
+        body = "{\"dir\":\"" + cxt.dir_name + "\",\"files\":[";
+        for(size_t i = 0; i < entries.size(); ++i)
+        {
+            const FileMeta& meta = entries[i].second;
+            body += i ? ",{\"name\":\"" : "{\"name\":\"";
+            kkurl::json_escape(entries[i].first, body);
+            body += "\",\"size\":" + std::to_string(meta.size) + ",\"mtime\":" + std::to_string(meta.mtime) + ",\"etag\":\"";
+            kkurl::json_escape(meta.etag, body);
+            body += "\"}";
         }
-        else if(query_string[c] == '=') {
-            name_end_pos = c;
-            value_pos = c + 1;
+        body += "]";
+        if(more)
+        {
+            body += ",\"next_cursor\":\"";
+            kkurl::json_escape(entries.back().first, body);
+            body += "\"";
         }
+        body += "}";
+        res.set(http::field::content_type, "application/json");
     }
-    if(name_pos < query_string.size()) {
-        auto name = query_string.substr(name_pos, name_end_pos - name_pos);
-        if(!name.empty()) {
-            auto value = value_pos >= query_string.size() ? std::string() : query_string.substr(value_pos);
-            result.emplace(std::move(name), Percent::decode(value));
+    res.prepare_payload();
+    return res;
+}
+
+std::shared_ptr<ArchiveWriter> FileTransportServer::makeArchive(const TransportContext& cxt, ARCHIVE_FORMAT format)
+{
+    vector<std::pair<string, FileMeta>> files;
+    if(!m_index.listDir(cxt.dir_name, files))
+        return nullptr;
+    vector<ArchiveWriter::Item> items;
+    items.reserve(files.size());
+    for(auto& file : files)
+    {
+        ArchiveWriter::Item item;
+        if(file.second.segment != 0)
+        {
+            //持有段文件, 发送期间被压缩删除仍可以读
+            item.segment = m_segments[file.second.root]->segment(file.second.segment);
+            if(!item.segment)
+                continue;
+            item.path = item.segment->path;
+        }
+        else
+        {
+            item.path = m_storage->roots()[file.second.root]->fullPath(cxt.dir_name + "/" + file.first);
+        }
+        item.name = std::move(file.first);
+        item.meta = std::move(file.second);
+        if(format == ARCHIVE_FORMAT::ZIP && !item.meta.has_crc32)
+        {
+            //zip本地头中要写CRC32, 第一次打包时在文件所在盘的IO线程上计算并缓存到索引
+            StorageRootPtr root = m_storage->roots()[item.meta.root];
+            if(!root->run([&item]() {
+                if(item.segment)
+                    return file_crc32(item.segment->fd, item.meta.offset, item.meta.size, item.meta.crc32);
+                return file_crc32(item.path, item.meta.crc32);
+            }))
+            {
+                //列目录之后被删除的文件不打包
+                continue;
+            }
+            item.meta.has_crc32 = true;
+            m_index.setCrc32(cxt.dir_name, item.name, item.meta.etag, item.meta.crc32);
         }
+        items.push_back(std::move(item));
     }
+    return std::make_shared<ArchiveWriter>(format, std::move(items));
+}
 
-    return result;
+void FileTransportServer::compressAsync(const TransportContext& cxt, const FileMeta& meta)
+{
+    //段中的文件不生成预压缩文件
+    if(g_cfg->compress_encodings.empty() ||
+            meta.segment != 0 ||
+            meta.size < g_cfg->compress_min_size ||
+            meta.size > g_cfg->compress_max_size ||
+            !is_compressible(mime_type(cxt.file_name)))
+        return;
+
+    //不占用请求fiber: 启用计算线程池时在池中压缩, 否则在文件所在盘的IO线程上压缩
+    string dir_name = cxt.dir_name;
+    string file_name = cxt.file_name;
+    string file_dir = cxt.file_dir;
+    string file_path = cxt.file_path;
+    string etag = meta.etag;
+    auto compress = [this, dir_name, file_name, file_dir, file_path, etag]() {
+        boost::system::error_code e;
+        fs::create_directory(file_dir + "/.variants", e);
+        for(CONTENT_ENCODING encoding : g_cfg->compress_encodings)
+        {
+            //先压缩到唯一的临时名, 同一文件的多次压缩互不覆盖
+            int64_t size = 0;
+            string variant = variant_path(file_dir, file_name, encoding);
+            string staged = variant + "." + std::to_string(m_variant_seq++) + ".pending";
+            if(!compress_file(file_path, staged, encoding, size))
+                continue;
+            //检查etag, 改名, 记录到索引 在同一把锁内完成, 不会覆盖或删除新上传的预压缩文件
+            std::lock_guard<std::mutex> lk(m_variant_mutex);
+            FileMeta meta;
+            if(!m_index.find(dir_name, file_name, meta) || meta.etag != etag)
+            {
+                //压缩期间文件被重新上传或删除
+                fs::remove(staged, e);
+                break;
+            }
+            if(::rename(staged.c_str(), variant.c_str()) != 0)
+            {
+                LogErrorExt << "rename variant failed," << strerror(errno) << "," << variant;
+                fs::remove(staged, e);
+                continue;
+            }
+            //检查之后才被替换, 新文件的压缩还没有提交, 删除是安全的
+            if(!m_index.addVariant(dir_name, file_name, etag, encoding, size))
+            {
+                fs::remove(variant, e);
+                break;
+            }
+        }
+    };
+    if(ComputePool::instance().enabled())
+    {
+        ComputePool::instance().post(std::move(compress));
+    }
+    else
+    {
+        cxt.root->post(std::move(compress));
+    }
+}
+
+http::response<http::string_body> FileTransportServer::initParallelUpload(const TransportContext& cxt,
+                                                                          const Request& req)
+{
+    const int64_t DEFAULT_PART_SIZE = 8 * 1024 * 1024;
+    const int64_t MIN_PART_SIZE = 64 * 1024;
+    const size_t MAX_PARTS = 10000;
+
+    http::response<http::string_body> res{http::status::ok, req.version()};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.keep_alive(req.keep_alive());
+    auto const int_param = [&cxt](const char* key, int64_t default_value)
+    {
+        boost::optional<boost::beast::string_view> v = cxt.query_params.find(key);
+        if(!v)
+            return default_value;
+        string str = v->to_string();
+        char* end = nullptr;
+        long long n = strtoll(str.c_str(), &end, 10);
+        return (str.empty() || *end != '\0') ? -1 : static_cast<int64_t>(n);
+    };
+
+    auto up = std::make_shared<ParallelUpload>();
+    up->rel_path = cxt.rel_path;
+    up->size = int_param("size", -1);
+    up->part_size = int_param("part_size", DEFAULT_PART_SIZE);
+    if(up->size <= 0)
+        return error_response(res, http::status::bad_request, "Invalid size");
+    if(up->part_size <= 0 || (up->part_size < MIN_PART_SIZE && up->part_size < up->size))
+        return error_response(res, http::status::bad_request, "Invalid part size");
+    if(up->partCount() > MAX_PARTS)
+        return error_response(res, http::status::bad_request, "Too many parts");
+    up->parts.assign(up->partCount(), ParallelUpload::PART_MISSING);
+
+    expireParallelUploads();
+    TransportContext up_cxt = cxt;
+    up_cxt.file_size = up->size;
+    if(!prepareUpload(up_cxt))
+        return error_response(res, http::status::insufficient_storage, "Insufficient storage");
+    up->task = registerUpload(up_cxt);
+    up->task->setParallel();
+    if(!up->task->initDigest(req))
+    {
+        unregisterUpload(up_cxt.rel_path, up->task);
+        return error_response(res, http::status::bad_request, "Invalid checksum header");
+    }
+    BSError start_ec;
+    if(!up->task->start(start_ec))
+    {
+        unregisterUpload(up_cxt.rel_path, up->task);
+        if(start_ec == boost::system::errc::no_space_on_device)
+            return error_response(res, http::status::insufficient_storage, "Insufficient storage");
+        return error_response(res, http::status::internal_server_error, "create upload file failed");
+    }
+    startReplication(up_cxt, up->task, req);
+
+    static std::atomic<uint32_t> s_upload_seq{0};
+    std::random_device rd;
+    char id[33];
+    snprintf(id, sizeof(id), "%08x%08x%08x%08x", rd(), rd(), static_cast<unsigned>(time(nullptr)), ++s_upload_seq);
+    up->id = id;
+    up->active_time = time(nullptr);
+    {
+        std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+        m_parallel_uploads[up->id] = up;
+    }
+    LogInfo << "parallel upload created," << up->id << "," << up->size << "," << up->part_size << "," << cxt.rel_path;
+    res.set(http::field::content_type, "application/json");
+    res.body() = "{\"upload_id\":\"" + up->id + "\",\"part_size\":" + std::to_string(up->part_size) +
+            ",\"parts\":" + std::to_string(up->partCount()) + "}";
+    res.prepare_payload();
+    return res;
+}
+
+http::response<http::string_body> FileTransportServer::recvPart(const TransportContext& cxt,
+                                                                RequestParser& p,
+                                                                boost::beast::multi_buffer& buffer)
+{
+    auto& req = p.get();
+    http::response<http::string_body> res{http::status::ok, req.version()};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.keep_alive(req.keep_alive());
+    string id = cxt.query_params.find("uploadId")->to_string();
+    boost::optional<boost::beast::string_view> number = cxt.query_params.find("partNumber");
+    size_t n = number ? strtoul(number->to_string().c_str(), nullptr, 10) : 0;
+    ParallelUploadPtr up;
+    int64_t offset = 0;
+    int64_t length = 0;
+    {
+        std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+        auto it = m_parallel_uploads.find(id);
+        if(it == m_parallel_uploads.end() || it->second->rel_path != cxt.rel_path)
+            return error_response(res, http::status::not_found, "No such upload", p.is_done());
+        up = it->second;
+        if(n == 0 || n > up->partCount())
+            return error_response(res, http::status::bad_request, "Invalid part number", p.is_done());
+        offset = up->partOffset(n);
+        length = up->partLength(n);
+        if(!p.content_length() || static_cast<int64_t>(*p.content_length()) != length)
+            return error_response(res, http::status::bad_request, "Content-Length must be " + std::to_string(length),
+                                  p.is_done());
+        if(up->parts[n - 1] == ParallelUpload::PART_RECEIVING)
+            return error_response(res, http::status::conflict, "Part is being uploaded", p.is_done());
+        up->parts[n - 1] = ParallelUpload::PART_RECEIVING;
+        up->active_time = time(nullptr);
+    }
+
+    boost::system::error_code ec;
+    int64_t received = 0;
+    std::vector<char> buf(64 * 1024);
+    while(!p.is_done())
+    {
+        req.body().data = buf.data();
+        req.body().size = buf.size();
+        http::async_read(*cxt.socket, buffer, p, boost::fibers::asio::yield[ec]);
+        if(ec == http::error::need_buffer)
+        {
+            ec.assign(0, ec.category());
+        }
+        if(ec)
+        {
+            LogErrorExt << ec.message();
+            break;
+        }
+        size_t size = buf.size() - req.body().size;
+        if(size == 0)
+            continue;
+        //数据直接写到这一片在文件中的位置
+        if(!up->task->recvAt(offset + received, string(buf.data(), size)))
+        {
+            ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+            break;
+        }
+        received += size;
+    }
+
+    std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+    up->active_time = time(nullptr);
+    if(ec || received != length)
+    {
+        up->parts[n - 1] = ParallelUpload::PART_MISSING;
+        if(up->task->cancelled())
+            return error_response(res, http::status::conflict, "upload cancelled", p.is_done());
+        return error_response(res, ec == boost::system::errc::io_error ? http::status::internal_server_error :
+                                                                         http::status::bad_request,
+                              "recv part failed", p.is_done());
+    }
+    up->parts[n - 1] = ParallelUpload::PART_DONE;
+    res.content_length(0);
+    return res;
+}
+
+http::response<http::string_body> FileTransportServer::finishParallelUpload(const TransportContext& cxt,
+                                                                            const Request& req,
+                                                                            bool commit)
+{
+    http::response<http::string_body> res{commit ? http::status::ok : http::status::no_content, req.version()};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.keep_alive(req.keep_alive());
+
+    string id = cxt.query_params.find("uploadId")->to_string();
+    ParallelUploadPtr up;
+    {
+        std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+        auto it = m_parallel_uploads.find(id);
+        if(it == m_parallel_uploads.end() || it->second->rel_path != cxt.rel_path)
+            return error_response(res, http::status::not_found, "No such upload");
+        up = it->second;
+        if(commit && !up->complete())
+        {
+            size_t missing = std::count_if(up->parts.begin(), up->parts.end(),
+                                           [](uint8_t s) { return s != ParallelUpload::PART_DONE; });
+            return error_response(res, http::status::conflict, std::to_string(missing) + " parts missing");
+        }
+        m_parallel_uploads.erase(it);
+    }
+
+    TransportContext up_cxt = cxt;
+    UploadTaskPtr task = up->task;
+    if(!commit)
+    {
+        task->stop(STOP_REASEON::ERROR);
+        unregisterUpload(up_cxt.rel_path, task);
+        LogInfo << "parallel upload aborted," << id << "," << cxt.rel_path;
+        return res;
+    }
+    //所有分片已在各自偏移处写好, 提交只需要改名
+    bool stored = task->stop(STOP_REASEON::NORMAL);
+    //先加入索引再移除任务
+    if(stored)
+    {
+        putIndex(up_cxt.dir_name, up_cxt.file_name, task->getFileMeta());
+    }
+    unregisterUpload(up_cxt.rel_path, task);
+    if(!stored && task->cancelled())
+        return error_response(res, http::status::conflict, "upload cancelled");
+    if(!stored)
+    {
+        eraseIndex(up_cxt.dir_name, up_cxt.file_name);
+        if(task->digestMismatch())
+            return error_response(res, http::status::bad_request, "Checksum mismatch");
+        return error_response(res, http::status::internal_server_error, "store file failed");
+    }
+    LogInfo << "parallel upload complete," << id << "," << cxt.rel_path;
+    compressAsync(up_cxt, task->getFileMeta());
+    if(!task->replicated())
+        return error_response(res, http::status::service_unavailable, "replication not acknowledged");
+    res.content_length(0);
+    return res;
+}
+
+void FileTransportServer::expireParallelUploads()
+{
+    time_t deadline = time(nullptr) - g_cfg->parallel_upload_timeout;
+    vector<ParallelUploadPtr> expired;
+    {
+        std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+        for(auto it = m_parallel_uploads.begin(); it != m_parallel_uploads.end();)
+        {
+            bool receiving = std::count(it->second->parts.begin(), it->second->parts.end(),
+                                        ParallelUpload::PART_RECEIVING) > 0;
+            if(it->second->active_time < deadline && !receiving)
+            {
+                expired.push_back(it->second);
+                it = m_parallel_uploads.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+    for(ParallelUploadPtr& up : expired)
+    {
+        LogWarnExt << "parallel upload expired," << up->id << "," << up->rel_path;
+        up->task->stop(STOP_REASEON::ERROR);
+        unregisterUpload(up->rel_path, up->task);
+    }
+}
+
+void FileTransportServer::expireResumableUploads()
+{
+    time_t deadline = time(nullptr) - g_cfg->upload_resume_timeout;
+    vector<JournalEntry> expired;
+    {
+        std::lock_guard<boost::fibers::mutex> lk(m_mutex);
+        for(auto it = m_resumable.begin(); it != m_resumable.end();)
+        {
+            if(it->second.suspend_time < deadline)
+            {
+                expired.push_back(it->second);
+                it = m_resumable.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+    for(const JournalEntry& entry : expired)
+    {
+        LogWarnExt << "resumable upload expired," << entry.offset << "," << entry.size << "," << entry.rel_path;
+        discardResumable(entry);
+    }
+}
+
+void FileTransportServer::discardResumable(const JournalEntry& entry)
+{
+    m_journal->remove(entry.rel_path);
+    StorageRootPtr root = m_storage->roots()[entry.root];
+    string tmp_path = root->fullPath(entry.rel_path) + ".tmp";
+    root->run([&]() { root->trash(tmp_path); });
+}
+
+void FileTransportServer::recoverUploads()
+{
+    if(g_cfg->upload_journal.empty())
+        return;
+    if(g_cfg->upload_tmpfile)
+    {
+        LogWarnExt << "upload journal needs named tmp files, uploads will not be resumable";
+    }
+    m_journal = std::make_shared<UploadJournal>(g_cfg->upload_journal, g_cfg->upload_journal_interval);
+    vector<JournalEntry> unfinished;
+    if(!m_journal->open(unfinished))
+        throw std::runtime_error("open upload journal failed");
+    const vector<StorageRootPtr>& roots = m_storage->roots();
+    for(const JournalEntry& e : unfinished)
+    {
+        //崩溃时已提交或临时文件已被删除
+        struct stat st;
+        if(e.root >= roots.size() || ::stat((roots[e.root]->fullPath(e.rel_path) + ".tmp").c_str(), &st) != 0 ||
+                st.st_size < e.offset)
+        {
+            m_journal->remove(e.rel_path);
+            continue;
+        }
+        LogInfo << "upload resumable," << e.offset << "," << e.size << "," << e.rel_path;
+        //崩溃前的断开时间未知, 从启动时开始计算续传超时
+        JournalEntry& entry = m_resumable[e.rel_path];
+        entry = e;
+        entry.suspend_time = time(nullptr);
+    }
+}
+
+void FileTransportServer::openSegments()
+{
+    if(g_cfg->segment_threshold <= 0)
+        return;
+    const vector<StorageRootPtr>& roots = m_storage->roots();
+    vector<vector<SegmentRecord>> records(roots.size());
+    for(const StorageRootPtr& root : roots)
+    {
+        SegmentStorePtr store = std::make_shared<SegmentStore>(root->path() + "/.segments", g_cfg->segment_size);
+        if(!store->open(records[root->index()]))
+            throw std::runtime_error("open segment store failed," + root->path());
+        m_segments.push_back(store);
+    }
+    for(size_t i = 0; i < roots.size(); ++i)
+    {
+        for(const SegmentRecord& r : records[i])
+        {
+            string dir_name;
+            string file_name;
+            if(!split_rel_path(r.rel_path, dir_name, file_name))
+                continue;
+            //删除记录没来得及写入就崩溃时, 以较新的为准
+            FileMeta meta;
+            if(m_index.find(dir_name, file_name, meta))
+            {
+                if(meta.mtime >= r.mtime)
+                {
+                    m_segments[i]->remove(r);
+                    continue;
+                }
+                if(meta.segment != 0)
+                    m_segments[meta.root]->remove(segment_record(r.rel_path, meta));
+                else
+                    roots[meta.root]->trash(roots[meta.root]->fullPath(r.rel_path));
+            }
+            m_index.put(dir_name, file_name, segment_meta(r, i));
+        }
+        LogInfo << "segment files loaded," << records[i].size() << "," << roots[i]->path();
+
+        m_segments[i]->startCompaction(
+                    [this, i](const SegmentRecord& r) {
+            string dir_name;
+            string file_name;
+            FileMeta meta;
+            return split_rel_path(r.rel_path, dir_name, file_name) &&
+                    m_index.find(dir_name, file_name, meta) &&
+                    meta.root == i && meta.segment == r.segment && meta.offset == r.offset;
+        },
+        [this, i](const SegmentRecord& from, const SegmentRecord& to) {
+            string dir_name;
+            string file_name;
+            return split_rel_path(from.rel_path, dir_name, file_name) &&
+                    m_index.relocate(dir_name, file_name, i, from.segment, from.offset, to.segment, to.offset);
+        });
+    }
+}
+
+void FileTransportServer::start()
+{
+    m_index.build(*m_storage);
+    openSegments();
+    recoverUploads();
+#ifdef FTS_AWAITABLE
+    boost::asio::co_spawn(m_accept.get_executor(), [this]() {
+        return this->accept();
+    }, boost::asio::detached);
+#else
+    make_fiber([this](){
+        this->accept();
+    }).detach();
+#endif
+    //定时清理超时的并行上传与等待续传的上传
+    make_fiber([this](){
+        const int interval = std::max(1, std::min({60, g_cfg->parallel_upload_timeout,
+                                                   g_cfg->upload_resume_timeout}));
+        for(;;)
+        {
+            boost::this_fiber::sleep_for(std::chrono::seconds(interval));
+            expireParallelUploads();
+            if(m_journal)
+                expireResumableUploads();
+        }
+    }).detach();
 }
@@ -2,6 +2,17 @@
 #define TRANSPORT_SERVER_H
 
 #include "kconfig.h"
+#include "tls_context.h"
+#include "storage.h"
+#include "file_index.h"
+#include "archive_writer.h"
+#include "replicator.h"
+#include "cluster.h"
+#include "origin.h"
+#include "upload_journal.h"
+#include "parallel_upload.h"
+#include "segment_store.h"
+#include "awaitable.h"
 
 //文件上传格式 post http://xxx.com/{dir}/filename.jpg 必须有 Content-Lenght
 //文件下载 get http://xxx.com/{dir}/filename.jpg
@@ -9,20 +20,66 @@
 //文件上传格式 post http://xxx.com/{dir}/filename88766_12398776.mp4 必须有 Content-Lenght
 //文件下载 get http://xxx.com/{dir}/filename88766_12398776.mp4
 
-//不支持断点续传,主要用于边上传边下载这种模式，上传的文件会定期清理，文件必须带有扩展名
-//如果要支持断点续传,下载方与上传方协商,比如重新指定一个上传文件名进行断点续传
+//multipart/form-data 上传 post http://xxx.com/{dir}/ 每个文件part保存为 {dir}/{part的filename}
+//post http://xxx.com/{dir}/filename.jpg 时第一个文件part保存为 filename.jpg, 其余part仍按各自filename保存
+
+//批量上传小文件 post http://xxx.com/{dir}/?ingest=tar 或 Content-Type: application/x-tar
+//tar包中的文件解包为 {dir}/{文件名}, 应答为每个文件结果的json清单
+
+//目录打包下载 get http://xxx.com/{dir}/?archive=tar|zip 只存储不压缩, 有 Content-Length
+
+//列目录 get http://xxx.com/{dir}/?list&prefix=xx&cursor=xx&limit=1000&format=json|binary
+//按文件名排序分页, cursor 为上一页最后一个文件名; 直接由内存索引提供, 不读目录
+//format=binary 时所有整数小端: u32 条目数, u8 是否还有下一页,
+//之后每个条目 u16 名字长度, 名字, u64 大小, u64 修改时间(秒)
+
+//删除文件 delete http://xxx.com/{dir}/filename.jpg 正在上传的同名文件会被中止
+//批量删除 post http://xxx.com/{dir}/?delete body为文件名, 每行一个
+//文件先移到存储盘的 .trash 目录, 由后台线程删除
+
+//配置 replica_peers 后上传边接收边复制到对端(对端的普通POST, 带 X-Fts-Replica 头), 按 replica_ack 等待确认
+//确认不足时文件仍保存在本地, 应答503
+
+//配置 cluster_file 后文件按 {dir}/{name} 归属集群中的一个节点, 非归属节点收到文件请求时
+//应答307重定向到归属节点, 或转发给归属节点(带 X-Fts-Forwarded 头)
+//tar 解包, multipart 与批量删除中归属其他节点的文件由收到请求的节点逐个转发给归属节点, 应答中带上节点地址或 failed 列表
+//列目录与打包下载只包含本节点的文件
+
+//配置 origin_url 后, get 本地没有的文件时从源站拉取, 作为一个上传任务边保存边发送
+
+//配置 upload_journal 后, 有 Content-Length 的上传在进程崩溃或客户端断开后可以续传
+//head http://xxx.com/{dir}/filename.mp4?upload 应答头 Upload-Offset 为已落盘长度, Upload-Length 为文件大小
+//post http://xxx.com/{dir}/filename.mp4?offset=N body为剩余部分, N 与 Upload-Offset 不一致时应答409
+
+//并行分片上传, 大文件分成多片在多个连接上同时上传
+//post http://xxx.com/{dir}/filename.mp4?uploads&size=总大小&part_size=分片大小 应答json {"upload_id":"..","part_size":N,"parts":K}
+//put http://xxx.com/{dir}/filename.mp4?uploadId=xx&partNumber=n (n从1开始) body为第n片, 写在 (n-1)*part_size 处
+//post http://xxx.com/{dir}/filename.mp4?uploadId=xx 所有分片完成后提交; delete 同样的url放弃
+//上传中的下载按文件顺序接收已连续的部分
+
+//边上传边下载时晚加入的下载可以不从头接收: get ...?live_edge 从最近收到的数据开始,
+//?offset=N 从第N字节开始, ?since=T 从 unix毫秒T 之后收到的数据开始; 应答为chunked, 头 X-Start-Offset 为开始的偏移
+//只对上传中的文件有效, 已完成的文件仍完整发送
+
+//配置 segment_threshold 后, 有 Content-Length 且不超过阈值的上传整个接收后追加到存储盘的段文件, 不单独占用inode
+//get 从段文件中的偏移处 sendfile; 段中有效数据不到一半时后台压缩; 这样的上传不能边上传边下载, 也不生成预压缩文件
+
+//主要用于边上传边下载这种模式，上传的文件会定期清理，文件必须带有扩展名
 
 class UploadTask;
 typedef std::shared_ptr<UploadTask> UploadTaskPtr;
 
 struct TransportContext
 {
-    boost::smatch path_params;
-    CaseInsensitiveMultimap query_params;
+    kkurl::QueryParams query_params;
+    string dir_name;
+    string file_name;
+    string rel_path;    //{dir}/{name}
+    StorageRootPtr root;
     string file_dir;
     string file_path;
-    SocketPtr socket;
-    int file_size = 0;
+    ConnectionPtr socket;
+    int64_t file_size = 0;  //-1表示大小未知
 };
 
 class FileTransportServer
@@ -33,27 +90,145 @@ public:
 
     void start();
 
+    //监听端口启用TLS,必须在start前调用
+    void enableTls(const string& cert_file, const string& key_file, long session_timeout, int handshake_timeout);
+
 private:
-    bool parseTarget(const boost::beast::string_view& target, std::string &path, std::string &query_string);
-    CaseInsensitiveMultimap parseQueryString(const std::string &query_string);
+    //连接在两个请求之间保留的状态
+    struct SessionState
+    {
+        SessionState() : arena(arena_buf, sizeof(arena_buf)) {}
+
+        // This buffer is required to persist across reads
+        boost::beast::multi_buffer buffer;
+        //解析器, 头部字段与路由匹配结果的分配区, 读下一个请求前整体释放
+        //头部不超过 arena_buf 时一个请求周期不需要堆分配
+        alignas(std::max_align_t) char arena_buf[4096];
+        std::pmr::monotonic_buffer_resource arena;
+        boost::optional<RequestParser> parser;
+    };
 
+    //释放上一个请求的分配区, 为下一个请求新建解析器
+    void resetParser(SessionState& st);
+    //已读到请求头, 在fiber中处理这个请求
+    //连接可以继续读下一个请求时返回true, 否则连接已关闭或交给了 DownTask
+    bool serveRequest(const ConnectionPtr& socket, SessionState& st);
+    //处理一个请求, 连接需要关闭时 close 为true, 连接交给 DownTask 后 detached 为true
+    void handleRequest(const ConnectionPtr& socket, RequestParser& p,
+                       boost::beast::multi_buffer& buffer, send_lambda<Connection>& send,
+                       bool& close, bool& detached);
+    //TLS握手, 在fiber中执行
+    bool handshake(Connection& conn);
+
+#ifdef FTS_AWAITABLE
+    //coroutine per server connection, 等待请求时只占用协程帧, 每个请求在fiber中处理
+    boost::asio::awaitable<void> session(ConnectionPtr socket);
+    boost::asio::awaitable<void> accept();
+#else
     /*****************************************************************************
     *   fiber function per server connection
     *****************************************************************************/
-    void session(SocketPtr socket);
-
+    void session(ConnectionPtr socket);
     void accept();
+#endif
+    //重放上传日志, 临时文件仍在的上传等待续传
+    void recoverUploads();
+    //清理超过 upload_resume_timeout 没有续传的上传
+    void expireResumableUploads();
+    //删除等待续传的上传的日志记录与临时文件
+    void discardResumable(const JournalEntry& entry);
+
+    void setFileRoot(TransportContext& cxt, const StorageRootPtr& root);
+    //选择存储盘, 删除其他盘上的旧文件
+    bool prepareUpload(TransportContext& cxt);
+    //注册上传任务, 同一路径正在上传的任务被中止
+    UploadTaskPtr registerUpload(const TransportContext& cxt);
+    //配置了对端时把上传同时复制出去
+    void startReplication(const TransportContext& cxt, const UploadTaskPtr& task, const RequestFields& headers);
+    //注册回源任务并请求源站, 已有同一路径的任务时直接返回它
+    //失败返回空, status 为应答客户端的状态码
+    UploadTaskPtr pullOrigin(TransportContext& cxt, http::status& status);
+    //接收源站的body, 完成后加入索引
+    void fillFromOrigin(const TransportContext& cxt, const UploadTaskPtr& task, const OriginFetchPtr& fetch);
+    //只移除自己注册的任务, 避免误删同一路径后来的上传
+    void unregisterUpload(const string& rel_path, const UploadTaskPtr& task);
+    //创建并行分片上传, 文件按总大小预分配
+    http::response<http::string_body> initParallelUpload(const TransportContext& cxt, const Request& req);
+    //接收一个分片, 边收边按偏移写入文件
+    http::response<http::string_body> recvPart(const TransportContext& cxt,
+                                               RequestParser& p,
+                                               boost::beast::multi_buffer& buffer);
+    //commit 为true时提交, 否则放弃
+    http::response<http::string_body> finishParallelUpload(const TransportContext& cxt, const Request& req,
+                                                           bool commit);
+    //清理超时未完成的并行上传
+    void expireParallelUploads();
+    //流式解析multipart body, 每个文件part作为一个独立的上传任务
+    http::response<http::string_body> recvMultipart(const TransportContext& cxt,
+                                                    RequestParser& p,
+                                                    boost::beast::multi_buffer& buffer);
+    //流式解包tar body, 所有文件放在同一块盘上, 成批落盘
+    http::response<http::string_body> recvTar(const TransportContext& cxt,
+                                              RequestParser& p,
+                                              boost::beast::multi_buffer& buffer);
+    //打开各存储盘的段文件, 段中的文件加入索引
+    void openSegments();
+    //小文件整个读入后校验, 追加到所在盘的段文件
+    http::response<http::string_body> recvSmallFile(TransportContext& cxt, RequestParser& p,
+                                                    boost::beast::multi_buffer& buffer);
+    //段已被压缩删除时重新查一次索引, 文件不再在段中时返回空
+    SegmentFilePtr findSegment(const TransportContext& cxt, FileMeta& meta);
+    //更新索引, 被替换或删除的文件占用的段记录随之释放, 被段中记录替换的独立文件移到 .trash
+    void putIndex(const string& dir_name, const string& file_name, const FileMeta& meta);
+    bool eraseIndex(const string& dir_name, const string& file_name, FileMeta* old = nullptr);
+    void retireSegment(const string& rel_path, const FileMeta& old, bool replaced_in_segment);
+    //把独立文件与预压缩文件移到 .trash
+    void trashFile(const string& dir_name, const string& file_name, const FileMeta& meta);
+    //在 root 的IO线程上调用
+    void trashVariants(const StorageRootPtr& root, const string& file_dir, const string& file_name,
+                       const FileMeta& meta);
+    //中止正在进行的上传与等待续传的上传, 都不存在时返回false
+    bool abortUpload(const string& rel_path);
+    //中止正在进行的上传, 删除已存储的文件与预压缩文件, 都不存在时返回false
+    bool removeFile(const string& dir_name, const string& file_name);
+    http::response<http::string_body> deleteBatch(const TransportContext& cxt,
+                                                  RequestParser& p,
+                                                  boost::beast::multi_buffer& buffer);
+    //分页列目录, 参数错误返回400, 目录不存在返回404
+    http::response<http::string_body> listDirectory(const TransportContext& cxt, unsigned version, bool keep_alive);
+    //目录下所有文件的归档, 目录不存在返回空
+    std::shared_ptr<ArchiveWriter> makeArchive(const TransportContext& cxt, ARCHIVE_FORMAT format);
+    //后台生成预压缩文件
+    void compressAsync(const TransportContext& cxt, const FileMeta& meta);
 
 private:
     IoContextPool & m_pool;
     tcp::acceptor m_accept;
-    string  m_doc_root;
+    StoragePtr m_storage;
+    FileIndex m_index;
+    TlsContextPtr m_tls;
+    std::shared_ptr<Replicator> m_replicator;
+    std::shared_ptr<Cluster> m_cluster;
+    std::shared_ptr<Origin> m_origin;
+    UploadJournalPtr m_journal;
+    //按存储盘下标, 未启用打包存储时为空
+    vector<SegmentStorePtr> m_segments;
+    //预压缩文件改名提交, 压缩在计算线程或盘IO线程上执行
+    std::mutex m_variant_mutex;
+    std::atomic<uint64_t> m_variant_seq{0};
 
-    //key为 file_path;
+    //key为 rel_path;
     map<string, UploadTaskPtr> m_upload_tasks;
+    //等待续传的上传, key为 rel_path
+    map<string, JournalEntry> m_resumable;
+    //并行分片上传, key为 upload id
+    map<string, ParallelUploadPtr> m_parallel_uploads;
     boost::fibers::mutex m_mutex;
 
     boost::regex m_target_file_regex = boost::regex("^/([0-9a-zA-Z]{1,32})/([_0-9a-zA-Z]{1,32}.*)$");
+    boost::regex m_target_dir_regex = boost::regex("^/([0-9a-zA-Z]{1,32})/$");
+    //multipart中part的filename
+    boost::regex m_file_name_regex = boost::regex("^[_0-9a-zA-Z]{1,32}[^/\\\\]*$");
     int m_body_limit = 1024*1024*100;
 };
 
@@ -0,0 +1,225 @@
+#include "upload_digest.h"
+#include <openssl/evp.h>
+#include <boost/beast/core/detail/base64.hpp>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace {
+const uint32_t CRC32C_POLY = 0x82F63B78;
+
+struct Crc32cTable
+{
+    uint32_t table[256];
+    Crc32cTable()
+    {
+        for(uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t c = i;
+            for(int k = 0; k < 8; ++k)
+                c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            table[i] = c;
+        }
+    }
+};
+
+uint32_t crc32c_soft(uint32_t crc, const char* data, size_t size)
+{
+    static const Crc32cTable t;
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    for(size_t i = 0; i < size; ++i)
+        crc = t.table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const char* data, size_t size)
+{
+    uint64_t c = crc;
+    while(size >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, data, 8);
+        c = _mm_crc32_u64(c, v);
+        data += 8;
+        size -= 8;
+    }
+    uint32_t c32 = static_cast<uint32_t>(c);
+    while(size > 0)
+    {
+        c32 = _mm_crc32_u8(c32, static_cast<unsigned char>(*data));
+        ++data;
+        --size;
+    }
+    return c32;
+}
+#endif
+
+string base64_decode(boost::beast::string_view in)
+{
+    string out;
+    out.resize(boost::beast::detail::base64::decoded_size(in.size()));
+    auto r = boost::beast::detail::base64::decode(&out[0], in.data(), in.size());
+    out.resize(r.first);
+    return out;
+}
+
+string base64_encode(const string& in)
+{
+    string out;
+    out.resize(boost::beast::detail::base64::encoded_size(in.size()));
+    out.resize(boost::beast::detail::base64::encode(&out[0], in.data(), in.size()));
+    return out;
+}
+
+boost::beast::string_view trim(boost::beast::string_view s)
+{
+    while(!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        s.remove_prefix(1);
+    while(!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        s.remove_suffix(1);
+    return s;
+}
+
+const char* digest_name(DIGEST_TYPE type)
+{
+    switch(type)
+    {
+    case DIGEST_TYPE::CRC32C: return "crc32c";
+    case DIGEST_TYPE::MD5: return "md5";
+    case DIGEST_TYPE::SHA256: return "sha-256";
+    default: return "";
+    }
+}
+}
+
+uint32_t crc32c_update(uint32_t crc, const char* data, size_t size)
+{
+    crc = ~crc;
+#if defined(__x86_64__)
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    if(has_sse42)
+        return ~crc32c_hw(crc, data, size);
+#endif
+    return ~crc32c_soft(crc, data, size);
+}
+
+UploadDigest::~UploadDigest()
+{
+    if(m_md_ctx)
+    {
+        EVP_MD_CTX_free(static_cast<EVP_MD_CTX*>(m_md_ctx));
+    }
+}
+
+bool UploadDigest::setExpected(DIGEST_TYPE type, boost::beast::string_view value)
+{
+    value = trim(value);
+    string raw;
+    //也接受8位十六进制; 4字节的base64同样是8个字符, 但以 '=' 结尾, 不会全是十六进制字符
+    bool hex = type == DIGEST_TYPE::CRC32C && value.size() == 8;
+    uint32_t v = 0;
+    for(size_t i = 0; hex && i < value.size(); ++i)
+    {
+        int h = kkurl::hex_value(value[i]);
+        if(h < 0)
+            hex = false;
+        v = (v << 4) | static_cast<uint32_t>(h);
+    }
+    if(hex)
+    {
+        raw = {static_cast<char>(v >> 24), static_cast<char>(v >> 16), static_cast<char>(v >> 8), static_cast<char>(v)};
+    }
+    else
+    {
+        raw = base64_decode(value);
+    }
+    size_t expect_len = type == DIGEST_TYPE::CRC32C ? 4 : (type == DIGEST_TYPE::MD5 ? 16 : 32);
+    if(raw.size() != expect_len)
+        return false;
+    //已有更快的算法时不替换
+    if(m_type != DIGEST_TYPE::NONE && m_type < type)
+        return true;
+    m_type = type;
+    m_expected = std::move(raw);
+    return true;
+}
+
+bool UploadDigest::init(const RequestFields& headers)
+{
+    bool ok = true;
+    auto it = headers.find("x-checksum-crc32c");
+    if(it != headers.end())
+        ok = setExpected(DIGEST_TYPE::CRC32C, it->value()) && ok;
+    it = headers.find("Content-MD5");
+    if(it != headers.end())
+        ok = setExpected(DIGEST_TYPE::MD5, it->value()) && ok;
+    it = headers.find("Digest");
+    if(it != headers.end())
+    {
+        //Digest: sha-256=xxx, md5=yyy  未知算法忽略
+        boost::beast::string_view list = it->value();
+        while(!list.empty())
+        {
+            size_t comma = list.find(',');
+            boost::beast::string_view item = trim(list.substr(0, comma));
+            list = comma == boost::beast::string_view::npos ? boost::beast::string_view() : list.substr(comma + 1);
+            size_t eq = item.find('=');
+            if(eq == boost::beast::string_view::npos)
+                continue;
+            boost::beast::string_view algo = item.substr(0, eq);
+            boost::beast::string_view value = item.substr(eq + 1);
+            if(boost::beast::iequals(algo, "crc32c"))
+                ok = setExpected(DIGEST_TYPE::CRC32C, value) && ok;
+            else if(boost::beast::iequals(algo, "md5"))
+                ok = setExpected(DIGEST_TYPE::MD5, value) && ok;
+            else if(boost::beast::iequals(algo, "sha-256"))
+                ok = setExpected(DIGEST_TYPE::SHA256, value) && ok;
+        }
+    }
+    if(!ok)
+    {
+        m_type = DIGEST_TYPE::NONE;
+        return false;
+    }
+
+    if(m_type == DIGEST_TYPE::MD5 || m_type == DIGEST_TYPE::SHA256)
+    {
+        EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(ctx, m_type == DIGEST_TYPE::MD5 ? EVP_md5() : EVP_sha256(), nullptr);
+        m_md_ctx = ctx;
+    }
+    return true;
+}
+
+void UploadDigest::update(const char* data, size_t size)
+{
+    if(m_type == DIGEST_TYPE::CRC32C)
+        m_crc = crc32c_update(m_crc, data, size);
+    else if(m_md_ctx)
+        EVP_DigestUpdate(static_cast<EVP_MD_CTX*>(m_md_ctx), data, size);
+}
+
+bool UploadDigest::verify()
+{
+    string actual;
+    if(m_type == DIGEST_TYPE::CRC32C)
+    {
+        actual = {static_cast<char>(m_crc >> 24), static_cast<char>(m_crc >> 16),
+                  static_cast<char>(m_crc >> 8), static_cast<char>(m_crc)};
+    }
+    else if(m_md_ctx)
+    {
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned int md_len = 0;
+        EVP_DigestFinal_ex(static_cast<EVP_MD_CTX*>(m_md_ctx), md, &md_len);
+        actual.assign(reinterpret_cast<char*>(md), md_len);
+    }
+    else
+    {
+        return true;
+    }
+    m_digest = string(digest_name(m_type)) + "=" + base64_encode(actual);
+    return actual == m_expected;
+}
@@ -0,0 +1,47 @@
+#ifndef UPLOAD_DIGEST_H
+#define UPLOAD_DIGEST_H
+
+#include "kconfig.h"
+
+enum class DIGEST_TYPE
+{
+    NONE = 0,
+    CRC32C = 1,
+    MD5 = 2,
+    SHA256 = 3
+};
+
+//CRC32C, 支持SSE4.2时使用crc32指令, 否则查表
+uint32_t crc32c_update(uint32_t crc, const char* data, size_t size);
+
+//上传数据的端到端校验
+//客户端通过 x-checksum-crc32c, Content-MD5, Digest(RFC 3230: crc32c/md5/sha-256) 提供校验值,
+//接收每个分片时增量计算, 完成时比较, 不一致的上传不会改名成正式文件
+class UploadDigest : private boost::noncopyable
+{
+public:
+    UploadDigest() = default;
+    ~UploadDigest();
+
+    //从请求头取出校验值, 同时提供多个时选择计算最快的, 格式错误返回false
+    bool init(const RequestFields& headers);
+    bool enabled() const { return m_type != DIGEST_TYPE::NONE; }
+
+    void update(const char* data, size_t size);
+    //计算结束并与客户端提供的值比较
+    bool verify();
+
+    //Digest 头格式的校验值 如 sha-256=base64, verify 之后有效
+    const string& digest() const { return m_digest; }
+
+private:
+    bool setExpected(DIGEST_TYPE type, boost::beast::string_view value);
+
+    DIGEST_TYPE m_type = DIGEST_TYPE::NONE;
+    string m_expected;      //原始字节
+    uint32_t m_crc = 0;
+    void* m_md_ctx = nullptr;   //EVP_MD_CTX
+    string m_digest;
+};
+
+#endif // UPLOAD_DIGEST_H
@@ -0,0 +1,396 @@
+#include "upload_file.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <atomic>
+
+namespace {
+//BUFFERED/DROP_CACHE 模式的用户态合并缓冲, 避免每个1K的body分片都产生一次系统调用
+const size_t PLAIN_BUFFER_SIZE = 64 * 1024;
+//DROP_CACHE 模式每写回这么多数据释放一次页缓存
+const int64_t DROP_CACHE_WINDOW = 8 * 1024 * 1024;
+}
+
+AlignedBufferPool& AlignedBufferPool::instance()
+{
+    static AlignedBufferPool pool;
+    return pool;
+}
+
+AlignedBufferPool::~AlignedBufferPool()
+{
+    for(char* buf : m_free_buffers)
+    {
+        ::free(buf);
+    }
+}
+
+void AlignedBufferPool::init(size_t buffer_size, size_t max_cached)
+{
+    std::lock_guard<std::mutex> lk(m_mutex);
+    for(char* buf : m_free_buffers)
+    {
+        ::free(buf);
+    }
+    m_free_buffers.clear();
+    m_buffer_size = std::max(ALIGNMENT, (buffer_size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT);
+    m_max_cached = max_cached;
+}
+
+char* AlignedBufferPool::get()
+{
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if(!m_free_buffers.empty())
+        {
+            char* buf = m_free_buffers.back();
+            m_free_buffers.pop_back();
+            return buf;
+        }
+    }
+    void* buf = nullptr;
+    if(::posix_memalign(&buf, ALIGNMENT, m_buffer_size) != 0)
+    {
+        throw std::bad_alloc();
+    }
+    return static_cast<char*>(buf);
+}
+
+void AlignedBufferPool::put(char* buf)
+{
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if(m_free_buffers.size() < m_max_cached)
+        {
+            m_free_buffers.push_back(buf);
+            return;
+        }
+    }
+    ::free(buf);
+}
+
+UploadFile::~UploadFile()
+{
+    abort();
+}
+
+bool UploadFile::open(const string& path, UPLOAD_IO_MODE mode, int64_t expect_size, bool anonymous, BSError& ec,
+                      int64_t offset)
+{
+    abort();
+    m_mode = mode;
+    m_path = path;
+    m_anonymous = false;
+    m_file_size = offset;
+    m_dropped = offset;
+    m_buf_used = 0;
+    if(offset > 0)
+    {
+        //续传只能用具名文件; O_DIRECT 的写入偏移必须对齐
+        anonymous = false;
+        if(m_mode == UPLOAD_IO_MODE::DIRECT && offset % AlignedBufferPool::ALIGNMENT != 0)
+            m_mode = UPLOAD_IO_MODE::DROP_CACHE;
+    }
+
+    int direct_flag = (m_mode == UPLOAD_IO_MODE::DIRECT) ? O_DIRECT : 0;
+    if(anonymous)
+    {
+        string dir = fs::path(path).parent_path().string();
+        m_fd = ::open(dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC | direct_flag, 0644);
+        if(m_fd < 0 && direct_flag && errno == EINVAL)
+        {
+            m_mode = UPLOAD_IO_MODE::DROP_CACHE;
+            direct_flag = 0;
+            m_fd = ::open(dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+        }
+        if(m_fd >= 0)
+        {
+            m_anonymous = true;
+        }
+        else
+        {
+            //文件系统不支持 O_TMPFILE, 退化为具名临时文件
+            LogWarnExt << "O_TMPFILE failed," << strerror(errno) << "," << dir;
+            m_path = path + ".tmp";
+        }
+    }
+
+    int flags = offset > 0 ? (O_WRONLY | O_CLOEXEC) : (O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+    if(m_fd < 0 && direct_flag)
+    {
+        m_fd = ::open(m_path.c_str(), flags | O_DIRECT, 0644);
+        if(m_fd < 0 && errno == EINVAL)
+        {
+            //tmpfs等文件系统不支持 O_DIRECT
+            LogWarnExt << "O_DIRECT not supported, use drop cache mode," << m_path;
+            m_mode = UPLOAD_IO_MODE::DROP_CACHE;
+            direct_flag = 0;
+        }
+    }
+    if(m_fd < 0 && !direct_flag)
+    {
+        m_fd = ::open(m_path.c_str(), flags, 0644);
+    }
+    if(m_fd < 0)
+    {
+        ec.assign(errno, boost::system::system_category());
+        LogErrorExt << "open failed," << ec.message() << "," << m_path;
+        return false;
+    }
+    //offset 之后可能是崩溃前没有落盘的残缺数据
+    if(offset > 0 && (::ftruncate(m_fd, offset) != 0 || ::lseek(m_fd, offset, SEEK_SET) != offset))
+    {
+        ec.assign(errno, boost::system::system_category());
+        LogErrorExt << "seek resume offset failed," << ec.message() << "," << m_path;
+        abort();
+        return false;
+    }
+
+    if(expect_size > offset)
+    {
+        //KEEP_SIZE: 只分配extent不改变文件长度, 失败或中断时文件长度仍是实际写入的长度
+        if(::fallocate(m_fd, FALLOC_FL_KEEP_SIZE, offset, expect_size - offset) != 0 &&
+                (errno == ENOSPC || errno == EDQUOT))
+        {
+            ec = boost::system::errc::make_error_code(boost::system::errc::no_space_on_device);
+            LogErrorExt << "fallocate no space," << expect_size << "," << m_path;
+            abort();
+            return false;
+        }
+    }
+
+    if(m_mode == UPLOAD_IO_MODE::DIRECT)
+    {
+        m_buf = AlignedBufferPool::instance().get();
+        m_buf_capacity = AlignedBufferPool::instance().bufferSize();
+    }
+    else
+    {
+        m_buf = new char[PLAIN_BUFFER_SIZE];
+        m_buf_capacity = PLAIN_BUFFER_SIZE;
+    }
+    return true;
+}
+
+bool UploadFile::write(const char* data, size_t size)
+{
+    if(m_fd < 0)
+        return false;
+    while(size > 0)
+    {
+        size_t n = std::min(size, m_buf_capacity - m_buf_used);
+        memcpy(m_buf + m_buf_used, data, n);
+        m_buf_used += n;
+        data += n;
+        size -= n;
+        if(m_buf_used == m_buf_capacity && !flush())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool UploadFile::writeAt(int64_t offset, const char* data, size_t size)
+{
+    if(m_fd < 0)
+        return false;
+    while(size > 0)
+    {
+        ssize_t n = ::pwrite(m_fd, data, size, offset);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            LogErrorExt << "pwrite failed," << strerror(errno);
+            return false;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+bool UploadFile::commit(const string& final_path)
+{
+    if(m_fd < 0)
+        return false;
+    if(!finish())
+    {
+        abort();
+        return false;
+    }
+
+    bool ok = true;
+    if(m_anonymous)
+    {
+        //linkat 不能覆盖已存在的文件, 这时先链接到同目录的临时名再 rename 覆盖, 读取方不会看到文件消失
+        string proc_path = "/proc/self/fd/" + std::to_string(m_fd);
+        int r = ::linkat(AT_FDCWD, proc_path.c_str(), AT_FDCWD, final_path.c_str(), AT_SYMLINK_FOLLOW);
+        if(r != 0 && errno == EEXIST)
+        {
+            static std::atomic<uint64_t> s_link_seq{0};
+            size_t slash = final_path.rfind('/');
+            string link_path = final_path.substr(0, slash + 1) + "." + final_path.substr(slash + 1) + "." +
+                    std::to_string(s_link_seq++) + ".link";
+            r = ::linkat(AT_FDCWD, proc_path.c_str(), AT_FDCWD, link_path.c_str(), AT_SYMLINK_FOLLOW);
+            if(r == 0 && (r = ::rename(link_path.c_str(), final_path.c_str())) != 0)
+            {
+                int err = errno;
+                ::unlink(link_path.c_str());
+                errno = err;
+            }
+        }
+        if(r != 0)
+        {
+            LogErrorExt << "linkat failed," << strerror(errno) << "," << final_path;
+            ok = false;
+        }
+    }
+    else if(::rename(m_path.c_str(), final_path.c_str()) != 0)
+    {
+        LogErrorExt << "rename failed," << strerror(errno) << "," << m_path << "," << final_path;
+        ok = false;
+    }
+
+    release();
+    if(!ok && !m_anonymous)
+    {
+        ::unlink(m_path.c_str());
+    }
+    return ok;
+}
+
+void UploadFile::abort()
+{
+    if(m_fd < 0)
+        return;
+    release();
+    //O_TMPFILE 的文件关闭后由内核回收
+    if(!m_anonymous)
+    {
+        ::unlink(m_path.c_str());
+    }
+}
+
+bool UploadFile::suspend(int64_t& offset)
+{
+    if(m_fd < 0)
+        return false;
+    if(!finish() || ::fdatasync(m_fd) != 0)
+    {
+        LogErrorExt << "suspend upload file failed," << strerror(errno) << "," << m_path;
+        return false;
+    }
+    offset = m_file_size;
+    release();
+    return true;
+}
+
+bool UploadFile::finish()
+{
+    bool ok = true;
+    if(m_mode == UPLOAD_IO_MODE::DIRECT && m_buf_used % AlignedBufferPool::ALIGNMENT != 0)
+    {
+        //尾部不足一个块,补齐写入后再截断到真实长度
+        int64_t real_size = m_file_size + m_buf_used;
+        size_t padded = (m_buf_used + AlignedBufferPool::ALIGNMENT - 1) / AlignedBufferPool::ALIGNMENT * AlignedBufferPool::ALIGNMENT;
+        memset(m_buf + m_buf_used, 0, padded - m_buf_used);
+        m_buf_used = padded;
+        ok = flushNow();
+        m_file_size = real_size;
+        if(ok && ::ftruncate(m_fd, real_size) != 0)
+        {
+            LogErrorExt << "ftruncate failed," << strerror(errno);
+            ok = false;
+        }
+    }
+    else
+    {
+        ok = flushNow();
+    }
+    if(ok && m_mode == UPLOAD_IO_MODE::DROP_CACHE)
+    {
+        dropWritten(true);
+    }
+    return ok;
+}
+
+void UploadFile::release()
+{
+    ::close(m_fd);
+    m_fd = -1;
+    if(m_buf && m_mode == UPLOAD_IO_MODE::DIRECT)
+    {
+        AlignedBufferPool::instance().put(m_buf);
+    }
+    else
+    {
+        delete[] m_buf;
+    }
+    m_buf = nullptr;
+    m_buf_capacity = 0;
+    m_buf_used = 0;
+}
+
+bool UploadFile::flush()
+{
+    if(m_buf_used == 0)
+        return true;
+    if(m_io_root)
+    {
+        return m_io_root->run([this]() { return flushNow(); });
+    }
+    return flushNow();
+}
+
+bool UploadFile::flushNow()
+{
+    if(!writeAll(m_buf, m_buf_used))
+        return false;
+    m_file_size += m_buf_used;
+    m_buf_used = 0;
+    if(m_mode == UPLOAD_IO_MODE::DROP_CACHE)
+    {
+        dropWritten(false);
+    }
+    return true;
+}
+
+bool UploadFile::writeAll(const char* data, size_t size)
+{
+    while(size > 0)
+    {
+        ssize_t n = ::write(m_fd, data, size);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            LogErrorExt << "write failed," << strerror(errno);
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+void UploadFile::dropWritten(bool final)
+{
+    //先异步发起刚写入数据的写回,攒够一个窗口后等待写回完成并丢弃这段页缓存
+    ::sync_file_range(m_fd, m_dropped, m_file_size - m_dropped, SYNC_FILE_RANGE_WRITE);
+    if(!final && m_file_size - m_dropped < DROP_CACHE_WINDOW)
+        return;
+    ::sync_file_range(m_fd, m_dropped, m_file_size - m_dropped,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    ::posix_fadvise(m_fd, m_dropped, m_file_size - m_dropped, POSIX_FADV_DONTNEED);
+    m_dropped = m_file_size;
+}
+
+UPLOAD_IO_MODE select_upload_io_mode(int64_t file_size)
+{
+    if(file_size < g_cfg->upload_io_threshold)
+        return UPLOAD_IO_MODE::BUFFERED;
+    return g_cfg->upload_io_mode;
+}
@@ -0,0 +1,92 @@
+#ifndef UPLOAD_FILE_H
+#define UPLOAD_FILE_H
+
+#include "kconfig.h"
+#include "storage.h"
+#include <mutex>
+
+//O_DIRECT 要求缓冲区地址,长度,文件偏移都按块对齐,缓冲区在所有线程间复用
+class AlignedBufferPool
+{
+public:
+    static AlignedBufferPool& instance();
+
+    //buffer_size 会向上对齐到 ALIGNMENT
+    void init(size_t buffer_size, size_t max_cached);
+    size_t bufferSize() const { return m_buffer_size; }
+
+    char* get();
+    void put(char* buf);
+
+    static constexpr size_t ALIGNMENT = 4096;
+
+private:
+    AlignedBufferPool() = default;
+    ~AlignedBufferPool();
+
+    std::mutex m_mutex;
+    vector<char*> m_free_buffers;
+    size_t m_buffer_size = 1024 * 1024;
+    size_t m_max_cached = 64;
+};
+
+//上传临时文件的写入,替代 ofstream
+//大文件使用 DIRECT 或 DROP_CACHE 模式,避免只下载一次的数据把热点小文件挤出页缓存
+//已知大小时用 fallocate 预分配连续extent; anonymous 模式使用 O_TMPFILE, 目录中不出现 .tmp 文件, 完成时 linkat 到最终路径
+class UploadFile : private boost::noncopyable
+{
+public:
+    UploadFile() = default;
+    ~UploadFile();
+
+    //anonymous 为 false 时 path 是临时文件路径, 为 true 时 path 是最终路径(只用来确定所在目录)
+    //预分配空间不足时 ec 为 no_space_on_device
+    //offset 大于0时续传: 打开已有的具名临时文件, 从 offset 处继续写
+    bool open(const string& path, UPLOAD_IO_MODE mode, int64_t expect_size, bool anonymous, BSError& ec,
+              int64_t offset = 0);
+    bool write(const char* data, size_t size);
+    //不经过缓冲直接 pwrite 到 offset 处, 只用于 BUFFERED 模式, 调用方负责在IO线程执行
+    bool writeAt(int64_t offset, const char* data, size_t size);
+    //刷出缓冲,文件改名或链接到 final_path 并关闭, 调用方负责在IO线程执行
+    bool commit(const string& final_path);
+    //关闭并删除未完成的文件
+    void abort();
+    //刷出缓冲并 fdatasync 后关闭, 保留文件以便续传, offset 为文件长度
+    bool suspend(int64_t& offset);
+
+    //设置后缓冲区刷盘在该盘的IO线程执行
+    void setIoQueue(const StorageRootPtr& root) { m_io_root = root; }
+
+    bool isOpen() const { return m_fd >= 0; }
+    int fd() const { return m_fd; }
+    //已交给内核的字节数, 不含用户态缓冲中的数据
+    int64_t written() const { return m_file_size; }
+    bool isAnonymous() const { return m_anonymous; }
+    UPLOAD_IO_MODE mode() const { return m_mode; }
+
+private:
+    bool finish();
+    void release();
+    bool flush();
+    bool flushNow();
+    bool writeAll(const char* data, size_t size);
+    void dropWritten(bool final);
+
+    int m_fd = -1;
+    string m_path;
+    StorageRootPtr m_io_root;
+    bool m_anonymous = false;
+    UPLOAD_IO_MODE m_mode = UPLOAD_IO_MODE::BUFFERED;
+
+    char* m_buf = nullptr;
+    size_t m_buf_capacity = 0;
+    size_t m_buf_used = 0;
+
+    int64_t m_file_size = 0;    //已交给内核的字节数
+    int64_t m_dropped = 0;      //DROP_CACHE 模式下已释放页缓存的位置
+};
+
+//根据配置与上传大小选择写入模式
+UPLOAD_IO_MODE select_upload_io_mode(int64_t file_size);
+
+#endif // UPLOAD_FILE_H
@@ -0,0 +1,352 @@
+#include "upload_journal.h"
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace {
+enum RECORD_TYPE : uint8_t
+{
+    RECORD_BEGIN = 1,
+    RECORD_CHECKPOINT = 2,
+    RECORD_END = 3
+};
+
+//日志超过这个大小时重写, 只保留未结束的会话
+const int64_t REWRITE_SIZE = 16 * 1024 * 1024;
+
+void put_u8(string& out, uint8_t v) { out.push_back(static_cast<char>(v)); }
+void put_u16(string& out, uint16_t v) { for(int i = 0; i < 2; ++i) out.push_back(static_cast<char>(v >> (8 * i))); }
+void put_u32(string& out, uint32_t v) { for(int i = 0; i < 4; ++i) out.push_back(static_cast<char>(v >> (8 * i))); }
+void put_i64(string& out, int64_t v) { for(int i = 0; i < 8; ++i) out.push_back(static_cast<char>(static_cast<uint64_t>(v) >> (8 * i))); }
+
+uint64_t get_le(const char* p, int bytes)
+{
+    uint64_t v = 0;
+    for(int i = 0; i < bytes; ++i)
+        v |= static_cast<uint64_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+    return v;
+}
+
+//payload 前加上长度与crc32
+void append_record(string& out, const string& payload)
+{
+    put_u32(out, static_cast<uint32_t>(payload.size()));
+    put_u32(out, static_cast<uint32_t>(::crc32(0L, reinterpret_cast<const Bytef*>(payload.data()), static_cast<uInt>(payload.size()))));
+    out.append(payload);
+}
+
+void append_begin(string& out, uint32_t id, const JournalEntry& e)
+{
+    string payload;
+    put_u8(payload, RECORD_BEGIN);
+    put_u32(payload, id);
+    put_u16(payload, static_cast<uint16_t>(e.root));
+    put_i64(payload, e.size);
+    put_i64(payload, e.offset);
+    put_u16(payload, static_cast<uint16_t>(e.rel_path.size()));
+    payload.append(e.rel_path);
+    append_record(out, payload);
+}
+
+void append_checkpoint(string& out, uint32_t id, int64_t offset)
+{
+    string payload;
+    put_u8(payload, RECORD_CHECKPOINT);
+    put_u32(payload, id);
+    put_i64(payload, offset);
+    append_record(out, payload);
+}
+
+void append_end(string& out, uint32_t id)
+{
+    string payload;
+    put_u8(payload, RECORD_END);
+    put_u32(payload, id);
+    append_record(out, payload);
+}
+
+bool write_all(int fd, const char* data, size_t size)
+{
+    while(size > 0)
+    {
+        ssize_t n = ::write(fd, data, size);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool read_file(const string& path, string& data)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return errno == ENOENT;
+    char buf[64 * 1024];
+    ssize_t n;
+    while((n = ::read(fd, buf, sizeof(buf))) > 0)
+    {
+        data.append(buf, n);
+    }
+    ::close(fd);
+    return n == 0;
+}
+
+//重放日志, 同一路径只保留最后开始的会话; 尾部残缺的记录是写入时崩溃造成的, 忽略
+void replay(const string& data, vector<JournalEntry>& unfinished)
+{
+    map<uint32_t, JournalEntry> sessions;
+    map<string, uint32_t> paths;
+    size_t pos = 0;
+    while(data.size() - pos >= 8)
+    {
+        uint32_t len = static_cast<uint32_t>(get_le(data.data() + pos, 4));
+        uint32_t crc = static_cast<uint32_t>(get_le(data.data() + pos + 4, 4));
+        if(len < 5 || data.size() - pos - 8 < len)
+            break;
+        const char* p = data.data() + pos + 8;
+        if(crc != static_cast<uint32_t>(::crc32(0L, reinterpret_cast<const Bytef*>(p), len)))
+            break;
+        pos += 8 + len;
+
+        uint8_t type = static_cast<uint8_t>(p[0]);
+        uint32_t id = static_cast<uint32_t>(get_le(p + 1, 4));
+        p += 5;
+        len -= 5;
+        if(type == RECORD_BEGIN && len >= 20)
+        {
+            JournalEntry e;
+            e.root = static_cast<size_t>(get_le(p, 2));
+            e.size = static_cast<int64_t>(get_le(p + 2, 8));
+            e.offset = static_cast<int64_t>(get_le(p + 10, 8));
+            size_t path_len = static_cast<size_t>(get_le(p + 18, 2));
+            if(len < 20 + path_len)
+                continue;
+            e.rel_path.assign(p + 20, path_len);
+            auto it = paths.find(e.rel_path);
+            if(it != paths.end())
+                sessions.erase(it->second);
+            paths[e.rel_path] = id;
+            sessions[id] = std::move(e);
+        }
+        else if(type == RECORD_CHECKPOINT && len >= 8)
+        {
+            auto it = sessions.find(id);
+            if(it != sessions.end())
+                it->second.offset = static_cast<int64_t>(get_le(p, 8));
+        }
+        else if(type == RECORD_END)
+        {
+            auto it = sessions.find(id);
+            if(it != sessions.end())
+            {
+                paths.erase(it->second.rel_path);
+                sessions.erase(it);
+            }
+        }
+    }
+    if(pos != data.size())
+    {
+        LogWarnExt << "upload journal tail ignored," << data.size() - pos;
+    }
+    for(auto& kv : sessions)
+    {
+        unfinished.push_back(kv.second);
+    }
+}
+}
+
+JournalSession::JournalSession(uint32_t id, int fd, const JournalEntry& entry) :
+    m_id(id), m_fd(fd), m_entry(entry), m_written(entry.offset), m_synced(entry.offset)
+{
+}
+
+JournalSession::~JournalSession()
+{
+    if(m_fd >= 0)
+        ::close(m_fd);
+}
+
+UploadJournal::UploadJournal(const string& path, int interval_ms) :
+    m_path(path), m_interval_ms(interval_ms)
+{
+}
+
+UploadJournal::~UploadJournal()
+{
+    if(m_thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_one();
+        m_thread.join();
+    }
+    if(m_fd >= 0)
+        ::close(m_fd);
+}
+
+bool UploadJournal::open(vector<JournalEntry>& unfinished)
+{
+    string data;
+    if(!read_file(m_path, data))
+    {
+        LogErrorExt << "read upload journal failed," << strerror(errno) << "," << m_path;
+        return false;
+    }
+    replay(data, unfinished);
+    for(const JournalEntry& e : unfinished)
+    {
+        m_dormant[e.rel_path] = std::make_pair(m_next_id++, e);
+    }
+    if(!rewrite())
+        return false;
+    LogInfo << "upload journal opened," << unfinished.size() << "," << m_path;
+    m_thread = std::thread([this]() { flushLoop(); });
+    return true;
+}
+
+JournalSessionPtr UploadJournal::begin(const JournalEntry& entry, int fd)
+{
+    int dup_fd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if(dup_fd < 0)
+    {
+        LogErrorExt << "dup upload file failed," << strerror(errno) << "," << entry.rel_path;
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lk(m_mutex);
+    JournalSessionPtr session(new JournalSession(m_next_id++, dup_fd, entry));
+    //新的开始记录覆盖同一路径之前的会话
+    m_dormant.erase(entry.rel_path);
+    m_sessions[session->m_id] = session;
+    append_begin(m_pending, session->m_id, entry);
+    return session;
+}
+
+void UploadJournal::end(const JournalSessionPtr& session)
+{
+    //结束记录不需要立即落盘, 崩溃后重放时临时文件已不存在的会话会被丢弃
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_sessions.erase(session->m_id);
+    append_end(m_pending, session->m_id);
+}
+
+void UploadJournal::suspend(const JournalSessionPtr& session, int64_t offset)
+{
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_sessions.erase(session->m_id);
+    JournalEntry entry = session->m_entry;
+    entry.offset = offset;
+    m_dormant[entry.rel_path] = std::make_pair(session->m_id, entry);
+    append_checkpoint(m_pending, session->m_id, offset);
+}
+
+void UploadJournal::remove(const string& rel_path)
+{
+    std::lock_guard<std::mutex> lk(m_mutex);
+    auto it = m_dormant.find(rel_path);
+    if(it == m_dormant.end())
+        return;
+    append_end(m_pending, it->second.first);
+    m_dormant.erase(it);
+}
+
+void UploadJournal::flushLoop()
+{
+    std::unique_lock<std::mutex> lk(m_mutex);
+    while(!m_stop)
+    {
+        m_cond.wait_for(lk, std::chrono::milliseconds(m_interval_ms));
+        lk.unlock();
+        flush();
+        lk.lock();
+    }
+}
+
+void UploadJournal::flush()
+{
+    string records;
+    vector<JournalSessionPtr> sessions;
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        records.swap(m_pending);
+        for(auto& kv : m_sessions)
+        {
+            sessions.push_back(kv.second);
+        }
+    }
+    //一个周期内所有上传共用一次日志同步
+    for(JournalSessionPtr& s : sessions)
+    {
+        int64_t written = s->m_written;
+        if(written <= s->m_synced)
+            continue;
+        if(::fdatasync(s->m_fd) != 0)
+        {
+            LogErrorExt << "fdatasync upload file failed," << strerror(errno) << "," << s->m_entry.rel_path;
+            continue;
+        }
+        s->m_synced = written;
+        append_checkpoint(records, s->m_id, written);
+    }
+    if(records.empty())
+        return;
+    if(!write_all(m_fd, records.data(), records.size()) || ::fdatasync(m_fd) != 0)
+    {
+        LogErrorExt << "write upload journal failed," << strerror(errno) << "," << m_path;
+        return;
+    }
+    m_journal_size += records.size();
+    if(m_journal_size > REWRITE_SIZE)
+    {
+        rewrite();
+    }
+}
+
+bool UploadJournal::rewrite()
+{
+    string data;
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        for(auto& kv : m_dormant)
+        {
+            append_begin(data, kv.second.first, kv.second.second);
+        }
+        for(auto& kv : m_sessions)
+        {
+            JournalEntry e = kv.second->m_entry;
+            e.offset = kv.second->m_synced;
+            append_begin(data, kv.first, e);
+        }
+    }
+    //写新文件后 rename, 任何时刻崩溃都有一份完整的日志
+    string new_path = m_path + ".new";
+    int fd = ::open(new_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0 || !write_all(fd, data.data(), data.size()) || ::fdatasync(fd) != 0 ||
+            ::rename(new_path.c_str(), m_path.c_str()) != 0)
+    {
+        LogErrorExt << "rewrite upload journal failed," << strerror(errno) << "," << m_path;
+        if(fd >= 0)
+            ::close(fd);
+        return false;
+    }
+    string dir = fs::path(m_path).parent_path().string();
+    int dir_fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dir_fd >= 0)
+    {
+        ::fsync(dir_fd);
+        ::close(dir_fd);
+    }
+    if(m_fd >= 0)
+        ::close(m_fd);
+    m_fd = fd;
+    m_journal_size = data.size();
+    return true;
+}
@@ -0,0 +1,88 @@
+#ifndef UPLOAD_JOURNAL_H
+#define UPLOAD_JOURNAL_H
+
+#include "kconfig.h"
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+//进程崩溃或客户端断开后可以续传的上传
+struct JournalEntry
+{
+    string rel_path;
+    size_t root = 0;
+    int64_t size = 0;       //文件总大小
+    int64_t offset = 0;     //已落盘的长度
+    time_t suspend_time = 0;    //开始等待续传的时间, 不写入日志
+};
+
+//一个正在写入的上传临时文件
+class JournalSession : private boost::noncopyable
+{
+public:
+    ~JournalSession();
+
+    //已交给内核的长度, 由接收线程在每次写入后更新, 刷盘线程按它记录检查点
+    void advance(int64_t written) { m_written = written; }
+
+private:
+    friend class UploadJournal;
+    JournalSession(uint32_t id, int fd, const JournalEntry& entry);
+
+    uint32_t m_id;
+    int m_fd;   //dup 的临时文件句柄, 上传关闭文件后刷盘线程仍可以安全 fdatasync
+    JournalEntry m_entry;
+    std::atomic<int64_t> m_written;
+    int64_t m_synced;
+};
+
+typedef std::shared_ptr<JournalSession> JournalSessionPtr;
+
+//上传会话的追加日志: 开始(路径, 大小, 起始偏移), 检查点(已落盘偏移), 结束
+//检查点由刷盘线程每隔 interval 毫秒成批生成: 先 fdatasync 各临时文件, 再一次写入日志并 fdatasync
+//接收数据时不产生任何同步IO
+//记录格式(小端): u32 长度, u32 crc32, u8 类型, u32 会话id, 类型相关字段
+class UploadJournal : private boost::noncopyable
+{
+public:
+    UploadJournal(const string& path, int interval_ms);
+    ~UploadJournal();
+
+    //重放日志得到未结束的上传, 压缩重写日志后启动刷盘线程
+    bool open(vector<JournalEntry>& unfinished);
+
+    //fd 为临时文件句柄, entry.offset 为续传的起始偏移
+    JournalSessionPtr begin(const JournalEntry& entry, int fd);
+    //上传提交或放弃后调用
+    void end(const JournalSessionPtr& session);
+    //客户端断开, 临时文件已同步到 offset, 会话保留等待续传
+    void suspend(const JournalSessionPtr& session, int64_t offset);
+    //放弃等待续传的上传
+    void remove(const string& rel_path);
+
+private:
+    void flushLoop();
+    void flush();
+    //日志过大时只保留未结束的会话
+    bool rewrite();
+
+    string m_path;
+    int m_interval_ms;
+    int m_fd = -1;
+    int64_t m_journal_size = 0;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_stop = false;
+    uint32_t m_next_id = 1;
+    string m_pending;
+    map<uint32_t, JournalSessionPtr> m_sessions;
+    //等待续传的上传 rel_path -> (id, entry)
+    map<string, std::pair<uint32_t, JournalEntry>> m_dormant;
+    std::thread m_thread;
+};
+
+typedef std::shared_ptr<UploadJournal> UploadJournalPtr;
+
+#endif // UPLOAD_JOURNAL_H
@@ -1,5 +1,8 @@
 #include "upload_task.h"
 #include "down_task.h"
+#include "compute_pool.h"
+#include <fcntl.h>
+#include <unistd.h>
 
 UploadTask::UploadTask(const TransportContext& cxt) : m_cxt(cxt)
 {
@@ -8,80 +11,399 @@ UploadTask::UploadTask(const TransportContext& cxt) : m_cxt(cxt)
 
 UploadTask::~UploadTask()
 {
-    if(m_ofs.is_open())
+    m_file.abort();
+}
+
+bool UploadTask::start(BSError& ec)
+{
+    m_file.setIoQueue(m_cxt.root);
+    vector<std::shared_ptr<string>> prefix;
+    if(!m_cxt.root->run([this, &ec, &prefix]() { return createFile(ec, prefix); }))
+        return false;
+    if(!prefix.empty())
+    {
+        std::lock_guard<boost::fibers::mutex> lk(m_buffers_mutex);
+        for(std::shared_ptr<string>& buf : prefix)
+        {
+            updateDigest(buf->data(), buf->size());
+            appendBuffer(buf);
+        }
+    }
+    //大小未知的上传无法续传
+    if(m_journal && m_cxt.file_size > 0 && !m_file.isAnonymous())
+    {
+        JournalEntry entry;
+        entry.rel_path = m_cxt.rel_path;
+        entry.root = m_cxt.root->index();
+        entry.size = m_cxt.file_size;
+        entry.offset = m_resume_offset;
+        m_session = m_journal->begin(entry, m_file.fd());
+    }
+    return true;
+}
+
+bool UploadTask::readPrefix(vector<std::shared_ptr<string>>& prefix)
+{
+    int fd = ::open(m_tmp_filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        LogErrorExt << "open resume file failed," << strerror(errno) << "," << m_tmp_filepath;
+        return false;
+    }
+    int64_t left = m_resume_offset;
+    while(left > 0)
     {
-        m_ofs.close();
+        auto buf = std::make_shared<string>(static_cast<size_t>(std::min<int64_t>(left, 1024 * 1024)), '\0');
+        ssize_t n = ::read(fd, &(*buf)[0], buf->size());
+        if(n <= 0)
+        {
+            LogErrorExt << "read resume file failed," << m_tmp_filepath;
+            ::close(fd);
+            return false;
+        }
+        buf->resize(n);
+        left -= n;
+        prefix.push_back(buf);
     }
+    ::close(fd);
+    return true;
 }
 
-void UploadTask::start()
+bool UploadTask::createFile(BSError& ec, vector<std::shared_ptr<string>>& prefix)
 {
     boost::system::error_code e;
-    fs::path tmp_path(m_cxt.file_path);
-    fs::remove(tmp_path, e);
-    tmp_path = m_tmp_filepath;
+    if(m_resume_offset > 0)
+    {
+        if(!readPrefix(prefix))
+        {
+            ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+            return false;
+        }
+        return m_file.open(m_tmp_filepath, select_upload_io_mode(m_cxt.file_size), m_cxt.file_size, false, ec,
+                           m_resume_offset);
+    }
+    //已存储的同名文件保留到 commit 时被 rename/linkat 替换, 上传期间与上传失败时仍可下载
+    fs::path tmp_path(m_tmp_filepath);
     fs::remove(tmp_path, e);
     tmp_path = m_cxt.file_dir;
     if(!boost::filesystem::is_directory(tmp_path, e))
     {
         boost::filesystem::create_directory(tmp_path, e);
     }
-    m_ofs.open(m_tmp_filepath, std::ios_base::binary);
+
+    //接收body前先检查剩余空间, multipart中的part大小未知(-1)时不检查
+    fs::space_info si = fs::space(tmp_path, e);
+    if(!e && m_cxt.file_size > 0 && static_cast<uintmax_t>(m_cxt.file_size) > si.available)
+    {
+        LogErrorExt << "no space for upload," << m_cxt.file_size << "," << si.available << "," << m_cxt.file_path;
+        ec = boost::system::errc::make_error_code(boost::system::errc::no_space_on_device);
+        return false;
+    }
+
+    bool anonymous = g_cfg->upload_tmpfile;
+    const string& open_path = anonymous ? m_cxt.file_path : m_tmp_filepath;
+    //分片按偏移乱序写入, 不能用 O_DIRECT 的对齐缓冲
+    UPLOAD_IO_MODE mode = m_parallel ? UPLOAD_IO_MODE::BUFFERED : select_upload_io_mode(m_cxt.file_size);
+    return m_file.open(open_path, mode, m_cxt.file_size, anonymous, ec);
 }
 
-void UploadTask::stop(STOP_REASEON r)
+bool UploadTask::stop(STOP_REASEON r)
 {
-    m_ofs.close();
-    if(r == STOP_REASEON::NORMAL)
+    bool ok = false;
+    std::unique_lock<boost::fibers::mutex> file_lk(m_file_mutex);
+    if(m_stopped)
+        return false;
+    m_stopped = true;
+    if(r == STOP_REASEON::NORMAL && !m_write_error && m_digest.enabled() && !m_digest.verify())
+    {
+        LogErrorExt << "upload digest mismatch," << m_digest.digest() << "," << m_cxt.file_path;
+        m_digest_mismatch = true;
+        r = STOP_REASEON::ERROR;
+    }
+    if(r == STOP_REASEON::NORMAL && !m_write_error)
     {
-        fs::path tmp_path(m_tmp_filepath);
-        fs::path new_path(m_cxt.file_path);
-        boost::system::error_code e;
-        fs::rename(tmp_path, new_path, e);
-        if(e)
+        ok = m_cxt.root->run([this]() {
+            if(!m_file.commit(m_cxt.file_path) || !stat_file_meta(m_cxt.file_path, m_cxt.root->index(), m_meta))
+                return false;
+            if(m_digest.enabled())
+            {
+                save_file_digest(m_cxt.file_path, m_digest.digest(), m_meta);
+            }
+            return true;
+        });
+        if(!ok)
         {
-            LogErrorExt << e.message() << "," << tmp_path << "," << new_path;
+            LogErrorExt << "commit upload file failed," << m_cxt.file_path;
         }
     }
+    else
+    {
+        m_file.abort();
+    }
+    if(m_session)
+    {
+        m_journal->end(m_session);
+        m_session.reset();
+    }
+    file_lk.unlock();
+    finishDownstream(ok);
+    return ok;
+}
 
+bool UploadTask::suspend(JournalEntry& entry)
+{
+    std::unique_lock<boost::fibers::mutex> file_lk(m_file_mutex);
+    if(m_stopped)
+        return false;
+    if(!m_session || m_write_error)
+    {
+        file_lk.unlock();
+        stop(STOP_REASEON::ERROR);
+        return false;
+    }
+    m_stopped = true;
+    int64_t offset = 0;
+    bool ok = m_cxt.root->run([this, &offset]() { return m_file.suspend(offset); });
+    if(ok)
+    {
+        m_journal->suspend(m_session, offset);
+        entry.rel_path = m_cxt.rel_path;
+        entry.root = m_cxt.root->index();
+        entry.size = m_cxt.file_size;
+        entry.offset = offset;
+        entry.suspend_time = time(nullptr);
+    }
+    else
+    {
+        m_file.abort();
+        m_journal->end(m_session);
+    }
+    m_session.reset();
+    file_lk.unlock();
+    finishDownstream(false);
+    return ok;
+}
+
+void UploadTask::finishDownstream(bool ok)
+{
+    vector<DownTaskPtr> down_tasks;
     {
         std::lock_guard<boost::fibers::mutex> lk(m_down_mutex);
-        for(DownTaskPtr& d : m_down_tasks)
-        {
-            d->stop();
-        }
+        m_down_finished = true;
+        m_down_complete = ok;
+        down_tasks = m_down_tasks;
     }
+    //上传失败时断开下载连接, 不发送结束标记, chunked 的下载方不会把不完整的数据当作完整文件
+    for(DownTaskPtr& d : down_tasks)
+    {
+        d->stop(ok);
+    }
+    //本地失败时中止复制, 对端丢弃
+    if(m_replicas)
+    {
+        m_replicated = m_replicas->finish(ok);
+    }
+}
+
+void UploadTask::cancel()
+{
+    m_cancelled = true;
+    stop(STOP_REASEON::ERROR);
 }
 
-void UploadTask::addDownTask(DownTaskPtr task)
+void UploadTask::setReplicas(const ReplicaGroupPtr& replicas)
 {
-    task->start();
+    //对端按 file_size 接收完整文件, 续传的前缀要先补发
+    std::lock_guard<boost::fibers::mutex> lk(m_buffers_mutex);
+    m_replicas = replicas;
+    if(!m_replicas)
+        return;
+    for(const std::shared_ptr<string>& buf : m_recv_buffers)
     {
+        m_replicas->send(buf);
+    }
+}
+
+void UploadTask::setReady(bool ok)
+{
+    {
+        std::lock_guard<boost::fibers::mutex> lk(m_ready_mutex);
+        m_ready = ok ? READY_STATE::READY : READY_STATE::FAILED;
+    }
+    m_ready_cond.notify_all();
+}
+
+bool UploadTask::waitReady()
+{
+    std::unique_lock<boost::fibers::mutex> lk(m_ready_mutex);
+    m_ready_cond.wait(lk, [this]() { return m_ready != READY_STATE::PENDING; });
+    return m_ready == READY_STATE::READY;
+}
+
+void UploadTask::appendBuffer(const std::shared_ptr<string>& pbuf)
+{
+    m_recv_buffers.push_back(pbuf);
+    m_recv_offsets.push_back(m_recv_total);
+    m_recv_times.push_back(std::chrono::duration_cast<std::chrono::milliseconds>(
+                               std::chrono::system_clock::now().time_since_epoch()).count());
+    m_recv_total += pbuf->size();
+}
+
+size_t UploadTask::findJoin(const DownJoin& join, size_t& skip) const
+{
+    skip = 0;
+    size_t count = m_recv_buffers.size();
+    switch(join.mode)
+    {
+    case DownJoin::OFFSET:
+    {
+        if(join.value >= m_recv_total)
+            return count;
+        //最后一个起始偏移不大于 value 的块
+        auto it = std::upper_bound(m_recv_offsets.begin(), m_recv_offsets.end(), join.value);
+        size_t i = static_cast<size_t>(it - m_recv_offsets.begin()) - 1;
+        skip = static_cast<size_t>(join.value - m_recv_offsets[i]);
+        return i;
+    }
+    case DownJoin::TIME:
+        return static_cast<size_t>(std::lower_bound(m_recv_times.begin(), m_recv_times.end(), join.value) -
+                                   m_recv_times.begin());
+    case DownJoin::LIVE_EDGE:
+        return count == 0 ? 0 : count - 1;
+    default:
+        return 0;
+    }
+}
+
+int64_t UploadTask::addDownTask(DownTaskPtr task, const DownJoin& join)
+{
+    bool finished = false;
+    bool complete = false;
+    int64_t start_offset = 0;
+    {
+        //与 recv 的入队在同一把锁内, 新加入的下载不会漏掉或重复数据
         std::lock_guard<boost::fibers::mutex> lk(m_buffers_mutex);
-        for(std::shared_ptr<string>& s : m_recv_buffers)
+        size_t skip = 0;
+        size_t first = findJoin(join, skip);
+        start_offset = first < m_recv_buffers.size() ? m_recv_offsets[first] + static_cast<int64_t>(skip) : m_recv_total;
+        int64_t skip_future = 0;
+        if(join.mode == DownJoin::OFFSET && join.value > start_offset)
+        {
+            //还没有收到的位置, 丢弃之后收到数据中 value 之前的部分
+            skip_future = join.value - start_offset;
+            start_offset = join.value;
+        }
+        task->setStartOffset(start_offset, skip_future);
+        task->start();
+        //只发送起点之后的块, 与已接收的总量无关
+        for(size_t i = first; i < m_recv_buffers.size(); ++i)
+        {
+            if(i == first && skip > 0)
+                task->send(std::make_shared<string>(m_recv_buffers[i]->substr(skip)));
+            else
+                task->send(m_recv_buffers[i]);
+        }
+        std::lock_guard<boost::fibers::mutex> down_lk(m_down_mutex);
+        if(m_down_finished)
+        {
+            finished = true;
+            complete = m_down_complete;
+        }
+        else
         {
-            task->send(s);
+            m_down_tasks.push_back(task);
         }
     }
+    if(finished)
     {
-        std::lock_guard<boost::fibers::mutex> lk(m_down_mutex);
-        m_down_tasks.push_back(task);
+        task->stop(complete);
     }
+    return start_offset;
 }
 
 void UploadTask::recv(string buf)
 {
-    m_ofs.write(buf.c_str(), buf.size());
-    std::shared_ptr<string> pbuf = std::make_shared<string>(std::move(buf));
     {
-        std::lock_guard<boost::fibers::mutex> lk(m_buffers_mutex);
-        m_recv_buffers.push_back(pbuf);
+        std::lock_guard<boost::fibers::mutex> lk(m_file_mutex);
+        if(m_stopped)
+            return;
+        if(!m_write_error && !m_file.write(buf.c_str(), buf.size()))
+        {
+            m_write_error = true;
+        }
+        updateDigest(buf.c_str(), buf.size());
+        if(m_session)
+        {
+            m_session->advance(m_file.written());
+        }
+    }
+    publish(std::make_shared<string>(std::move(buf)));
+}
+
+bool UploadTask::recvAt(int64_t offset, string buf)
+{
+    std::lock_guard<boost::fibers::mutex> lk(m_file_mutex);
+    if(m_stopped || m_write_error)
+        return false;
+    const char* data = buf.data();
+    size_t size = buf.size();
+    if(!m_cxt.root->run([this, offset, data, size]() { return m_file.writeAt(offset, data, size); }))
+    {
+        m_write_error = true;
+        return false;
     }
+    if(offset + static_cast<int64_t>(size) <= m_published)
+        return true;
+    //重传的分片可能与已有数据重叠, 内容相同
+    std::shared_ptr<string>& slot = m_pending[offset];
+    if(!slot || slot->size() < size)
+        slot = std::make_shared<string>(std::move(buf));
+    while(!m_pending.empty() && m_pending.begin()->first <= m_published)
     {
-        std::lock_guard<boost::fibers::mutex> lk(m_down_mutex);
+        auto it = m_pending.begin();
+        std::shared_ptr<string> piece = it->second;
+        int64_t end = it->first + static_cast<int64_t>(piece->size());
+        if(end > m_published)
+        {
+            if(it->first < m_published)
+                piece = std::make_shared<string>(piece->substr(static_cast<size_t>(m_published - it->first)));
+            updateDigest(piece->data(), piece->size());
+            m_published = end;
+            publish(piece);
+        }
+        m_pending.erase(it);
+    }
+    return true;
+}
+
+void UploadTask::updateDigest(const char* data, size_t size)
+{
+    //小块切换线程的开销比计算本身大
+    const size_t OFFLOAD_SIZE = 16 * 1024;
+    if(!m_digest.enabled())
+        return;
+    if(size < OFFLOAD_SIZE || !ComputePool::instance().enabled())
+    {
+        m_digest.update(data, size);
+        return;
+    }
+    ComputePool::instance().run([this, data, size]() { m_digest.update(data, size); });
+}
+
+void UploadTask::publish(const std::shared_ptr<string>& pbuf)
+{
+    {
+        std::lock_guard<boost::fibers::mutex> lk(m_buffers_mutex);
+        appendBuffer(pbuf);
+        std::lock_guard<boost::fibers::mutex> down_lk(m_down_mutex);
         for(DownTaskPtr& d : m_down_tasks)
         {
             d->send(pbuf);
         }
     }
+    //只入队, 不等待对端
+    if(m_replicas)
+    {
+        m_replicas->send(pbuf);
+    }
 }
@@ -2,6 +2,11 @@
 #define UPLOAD_TASK_H
 #include "kconfig.h"
 #include "transport_server.h"
+#include "upload_file.h"
+#include "file_index.h"
+#include "upload_digest.h"
+#include "replicator.h"
+#include "upload_journal.h"
 
 enum class STOP_REASEON
 {
@@ -12,27 +17,127 @@ enum class STOP_REASEON
 class DownTask;
 typedef std::shared_ptr<DownTask> DownTaskPtr;
 
+//边上传边下载时下载方从哪里开始接收
+struct DownJoin
+{
+    enum MODE
+    {
+        BEGIN,      //从头发送已接收的全部数据
+        OFFSET,     //从 value 字节处开始
+        TIME,       //从 value(unix毫秒) 之后收到的数据开始
+        LIVE_EDGE   //从最近收到的一块开始
+    };
+    MODE mode = BEGIN;
+    int64_t value = 0;
+};
+
 class UploadTask : public std::enable_shared_from_this<UploadTask>
 {
 public:
     UploadTask(const TransportContext& cxt);
     virtual ~UploadTask();
-    int getFileSize() {return m_cxt.file_size; }
-    void start();
-    void stop(STOP_REASEON r);
+    int64_t getFileSize() {return m_cxt.file_size; }
+    //回源任务在源站应答后才知道大小, 必须在 start 之前调用
+    void setFileSize(int64_t size) { m_cxt.file_size = size; }
+    //stop(NORMAL) 成功后有效, ETag 在此时计算一次, 之后由索引直接提供
+    const FileMeta& getFileMeta() { return m_meta; }
+    //请求头中带校验值时开启校验, 校验头格式错误返回false
+    bool initDigest(const RequestFields& headers) { return m_digest.init(headers); }
+    bool digestMismatch() const { return m_digest_mismatch; }
+    //磁盘空间不足时 ec 为 no_space_on_device
+    bool start(BSError& ec);
+    //NORMAL 时返回文件是否成功落盘; 只有第一次调用生效
+    bool stop(STOP_REASEON r);
+    //客户端断开时调用, 已接收的数据同步到磁盘并保留, entry 为续传信息
+    //没有记录上传日志或已被中止时等同 stop(ERROR), 返回false
+    bool suspend(JournalEntry& entry);
+    //文件被删除或被新的上传替换时由其他请求调用, 之后上传方的 stop 返回false
+    void cancel();
+    bool cancelled() const { return m_cancelled; }
+
+    //记录到上传日志, 崩溃后可以续传; 必须在 start 之前设置
+    void setJournal(const UploadJournalPtr& journal) { m_journal = journal; }
+    //从崩溃前已落盘的 offset 处续传, 必须在 start 之前设置
+    void setResumeOffset(int64_t offset) { m_resume_offset = offset; }
+
+    //收到的数据同时转发给对端, 必须在第一次 recv 之前设置; 续传时 start 读入的前缀先发给对端
+    void setReplicas(const ReplicaGroupPtr& replicas);
+    //stop(NORMAL) 后有效, 满足复制的ack要求
+    bool replicated() const { return m_replicated; }
 
-    void addDownTask(DownTaskPtr task);
+    //回源任务注册时还没有数据, 其他下载请求等待源站应答后再加入
+    void setPending() { m_ready = READY_STATE::PENDING; }
+    void setReady(bool ok);
+    //源站应答200并开始接收后返回true
+    bool waitReady();
+
+    //并行分片上传, 文件按 BUFFERED 模式打开, 必须在 start 之前设置
+    void setParallel() { m_parallel = true; }
+    //分片数据写到 offset 处; 已连续的前缀按顺序发给下载方, 复制与校验
+    bool recvAt(int64_t offset, string buf);
+
+    //返回下载开始的偏移, 不从头开始时下载使用chunked
+    int64_t addDownTask(DownTaskPtr task, const DownJoin& join = DownJoin());
     void recv(string buf);
 
 private:
+    bool createFile(BSError& ec, vector<std::shared_ptr<string>>& prefix);
+    //读出续传前已有的数据, 边上传边下载的请求需要从头发送
+    bool readPrefix(vector<std::shared_ptr<string>>& prefix);
+    //结束下载与复制
+    void finishDownstream(bool ok);
+    //按文件顺序的一段数据, 发给下载方与对端
+    void publish(const std::shared_ptr<string>& pbuf);
+    //按文件顺序累加校验, 大块在计算线程执行
+    void updateDigest(const char* data, size_t size);
+    //加入已接收数据, 调用方持有 m_buffers_mutex
+    void appendBuffer(const std::shared_ptr<string>& pbuf);
+    //join 对应的第一块下标与块内偏移, 调用方持有 m_buffers_mutex
+    size_t findJoin(const DownJoin& join, size_t& skip) const;
+
+    enum class READY_STATE
+    {
+        PENDING,
+        READY,
+        FAILED
+    };
+
     TransportContext m_cxt;
     string m_tmp_filepath;
     std::vector<std::shared_ptr<string>> m_recv_buffers;
+    //每块的起始偏移与接收时间(unix毫秒), 晚加入的下载按它二分查找起点
+    std::vector<int64_t> m_recv_offsets;
+    std::vector<int64_t> m_recv_times;
+    int64_t m_recv_total = 0;
     boost::fibers::mutex m_buffers_mutex;
 
     boost::fibers::mutex m_down_mutex;
     vector<DownTaskPtr> m_down_tasks;
-    ofstream m_ofs;
+    //stop 之后加入的下载直接发完已接收的数据
+    bool m_down_finished = false;
+    bool m_down_complete = false;
+    boost::fibers::mutex m_ready_mutex;
+    boost::fibers::condition_variable m_ready_cond;
+    READY_STATE m_ready = READY_STATE::READY;
+    //stop 可能由删除请求在其他线程调用, 与 recv 的写文件互斥
+    boost::fibers::mutex m_file_mutex;
+    std::atomic_bool m_stopped{false};
+    std::atomic_bool m_cancelled{false};
+    UploadFile m_file;
+    bool m_write_error = false;
+    FileMeta m_meta;
+    UploadDigest m_digest;
+    ReplicaGroupPtr m_replicas;
+    UploadJournalPtr m_journal;
+    JournalSessionPtr m_session;
+    int64_t m_resume_offset = 0;
+    bool m_parallel = false;
+    //并行上传中已写入但前面还有空洞的数据, key为偏移
+    map<int64_t, std::shared_ptr<string>> m_pending;
+    //已按顺序发布的长度
+    int64_t m_published = 0;
+    bool m_replicated = true;
+    bool m_digest_mismatch = false;
 };
 
 #endif // UPLOADTASK_H
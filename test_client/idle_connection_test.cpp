@@ -0,0 +1,173 @@
+//------------------------------------------------------------------------------
+//
+// 空闲连接内存测试: 启动一个 file_transfer_server, 打开 N 个 keep-alive 连接,
+// 每个连接完成一个请求后保持空闲(栈 + multi_buffer + 解析器), 服务进程 RSS 的增量除以 N 超过预算时失败
+//
+//------------------------------------------------------------------------------
+
+#include "server_probe.h"
+#include <iostream>
+#include <map>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+using namespace probe;
+using namespace std;
+
+namespace {
+//测试自己设置的配置项, 原配置文件中的同名项被去掉
+const map<string, string> OVERRIDES = {
+    {"thread_pool", "1"},
+    {"http_listen_addr", "127.0.0.1"},
+    {"storage_roots", ""},
+    {"segment_threshold", "0"},
+    {"tls_enable", "false"},
+    {"upload_journal", ""},
+    {"replica_peers", ""},
+    {"cluster_file", ""},
+    {"origin_url", ""},
+    {"log_level", "error"},
+};
+
+string config_key(const string& line)
+{
+    size_t begin = line.find_first_not_of(" \t");
+    if(begin == string::npos || line[begin] == '#')
+        return string();
+    size_t end = line.find_first_of(" \t=", begin);
+    return line.substr(begin, end == string::npos ? string::npos : end - begin);
+}
+
+//复制 config_file, 端口, 存储目录与日志换成测试的
+bool write_config(const string& config_file, const string& out_file, const string& root_dir, unsigned short port)
+{
+    map<string, string> overrides = OVERRIDES;
+    overrides["http_listen_port"] = to_string(port);
+    overrides["root_dir"] = root_dir;
+    overrides["log_path"] = root_dir + "/server.log";
+
+    ifstream in(config_file);
+    if(!in)
+        return false;
+    ofstream out(out_file);
+    string line;
+    while(getline(in, line))
+    {
+        if(overrides.count(config_key(line)) == 0)
+            out << line << "\n";
+    }
+    for(auto& kv : overrides)
+        out << kv.first << " = " << kv.second << "\n";
+    return static_cast<bool>(out);
+}
+
+unsigned short free_port(boost::asio::io_context& ioc)
+{
+    tcp::acceptor acceptor(ioc, tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), 0));
+    return acceptor.local_endpoint().port();
+}
+
+//等待服务开始监听, 服务提前退出时返回false
+bool wait_listen(boost::asio::io_context& ioc, pid_t pid, const tcp::endpoint& ep)
+{
+    for(int i = 0; i < 100; ++i)
+    {
+        int status = 0;
+        if(waitpid(pid, &status, WNOHANG) == pid)
+            return false;
+        boost::system::error_code ec;
+        tcp::socket s(ioc);
+        s.connect(ep, ec);
+        if(!ec)
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return false;
+}
+}
+
+int main(int argc, char** argv)
+{
+    if(argc != 5)
+    {
+        std::cerr <<
+                     "Usage: idle_connection_test <server binary> <config file> <connections> <budget bytes>\n" <<
+                     "Example:\n" <<
+                     "idle_connection_test ./file_transfer_server ../config/file_transport_server.cfg 5000 32768\n";
+        return EXIT_FAILURE;
+    }
+    string const server = argv[1];
+    string const config_file = argv[2];
+    int const count = atoi(argv[3]);
+    int64_t const budget = atoll(argv[4]);
+
+    //客户端与服务端各需要 count 个fd, 服务进程继承这个限制
+    rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    char dir_template[] = "/tmp/fts_idle_XXXXXX";
+    if(!mkdtemp(dir_template))
+    {
+        std::cerr << "mkdtemp failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    string const root_dir = dir_template;
+    pid_t pid = -1;
+    int64_t idle_rss = -1;
+    try
+    {
+        boost::filesystem::create_directories(root_dir + "/idle");
+        ofstream(root_dir + "/idle/small.txt") << string(512, 'x');
+
+        boost::asio::io_context ioc;
+        unsigned short const port = free_port(ioc);
+        string const test_config = root_dir + "/server.cfg";
+        if(!write_config(config_file, test_config, root_dir, port))
+            throw std::runtime_error("write config failed, " + config_file);
+
+        pid = fork();
+        if(pid == 0)
+        {
+            execl(server.c_str(), server.c_str(), "-c", test_config.c_str(), static_cast<char*>(nullptr));
+            _exit(127);
+        }
+        if(pid < 0)
+            throw std::runtime_error("fork failed");
+
+        tcp::endpoint const ep(boost::asio::ip::make_address("127.0.0.1"), port);
+        if(!wait_listen(ioc, pid, ep))
+            throw std::runtime_error("server did not start, see " + root_dir + "/server.log");
+
+        auto const req = make_request("127.0.0.1", "/idle/small.txt");
+        vector<std::unique_ptr<Connection>> conns;
+        tcp::resolver resolver{ioc};
+        idle_rss = open_idle_connections(ioc, resolver.resolve("127.0.0.1", to_string(port)), req, pid, count, conns);
+    }
+    catch(std::exception const& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+    }
+    if(pid > 0)
+    {
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+    }
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(root_dir, ec);
+    if(idle_rss < 0)
+        return EXIT_FAILURE;
+
+    cout << "connections:" << count << ",idle rss per connection:" << idle_rss << " bytes,budget:" << budget << "\n";
+    if(idle_rss > budget)
+    {
+        std::cerr << "idle connection memory over budget" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,178 @@
+//------------------------------------------------------------------------------
+//
+// url解析的微基准: kkurl::parse_target 与 kkurl::QueryParams
+// 对比原来的 parseTarget 与 parseQueryString (复制 std::string, 结果放在 unordered_multimap 中)
+// 每组 target 先检查两种实现的解析结果一致, 再各自循环解析, 输出每次解析的纳秒数
+//
+//------------------------------------------------------------------------------
+
+#include "url_parser.hpp"
+#include "web_utility.hpp"
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+namespace {
+//以下是改动前 FileTransportServer 中的实现
+string old_decode(const string &value)
+{
+    string result;
+    result.reserve(value.size());
+
+    for(size_t i = 0; i < value.size(); ++i) {
+        auto &chr = value[i];
+        if(chr == '%' && i + 2 < value.size()) {
+            auto hex = value.substr(i + 1, 2);
+            auto decoded_chr = static_cast<char>(std::strtol(hex.c_str(), nullptr, 16));
+            result += decoded_chr;
+            i += 2;
+        }
+        else if(chr == '+')
+            result += ' ';
+        else
+            result += chr;
+    }
+
+    return result;
+}
+
+bool old_parse_target(const boost::beast::string_view& target, string &path, string &query_string)
+{
+    size_t query_start = target.find('?');
+    if(query_start != boost::beast::string_view::npos)
+    {
+        path = target.substr(0, query_start).to_string();
+        query_string = target.substr(query_start + 1).to_string();
+    }
+    else
+    {
+        path = target.to_string();
+    }
+    return true;
+}
+
+CaseInsensitiveMultimap old_parse_query_string(const string &query_string)
+{
+    CaseInsensitiveMultimap result;
+
+    if(query_string.empty())
+        return result;
+
+    size_t name_pos = 0;
+    size_t name_end_pos = -1;
+    size_t value_pos = -1;
+    for(size_t c = 0; c < query_string.size(); ++c) {
+        if(query_string[c] == '&') {
+            auto name = query_string.substr(name_pos, (name_end_pos == string::npos ? c : name_end_pos) - name_pos);
+            if(!name.empty()) {
+                auto value = value_pos == string::npos ? string() : query_string.substr(value_pos, c - value_pos);
+                result.emplace(std::move(name), old_decode(value));
+            }
+            name_pos = c + 1;
+            name_end_pos = -1;
+            value_pos = -1;
+        }
+        else if(query_string[c] == '=') {
+            name_end_pos = c;
+            value_pos = c + 1;
+        }
+    }
+    if(name_pos < query_string.size()) {
+        auto name = query_string.substr(name_pos, name_end_pos - name_pos);
+        if(!name.empty()) {
+            auto value = value_pos >= query_string.size() ? string() : query_string.substr(value_pos);
+            result.emplace(std::move(name), old_decode(value));
+        }
+    }
+
+    return result;
+}
+
+//两种实现对同一个 target 的结果是否一致
+bool same_result(const string& target)
+{
+    string old_path, old_query;
+    old_parse_target(target, old_path, old_query);
+    auto old_params = old_parse_query_string(old_query);
+
+    boost::beast::string_view path, query;
+    kkurl::parse_target(target, path, query);
+    kkurl::QueryParams params;
+    params.parse(query);
+
+    if(path != old_path || query != old_query || params.size() != old_params.size())
+        return false;
+    for(size_t i = 0; i < params.size(); ++i)
+    {
+        auto range = old_params.equal_range(params.name(i).to_string());
+        bool found = false;
+        for(auto it = range.first; it != range.second && !found; ++it)
+            found = it->second == params.value(i);
+        if(!found)
+            return false;
+    }
+    return true;
+}
+
+template<class F>
+double ns_per_call(size_t rounds, F&& f)
+{
+    auto const t0 = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < rounds; ++i)
+        f();
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / rounds;
+}
+
+//防止编译器把解析结果优化掉
+volatile size_t g_sink;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc > 2)
+    {
+        std::cerr <<
+                     "Usage: parse_bench [rounds]\n" <<
+                     "Example:\n" <<
+                     "parse_bench 1000000\n";
+        return EXIT_FAILURE;
+    }
+    size_t const rounds = argc == 2 ? static_cast<size_t>(atoll(argv[1])) : 1000000;
+
+    //服务实际收到的几类 target: 无参数, 上传续传, 带百分号编码的文件名, 较长的参数串
+    const vector<string> targets = {
+        "/data/files/report.pdf",
+        "/data/upload/video.mp4?offset=1048576&size=52428800",
+        "/data/files/%E6%8A%A5%E5%91%8A.pdf?name=%E6%8A%A5%E5%91%8A+2024.pdf&overwrite=1",
+        "/data/list?dir=%2Fdata%2Fphotos%2F2024&recursive=1&page=3&page_size=200&sort=mtime&order=desc&fields=name,size,mtime,etag",
+    };
+
+    for(const string& target : targets)
+    {
+        if(!same_result(target))
+        {
+            std::cerr << "result mismatch: " << target << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    for(const string& target : targets)
+    {
+        double const old_ns = ns_per_call(rounds, [&]() {
+            string path, query;
+            old_parse_target(target, path, query);
+            g_sink = path.size() + old_parse_query_string(query).size();
+        });
+        double const new_ns = ns_per_call(rounds, [&]() {
+            boost::beast::string_view path, query;
+            kkurl::parse_target(target, path, query);
+            kkurl::QueryParams params;
+            params.parse(query);
+            g_sink = path.size() + params.size();
+        });
+        cout << target << "\n  old:" << old_ns << " ns,new:" << new_ns << " ns,speedup:" << old_ns / new_ns << "x\n";
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,137 @@
+#ifndef SERVER_PROBE_H
+#define SERVER_PROBE_H
+
+//session_bench 与 idle_connection_test 共用: 读服务进程的 /proc 统计, 同步 keep-alive 连接
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/version.hpp>
+#include <boost/asio/connect.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/filesystem.hpp>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+namespace probe {
+
+using tcp = boost::asio::ip::tcp;
+namespace http = boost::beast::http;
+
+//进程常驻内存, 字节
+inline int64_t process_rss(int pid)
+{
+    std::ifstream in("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while(getline(in, line))
+    {
+        if(line.compare(0, 6, "VmRSS:") == 0)
+            return atoll(line.c_str() + 6) * 1024;
+    }
+    return -1;
+}
+
+//进程用户态加内核态CPU时间, 微秒
+inline int64_t process_cpu_us(int pid)
+{
+    std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+    std::string stat((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    //进程名可能含空格, 从最后一个 ')' 之后按字段取, utime stime 是第14,15个字段
+    std::istringstream fields(stat.substr(stat.rfind(')') + 2));
+    std::string field;
+    int64_t utime = 0;
+    int64_t stime = 0;
+    for(int i = 3; i <= 15 && fields >> field; ++i)
+    {
+        if(i == 14)
+            utime = atoll(field.c_str());
+        else if(i == 15)
+            stime = atoll(field.c_str());
+    }
+    return (utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+//所有线程的内核上下文切换次数(自愿加非自愿)
+inline int64_t process_ctx_switches(int pid)
+{
+    int64_t total = 0;
+    boost::filesystem::path dir("/proc/" + std::to_string(pid) + "/task");
+    for(auto& entry : boost::filesystem::directory_iterator(dir))
+    {
+        std::ifstream in((entry.path() / "status").string());
+        std::string line;
+        while(getline(in, line))
+        {
+            if(line.find("ctxt_switches:") != std::string::npos)
+                total += atoll(line.c_str() + line.find(':') + 1);
+        }
+    }
+    return total;
+}
+
+struct Connection
+{
+    explicit Connection(boost::asio::io_context& ioc) : socket(ioc) {}
+    tcp::socket socket;
+    boost::beast::flat_buffer buffer;
+};
+
+inline http::request<http::empty_body> make_request(const std::string& host, const std::string& target)
+{
+    http::request<http::empty_body> req{http::verb::get, target, 11};
+    req.set(http::field::host, host);
+    req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+    req.keep_alive(true);
+    return req;
+}
+
+inline void write_request(Connection& c, const http::request<http::empty_body>& req)
+{
+    http::write(c.socket, req);
+}
+
+inline void read_response(Connection& c)
+{
+    http::response<http::string_body> res;
+    http::read(c.socket, c.buffer, res);
+    if(res.result() != http::status::ok)
+        throw std::runtime_error("unexpected status " + std::to_string(res.result_int()));
+}
+
+//先预热, 服务端的栈缓存, 分配器与索引进入稳定状态
+//再打开 count 个连接, 每个完成一个请求后保持空闲, 返回服务进程 RSS 的增量除以 count
+inline int64_t open_idle_connections(boost::asio::io_context& ioc, const tcp::resolver::results_type& endpoints,
+                                     const http::request<http::empty_body>& req, int pid, int count,
+                                     std::vector<std::unique_ptr<Connection>>& conns)
+{
+    for(int i = 0; i < 100; ++i)
+    {
+        Connection c(ioc);
+        boost::asio::connect(c.socket, endpoints);
+        write_request(c, req);
+        read_response(c);
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+
+    int64_t const rss0 = process_rss(pid);
+    conns.reserve(conns.size() + count);
+    for(int i = 0; i < count; ++i)
+    {
+        conns.emplace_back(new Connection(ioc));
+        boost::asio::connect(conns.back()->socket, endpoints);
+        write_request(*conns.back(), req);
+        read_response(*conns.back());
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    return (process_rss(pid) - rss0) / count;
+}
+
+}
+
+#endif // SERVER_PROBE_H
@@ -0,0 +1,72 @@
+//------------------------------------------------------------------------------
+//
+// 连接开销测量: 对运行中的 file_transfer_server 打开 N 个 keep-alive 连接
+// 1. 每个连接完成一个请求后保持空闲, 服务进程 RSS 的增量除以 N 为每个空闲连接的内存
+// 2. 之后每轮在所有连接上各发一个请求再读回应答, 服务进程的CPU时间与内核上下文切换次数除以请求数
+// 用同一个文件分别测 fiber 构建与 fts_awaitable 构建
+//
+//------------------------------------------------------------------------------
+
+#include "server_probe.h"
+#include <iostream>
+
+using namespace probe;
+using namespace std;
+
+int main(int argc, char** argv)
+{
+    if(argc != 7)
+    {
+        std::cerr <<
+                     "Usage: session_bench <host> <port> <server pid> <target> <connections> <rounds>\n" <<
+                     "Example:\n" <<
+                     "session_bench 127.0.0.1 2180 12345 /bench/small.txt 5000 20\n";
+        return EXIT_FAILURE;
+    }
+    auto const host = argv[1];
+    auto const port = argv[2];
+    int const pid = atoi(argv[3]);
+    string const target = argv[4];
+    int const count = atoi(argv[5]);
+    int const rounds = atoi(argv[6]);
+
+    try
+    {
+        boost::asio::io_context ioc;
+        tcp::resolver resolver{ioc};
+        auto const endpoints = resolver.resolve(host, port);
+
+        auto const req = make_request(host, target);
+        vector<std::unique_ptr<Connection>> conns;
+        int64_t const idle_rss = open_idle_connections(ioc, endpoints, req, pid, count, conns);
+
+        int64_t const cpu0 = process_cpu_us(pid);
+        int64_t const ctx0 = process_ctx_switches(pid);
+        auto const t0 = std::chrono::steady_clock::now();
+        for(int r = 0; r < rounds; ++r)
+        {
+            //先在所有连接上发出请求, 服务端同时有 N 个请求在处理
+            for(auto& c : conns)
+                write_request(*c, req);
+            for(auto& c : conns)
+                read_response(*c);
+        }
+        auto const t1 = std::chrono::steady_clock::now();
+        int64_t const cpu1 = process_cpu_us(pid);
+        int64_t const ctx1 = process_ctx_switches(pid);
+
+        double const requests = static_cast<double>(count) * rounds;
+        cout << "connections:" << count << ",rounds:" << rounds << "\n"
+             << "idle rss per connection:" << idle_rss << " bytes\n"
+             << "server cpu per request:" << (cpu1 - cpu0) / requests << " us\n"
+             << "server context switches per request:" << (ctx1 - ctx0) / requests << "\n"
+             << "requests per second:"
+             << requests / std::chrono::duration<double>(t1 - t0).count() << "\n";
+    }
+    catch(std::exception const& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,166 @@
+//------------------------------------------------------------------------------
+//
+// 倾斜负载下的尾延迟: 对运行中的 file_transfer_server
+// 1. 先在每个网络线程上各一个连接轮流发小文件GET, 得到空载时的延迟分布
+// 2. 再发起 K 个带 sha-256 校验的大上传, 全部落在同一个网络线程上, 上传期间同样测小文件GET的延迟
+// 服务按接受顺序轮流分配 io_context, 客户端按顺序建立连接来控制连接落在哪个线程
+// 分别用 compute_threads = 0 与 compute_threads > 0 启动服务比较
+//
+//------------------------------------------------------------------------------
+
+#include "server_probe.h"
+#include <boost/beast/core/detail/base64.hpp>
+#include <openssl/sha.h>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <random>
+
+using namespace probe;
+using namespace std;
+
+namespace {
+struct Latency
+{
+    vector<double> us;
+
+    void print(const char* name)
+    {
+        if(us.empty())
+            return;
+        sort(us.begin(), us.end());
+        auto at = [this](double q) { return us[std::min(us.size() - 1, static_cast<size_t>(q * us.size()))]; };
+        cout << name << " requests:" << us.size() << ",p50:" << at(0.5) << " us,p99:" << at(0.99)
+             << " us,p999:" << at(0.999) << " us,max:" << us.back() << " us\n";
+    }
+};
+
+//在 conns 上轮流发请求, 直到 stop 为true或达到 count 个
+void probe_latency(vector<std::unique_ptr<Connection>>& conns, const http::request<http::empty_body>& req,
+                   const std::atomic_bool& stop, size_t count, Latency& latency)
+{
+    for(size_t i = 0; !stop && i < count; ++i)
+    {
+        Connection& c = *conns[i % conns.size()];
+        auto const t0 = std::chrono::steady_clock::now();
+        write_request(c, req);
+        read_response(c);
+        latency.us.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+    }
+}
+
+string sha256_digest(const string& data)
+{
+    unsigned char md[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(data.data()), data.size(), md);
+    string b64(boost::beast::detail::base64::encoded_size(sizeof(md)), '\0');
+    b64.resize(boost::beast::detail::base64::encode(&b64[0], md, sizeof(md)));
+    return "sha-256=" + b64;
+}
+}
+
+int main(int argc, char** argv)
+{
+    if(argc != 7)
+    {
+        std::cerr <<
+                     "Usage: skew_bench <host> <port> <server threads> <target> <uploads> <upload MB>\n" <<
+                     "Example:\n" <<
+                     "skew_bench 127.0.0.1 2180 4 /bench/small.txt 4 64\n";
+        return EXIT_FAILURE;
+    }
+    auto const host = argv[1];
+    auto const port = argv[2];
+    int const threads = std::max(1, atoi(argv[3]));
+    string const target = argv[4];
+    int const uploads = atoi(argv[5]);
+    size_t const upload_size = static_cast<size_t>(atoll(argv[6])) * 1024 * 1024;
+    const size_t BASELINE_REQUESTS = 2000;
+
+    try
+    {
+        boost::asio::io_context ioc;
+        tcp::resolver resolver{ioc};
+        auto const endpoints = resolver.resolve(host, port);
+        auto const req = make_request(host, target);
+
+        //每个网络线程一个测量连接, 第 i 个连接落在第 i 个线程上
+        vector<std::unique_ptr<Connection>> probes;
+        for(int i = 0; i < threads; ++i)
+        {
+            probes.emplace_back(new Connection(ioc));
+            boost::asio::connect(probes.back()->socket, endpoints);
+        }
+        Latency idle;
+        std::atomic_bool stop{false};
+        probe_latency(probes, req, stop, BASELINE_REQUESTS, idle);
+
+        //每个上传连接之后补 threads-1 个空连接, 所有上传都落在同一个线程上
+        vector<std::unique_ptr<Connection>> upload_conns;
+        vector<std::unique_ptr<Connection>> fillers;
+        for(int i = 0; i < uploads; ++i)
+        {
+            upload_conns.emplace_back(new Connection(ioc));
+            boost::asio::connect(upload_conns.back()->socket, endpoints);
+            for(int k = 1; k < threads; ++k)
+            {
+                fillers.emplace_back(new Connection(ioc));
+                boost::asio::connect(fillers.back()->socket, endpoints);
+            }
+        }
+
+        string body(upload_size, '\0');
+        std::mt19937_64 rng(12345);
+        for(size_t i = 0; i + 8 <= body.size(); i += 8)
+        {
+            uint64_t v = rng();
+            memcpy(&body[i], &v, 8);
+        }
+        string const digest = sha256_digest(body);
+
+        std::atomic_int done{0};
+        std::atomic_int failed{0};
+        vector<std::thread> workers;
+        auto const t0 = std::chrono::steady_clock::now();
+        for(int i = 0; i < uploads; ++i)
+        {
+            workers.emplace_back([&, i]() {
+                try
+                {
+                    http::request<http::string_body> up{http::verb::post, "/skew/upload" + to_string(i) + ".bin", 11};
+                    up.set(http::field::host, host);
+                    up.set("Digest", digest);
+                    up.keep_alive(true);
+                    up.body() = body;
+                    up.prepare_payload();
+                    http::write(upload_conns[i]->socket, up);
+                    read_response(*upload_conns[i]);
+                }
+                catch(std::exception const& e)
+                {
+                    std::cerr << "upload failed: " << e.what() << std::endl;
+                    ++failed;
+                }
+                if(++done == uploads)
+                    stop = true;
+            });
+        }
+        Latency loaded;
+        probe_latency(probes, req, stop, SIZE_MAX, loaded);
+        for(std::thread& t : workers)
+            t.join();
+        double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+        cout << "server threads:" << threads << ",uploads:" << uploads << " x " << upload_size / (1024 * 1024)
+             << " MB,failed:" << failed << "\n";
+        idle.print("idle");
+        loaded.print("loaded");
+        cout << "upload throughput:" << uploads * upload_size / (1024.0 * 1024.0) / seconds << " MB/s\n";
+    }
+    catch(std::exception const& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}